@@ -1,7 +1,9 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <sys/mman.h>
 
 #include "mxml.h"
 #include "mxml_int.h"
@@ -23,92 +25,207 @@ ends_with(const char *s, const char *end)
 }
 
 /**
- * Copies/calculates unencoded form of XML.
- * Expands &lt &gt &amp and CDATA.
- * @param out (optional) buffer to copy unencoded data to.
- * @returns number of bytes copied into @a out.
+ * Decodes a numeric character reference into UTF-8.
+ * @param ref the text between "&#" and ";", eg "x41" or "65"
+ * @param out storage for at least 4 bytes
+ * @returns the number of bytes stored in @a out
+ * @retval 0 the reference is malformed or not a valid character
  */
 static size_t
-unencode_xml_into(const struct cursor *init_curs, char *out)
+decode_charref(const char *ref, size_t reflen, char *out)
 {
-	size_t n = 0;
-	struct cursor c = *init_curs;
+	unsigned long cp = 0;
+	int base = 10;
 
-#define OUT(ch) do { if (out) out[n] = (ch); n++; } while (0)
+	if (reflen && (*ref == 'x' || *ref == 'X')) {
+		base = 16;
+		ref++;
+		reflen--;
+	}
+	if (!reflen || reflen > 8)
+		return 0;
+	while (reflen--) {
+		int ch = *ref++;
+		int digit;
+
+		if (ch >= '0' && ch <= '9')
+			digit = ch - '0';
+		else if (base == 16 && ch >= 'a' && ch <= 'f')
+			digit = ch - 'a' + 10;
+		else if (base == 16 && ch >= 'A' && ch <= 'F')
+			digit = ch - 'A' + 10;
+		else
+			return 0;
+		cp = cp * base + digit;
+	}
+	if (cp == 0 || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+		return 0;
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = 0xc0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = 0xe0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3f);
+		out[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3f);
+	out[2] = 0x80 | ((cp >> 6) & 0x3f);
+	out[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
 
-	while (!cursor_is_at_eof(&c)) {
-		char ch = *c.pos++;
-		if (ch == '&' && !cursor_is_at_eof(&c)) {
-			switch (*c.pos) {
-			case 'l': OUT('<'); break; /* &lt; */
-			case 'g': OUT('>'); break; /* &gt; */
-			case 'a': OUT('&'); break; /* &amp; */
-			}
-			cursor_skip_to_ch(&c, ';');
-			if (!cursor_is_at_eof(&c))
-				c.pos++;
-		} else if (ch == '<' && cursor_eatn(&c, "![CDATA[",
-						    strlen("![CDATA[")))
-		{
-			while (!cursor_is_at_eof(&c)) {
-				ch = *c.pos++;
-				if (ch == ']' && cursor_eatn(&c, "]>", 2))
-					break;
-				OUT(ch);
-			}
-		} else if (ch == '<') {
+/**
+ * Decodes one entity reference.
+ * Unknown or malformed entities decode to nothing.
+ * @param ent the text between '&' and ';'
+ * @param out storage for at least 4 bytes
+ * @returns the number of bytes stored in @a out
+ */
+static size_t
+decode_entity(const char *ent, size_t entlen, char *out)
+{
+	if (entlen && *ent == '#')
+		return decode_charref(ent + 1, entlen - 1, out);
+	switch (entlen) {
+	case 2:
+		if (ent[1] != 't')
 			break;
-		} else {
-			OUT(ch);
-		}
+		if (ent[0] == 'l') { *out = '<'; return 1; }
+		if (ent[0] == 'g') { *out = '>'; return 1; }
+		break;
+	case 3:
+		if (memcmp(ent, "amp", 3) == 0) { *out = '&'; return 1; }
+		break;
+	case 4:
+		if (memcmp(ent, "quot", 4) == 0) { *out = '"'; return 1; }
+		if (memcmp(ent, "apos", 4) == 0) { *out = '\''; return 1; }
+		break;
 	}
-	return n;
-#undef OUT
+	return 0;
 }
 
 /**
- * Unencodes XML into a new string.
- * Expands the XML entities, (&lt; &gt; &amp;) and CDATA
- * @returns NUL-terminated string allocated by #buffer_malloc.
- * @retval NULL [ENOMEM] could not allocate memory.
+ * Measures the encoded text that #unencode_xml_into() decodes:
+ * the content up to its first tag, with any CDATA sections.
+ * @returns the length of the text in @a content
  */
-static char *
-unencode_xml(struct mxml *m, const char *content, size_t contentsz)
+size_t
+unencode_xml_span(const char *content, size_t contentsz)
 {
-	size_t retsz = 0;
-	struct cursor c;
-	char *ret;
-
-	c.pos = content;
-	c.end = content + contentsz;
-	retsz = unencode_xml_into(&c, NULL);
-	ret = realloc(m->buffer, retsz + 1);
-	if (!ret)
-		return NULL;
-	m->buffer = ret;
-	m->buffersz = retsz + 1;
-	unencode_xml_into(&c, ret);
-	ret[retsz] = '\0';
-	return ret;
-}
+	const char *p = content;
+	const char *end = content + contentsz;
+	const char *lt;
 
+	while ((lt = memchr(p, '<', end - p))) {
+		const char *cend;
 
-/* Save a little bit of memory with a global empty value string */
-static char value_empty[] = "";
+		if (end - lt < 9 || memcmp(lt, "<![CDATA[", 9) != 0)
+			return lt - content;
+		cend = memmem(lt + 9, end - (lt + 9), "]]>", 3);
+		if (!cend)
+			break;
+		p = cend + 3;
+	}
+	return contentsz;
+}
 
-static char *
-value_strdup(const char *s)
+/**
+ * Unencodes XML into a buffer in a single pass.
+ * Expands entities (&lt; &gt; &amp; &quot; &apos; and numeric
+ * character references) and CDATA sections, stopping at the
+ * first tag. Only the text before that tag is searched.
+ * Runs of plain text are found with #memchr() and copied in bulk.
+ * The decoded form is never longer than the encoded form.
+ * @param out buffer of at least #unencode_xml_span() bytes
+ * @returns number of bytes stored in @a out.
+ */
+size_t
+unencode_xml_into(const char *content, size_t contentsz, char *out)
 {
-	if (!s || !*s)
-		return value_empty;
-	return strdup(s);
+	const char *p = content;
+	const char *end = content + contentsz;
+	char *o = out;
+
+	for (;;) {
+		const char *lt = memchr(p, '<', end - p);
+		const char *textend = lt ? lt : end;
+		const char *amp;
+
+		/* Expand the entities in the text before the tag */
+		while ((amp = memchr(p, '&', textend - p))) {
+			const char *semi;
+
+			memcpy(o, p, amp - p);
+			o += amp - p;
+			p = amp;
+			if (p + 1 == end) {
+				*o++ = *p++; /* a lone '&' at the end */
+				return o - out;
+			}
+			semi = memchr(p + 1, ';', textend - (p + 1));
+			if (!semi)
+				return o - out; /* unterminated entity */
+			o += decode_entity(p + 1, semi - (p + 1), o);
+			p = semi + 1;
+		}
+		memcpy(o, p, textend - p);
+		o += textend - p;
+		p = textend;
+		if (!lt)
+			break;
+
+		if (end - p >= 9 && memcmp(p, "<![CDATA[", 9) == 0) {
+			const char *cdata = p + 9;
+			const char *cend = memmem(cdata, end - cdata, "]]>", 3);
+
+			if (!cend)
+				cend = end;
+			memcpy(o, cdata, cend - cdata);
+			o += cend - cdata;
+			p = cend + 3 < end ? cend + 3 : end;
+		} else
+			break; /* a tag */
+	}
+	return o - out;
 }
 
-static void
-value_free(char *value)
+/**
+ * Unencodes XML into a new string.
+ * Expands the XML entities and CDATA; see #unencode_xml_into().
+ * @returns NUL-terminated string in the handle's private buffer,
+ *          which is grown geometrically and reused between calls.
+ *          It is sized by the text decoded, not the whole content.
+ * @retval NULL [ENOMEM] could not allocate memory.
+ */
+char *
+unencode_xml(struct mxml *m, const char *content, size_t contentsz)
 {
-	if (value != value_empty)
-		free(value);
+	size_t retsz;
+
+	contentsz = unencode_xml_span(content, contentsz);
+	if (m->buffersz < contentsz + 1) {
+		size_t bufsz = m->buffersz ? m->buffersz : 64;
+		char *buf;
+
+		while (bufsz < contentsz + 1)
+			bufsz *= 2;
+		buf = realloc(m->buffer, bufsz);
+		if (!buf)
+			return NULL;
+		m->buffer = buf;
+		m->buffersz = bufsz;
+	}
+	retsz = unencode_xml_into(content, contentsz, m->buffer);
+	m->buffer[retsz] = '\0';
+	return m->buffer;
 }
 
 
@@ -122,14 +239,40 @@ mxml_new(const char *start, size_t size)
 	m->start = start;
 	m->size = size;
 	m->edits = NULL;
+	m->pool = NULL;
+	m->index = NULL;
+	m->lists = NULL;
+	m->nlists = 0;
+	m->listslots = 0;
+	m->listgen = 0;
+	memset(m->listparents, 0, sizeof m->listparents);
+	m->map = NULL;
+	m->mapsz = 0;
 	m->buffer = NULL;
 	m->buffersz = 0;
+	m->prefix = NULL;
+	m->merged = NULL;
+	m->gen = 0;
+	m->watches = NULL;
+	m->nwatches = 0;
 #if HAVE_CACHE
 	cache_init(m);
 #endif
 	return m;
 }
 
+int
+mxml_build_index(struct mxml *m, unsigned int nthreads)
+{
+	struct index *ix = index_build(m->start, m->size, nthreads);
+
+	if (!ix)
+		return -1;
+	index_free(m->index);
+	m->index = ix;
+	return 0;
+}
+
 void
 mxml_free(struct mxml *m)
 {
@@ -139,11 +282,22 @@ mxml_free(struct mxml *m)
 		return;
 	while ((e = m->edits)) {
 		m->edits = e->next;
-		free(e->key);
-		value_free(e->value);
+		free(e->pattern);
+		if (e->ref && !--e->ref->refs) {
+			if (e->ref->free_fn)
+				e->ref->free_fn((void *)e->ref->value);
+			free(e->ref);
+		}
 		free(e);
 	}
+	watch_free_all(m);
+	pool_free(m->pool);
+	index_free(m->index);
+	list_free_all(m);
+	if (m->map)
+		munmap(m->map, m->mapsz);
 	free(m->buffer);
+	free(m->prefix);
 	free(m);
 }
 
@@ -175,35 +329,241 @@ mxml_get(struct mxml *m, const char *key)
 	return unencode_xml(m, content, contentsz);
 }
 
+/* The longest encoded scalar value decoded by find_scalar() */
+#define SCALAR_MAX	64
+
 /**
- * Create a new edit record, inserted at the head
- * of the edit list.
- * @retval NULL [ENOMEM] no memory
+ * Finds a value for parsing, without copying it unless it has
+ * entities or CDATA to expand.
+ * @param buf storage of SCALAR_MAX bytes for an expanded value
+ * @retval NULL [EINVAL] the value needs expanding, and is too long
+ */
+static const char *
+find_scalar(struct mxml *m, const char *key, char *buf, size_t *size_return)
+{
+	const char *content;
+	size_t contentsz;
+
+	content = find_expand_key(m, key, &contentsz);
+	if (!content) {
+		/* Provide a missing list total */
+		if (errno == ENOENT && ends_with(key, "[#]")) {
+			*size_return = 1;
+			return "0";
+		}
+		return NULL;
+	}
+	contentsz = unencode_xml_span(content, contentsz);
+	if (!memchr(content, '&', contentsz) &&
+	    !memchr(content, '<', contentsz))
+	{
+		*size_return = contentsz;
+		return content;
+	}
+	if (contentsz > SCALAR_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	*size_return = unencode_xml_into(content, contentsz, buf);
+	return buf;
+}
+
+int
+mxml_get_uint(struct mxml *m, const char *key, unsigned int *value_return)
+{
+	char buf[SCALAR_MAX];
+	const char *s;
+	size_t sz;
+
+	s = find_scalar(m, key, buf, &sz);
+	if (!s)
+		return -1;
+	return parse_uint(s, sz, value_return);
+}
+
+int
+mxml_get_int64(struct mxml *m, const char *key, int64_t *value_return)
+{
+	char buf[SCALAR_MAX];
+	const char *s;
+	size_t sz;
+
+	s = find_scalar(m, key, buf, &sz);
+	if (!s)
+		return -1;
+	return parse_int64(s, sz, value_return);
+}
+
+int
+mxml_get_bool(struct mxml *m, const char *key, int *value_return)
+{
+	char buf[SCALAR_MAX];
+	const char *s;
+	size_t sz;
+
+	s = find_scalar(m, key, buf, &sz);
+	if (!s)
+		return -1;
+	return parse_bool(s, sz, value_return);
+}
+
+int
+mxml_get_enum(struct mxml *m, const char *key, const char *const *table)
+{
+	char buf[SCALAR_MAX];
+	const char *s;
+	size_t sz;
+	int i;
+
+	s = find_scalar(m, key, buf, &sz);
+	if (!s)
+		return -1;
+	for (i = 0; table[i]; i++)
+		if (strncmp(table[i], s, sz) == 0 && !table[i][sz])
+			return i;
+	errno = EINVAL;
+	return -1;
+}
+
+struct mxml_key *
+mxml_key_compile(struct mxml *m, const char *key)
+{
+	return key_compile(m, key);
+}
+
+void
+mxml_key_free(struct mxml_key *key)
+{
+	free(key);
+}
+
+static const char *
+find_compiled_key(struct mxml *m, const struct mxml_key *key,
+	size_t *size_return)
+{
+	char ekeybuf[KEY_MAX];
+	const char *ekey;
+	int ekeylen;
+
+	ekey = key_resolve(m, key, ekeybuf, &ekeylen);
+	if (!ekey)
+		return NULL;
+	return find_key(m, ekey, ekeylen, size_return);
+}
+
+char *
+mxml_get_key(struct mxml *m, const struct mxml_key *key)
+{
+	const char *content;
+	size_t contentsz;
+
+	content = find_compiled_key(m, key, &contentsz);
+	if (!content) {
+		/* Provide a missing list total */
+		if (errno == ENOENT && key->is_total)
+			return unencode_xml(m, "0", 1);
+		return NULL;
+	}
+	return unencode_xml(m, content, contentsz);
+}
+
+int
+mxml_exists_key(struct mxml *m, const struct mxml_key *key)
+{
+	size_t contentsz;
+
+	return find_compiled_key(m, key, &contentsz) != NULL;
+}
+
+/**
+ * Create a new edit record, whose value is either copied into the
+ * journal pool, or is held by reference.
+ * @param ref (optional) the value to hold instead of copying it
+ * @see edit_new()
  */
 static struct edit *
-edit_new(struct mxml *m, enum edit_op op, const char *ekey, int ekeylen,
-	const char *value)
+edit_new_ref(struct mxml *m, enum edit_op op, const char *ekey, int ekeylen,
+	const char *value, size_t valuelen, struct edit_ref *ref)
 {
-	struct edit *e = calloc(1, sizeof *e);
+	struct edit *e;
+	long keyid;
+
+	if (!m->pool && !(m->pool = pool_new()))
+		return NULL;
+	e = calloc(1, sizeof *e);
 	if (!e)
 		return NULL;
-	e->key = strndup(ekey, ekeylen);
-	if (!e->key) {
+	keyid = pool_intern_key(m->pool, ekey, ekeylen);
+	if (keyid == -1 || !(e->key = pool_key(m->pool, keyid))) {
 		free(e);
 		return NULL;
 	}
-	e->value = value_strdup(value);
+	e->keyid = keyid;
+	e->value = ref ? value : pool_value(m->pool, value, valuelen);
 	if (!e->value) {
-		free(e->key);
 		free(e);
 		return NULL;
 	}
+	e->valuelen = valuelen;
+	e->verbatim = !memchr(e->value, '<', valuelen) &&
+	    !memchr(e->value, '>', valuelen) &&
+	    !memchr(e->value, '&', valuelen);
 	e->op = op;
+	if (op == EDIT_MOVE) {
+		long destid = pool_intern_key(m->pool, value, valuelen);
+
+		if (destid == -1) {
+			free(e);
+			return NULL;
+		}
+		e->destid = destid;
+	}
+	if (watch_reserve(m) == -1) {
+		free(e);
+		return NULL;
+	}
+	if (op == EDIT_DELETE_MATCHING &&
+	    !(e->pattern = pattern_new(e->key, ekeylen)))
+	{
+		free(e);
+		return NULL;
+	}
+	if (ref) {
+		e->ref = ref;
+		ref->refs++;
+	}
 	e->next = m->edits;
 	m->edits = e;
+	m->gen++;
+	list_edited(m, e);
+	watch_edited(m, e);
 	return e;
 }
 
+/**
+ * Create a new edit record, inserted at the head
+ * of the edit list.
+ * @retval NULL [ENOMEM] no memory
+ */
+struct edit *
+edit_new(struct mxml *m, enum edit_op op, const char *ekey, int ekeylen,
+	const char *value)
+{
+	return edit_new_n(m, op, ekey, ekeylen, value ? value : "",
+	    value ? strlen(value) : 0);
+}
+
+/**
+ * Create a new edit record with a counted value.
+ * @see edit_new()
+ */
+struct edit *
+edit_new_n(struct mxml *m, enum edit_op op, const char *ekey, int ekeylen,
+	const char *value, size_t valuelen)
+{
+	return edit_new_ref(m, op, ekey, ekeylen, value, valuelen, NULL);
+}
+
 int
 mxml_delete(struct mxml *m, const char *key)
 {
@@ -305,7 +665,24 @@ mxml_delete(struct mxml *m, const char *key)
 }
 
 int
-mxml_update(struct mxml *m, const char *key, const char *value)
+mxml_delete_matching(struct mxml *m, const char *pattern)
+{
+	int len = strlen(pattern);
+
+	if (len >= KEY_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!edit_new(m, EDIT_DELETE_MATCHING, pattern, len, NULL))
+		return -1;
+	return 0;
+}
+
+/** Updates an existing key with a counted value.
+ *  @see mxml_update() */
+static int
+update_value(struct mxml *m, const char *key, const char *value,
+	size_t valuelen, struct edit_ref *ref)
 {
 	char ekey[KEY_MAX];
 	int ekeylen;
@@ -326,12 +703,19 @@ mxml_update(struct mxml *m, const char *key, const char *value)
 	content = find_key(m, ekey, ekeylen, &contentsz);
 	if (!content)
 		return -1;	/* Must exist to be set */
-	edit = edit_new(m, EDIT_SET, ekey, ekeylen, value);
+	edit = edit_new_ref(m, EDIT_SET, ekey, ekeylen, value, valuelen, ref);
 	if (!edit)
 		return -1;
 	return 0;
 }
 
+int
+mxml_update(struct mxml *m, const char *key, const char *value)
+{
+	return update_value(m, key, value ? value : "",
+	    value ? strlen(value) : 0, NULL);
+}
+
 int
 mxml_exists(struct mxml *m, const char *key)
 {
@@ -340,8 +724,11 @@ mxml_exists(struct mxml *m, const char *key)
 	return find_expand_key(m, key, &contentsz) != NULL;
 }
 
-int
-mxml_append(struct mxml *m, const char *key, const char *value)
+/** Appends a new key with a counted value.
+ *  @see mxml_append() */
+static int
+append_value(struct mxml *m, const char *key, const char *value,
+	size_t valuelen, struct edit_ref *ref)
 {
 	char ekey[KEY_MAX];
 	int ekeylen;
@@ -382,8 +769,7 @@ mxml_append(struct mxml *m, const char *key, const char *value)
 		char etkey[KEY_MAX];	/* "tags.total" */
 		int etkeylen;
 		int bracklen = brackplus - key + 3;
-		const char *tcontent;
-		size_t tcontentsz;
+		int has_total;
 		unsigned int total;
 		char newtotal[UINT_MAX_LEN + 1];
 
@@ -400,24 +786,29 @@ mxml_append(struct mxml *m, const char *key, const char *value)
 			return 0;
 
 		/* Find the existing total, if any */
-		tcontent = find_key(m, etkey, etkeylen, &tcontentsz);
-		if (!tcontent || parse_uint(tcontent, tcontentsz, &total) < 0)
-			total = 0;
+		has_total = list_total(m, etkey, etkeylen, &total);
 
 		/* Add one, and make an edit element to update it */
 		snprintf(newtotal, sizeof newtotal, "%u", total + 1);
-		edit = edit_new(m, tcontent ? EDIT_SET : EDIT_APPEND,
+		edit = edit_new(m, has_total ? EDIT_SET : EDIT_APPEND,
 		    etkey, etkeylen, newtotal);
 
 		free(tkey);
 	}
 
-	edit = edit_new(m, EDIT_APPEND, ekey, ekeylen, value);
+	edit = edit_new_ref(m, EDIT_APPEND, ekey, ekeylen, value, valuelen, ref);
 	if (!edit)
 		return -1;
 	return 0;
 }
 
+int
+mxml_append(struct mxml *m, const char *key, const char *value)
+{
+	return append_value(m, key, value ? value : "",
+	    value ? strlen(value) : 0, NULL);
+}
+
 int
 mxml_set(struct mxml *m, const char *key, const char *value)
 {
@@ -433,6 +824,152 @@ mxml_set(struct mxml *m, const char *key, const char *value)
 	return ret;
 }
 
+int
+mxml_set_nocopy(struct mxml *m, const char *key, const char *value,
+	size_t len, void (*free_fn)(void *value))
+{
+	struct edit_ref *ref = NULL;
+	const struct edit *e;
+	unsigned int refs;
+	int ret;
+
+	/* Edits of the same value share one reference */
+	for (e = m->edits; e && !ref; e = e->next)
+		if (e->ref && e->ref->value == value &&
+		    e->ref->free_fn == free_fn)
+			ref = e->ref;
+	if (!ref) {
+		ref = calloc(1, sizeof *ref);
+		if (!ref) {
+			errno = ENOMEM;
+			return -1;
+		}
+		ref->value = value;
+		ref->free_fn = free_fn;
+	}
+
+	refs = ref->refs;
+	ret = append_value(m, key, value, len, ref);
+	if (ret == -1 && errno == EEXIST)
+		ret = update_value(m, key, value, len, ref);
+	if (ref->refs == refs) {
+		/* No edit took the value; the caller keeps it */
+		if (!ref->refs)
+			free(ref);
+		return -1;
+	}
+	return ret;
+}
+
+int
+mxml_move(struct mxml *m, const char *from, const char *to)
+{
+	char efrom[KEY_MAX];
+	int efromlen;
+	char eto[KEY_MAX];
+	int etolen;
+	const char *dot;
+	const char *content;
+	size_t contentsz;
+	struct edit *edit;
+
+	efromlen = expand_key(m, efrom, sizeof efrom, from);
+	if (efromlen < 0)
+		return -1;
+	etolen = expand_key(m, eto, sizeof eto, to);
+	if (etolen < 0)
+		return -1;
+
+	/* The destination must have a parent, and not be in the subtree */
+	if (!memchr(eto, '.', etolen) ||
+	    (etolen >= efromlen && memcmp(eto, efrom, efromlen) == 0 &&
+	     (etolen == efromlen || eto[efromlen] == '.')))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (!find_key(m, efrom, efromlen, &contentsz))
+		return -1;
+	if (find_key(m, eto, etolen, &contentsz)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	/* Append the destination's missing parents */
+	for (dot = eto; (dot = memchr(dot, '.', etolen - (dot - eto))); dot++)
+	{
+		content = find_key(m, eto, dot - eto, &contentsz);
+		if (!content && !edit_new(m, EDIT_APPEND, eto, dot - eto, NULL))
+			return -1;
+	}
+
+	edit = edit_new(m, EDIT_MOVE, efrom, efromlen, eto);
+	if (!edit)
+		return -1;
+	return 0;
+}
+
+/** Tests that an XML fragment is a sequence of whole elements and text */
+static int
+is_balanced(const char *xml, size_t len)
+{
+	struct cursor c;
+
+	c.pos = xml;
+	c.end = xml + len;
+	cursor_skip_content(&c);
+	while (!cursor_is_at_eof(&c)) {
+		if (cursor_is_at(&c, "</"))
+			return 0; /* unmatched close */
+		cursor_skip_to_ch(&c, '>'); /* Skip over <tag> */
+		if (!cursor_eatch(&c, '>'))
+			return 0;
+		cursor_skip_to_close(&c);
+		if (!cursor_eatn(&c, "</", 2))
+			return 0; /* unclosed */
+		cursor_skip_to_ch(&c, '>'); /* Skip over </tag> */
+		if (!cursor_eatch(&c, '>'))
+			return 0;
+		cursor_skip_content(&c);
+	}
+	return 1;
+}
+
+int
+mxml_replace_subtree(struct mxml *m, const char *key, const char *xml,
+	size_t len)
+{
+	char ekey[KEY_MAX];
+	int ekeylen;
+	const char *dot;
+	size_t contentsz;
+
+	ekeylen = expand_key(m, ekey, sizeof ekey, key);
+	if (ekeylen < 0)
+		return -1;
+	if (!is_balanced(xml, len)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Append the element and its parents if missing */
+	if (!find_key(m, ekey, ekeylen, &contentsz)) {
+		for (dot = ekey; (dot = memchr(dot, '.', ekeylen - (dot - ekey)));
+		     dot++)
+		{
+			if (!find_key(m, ekey, dot - ekey, &contentsz) &&
+			    !edit_new(m, EDIT_APPEND, ekey, dot - ekey, NULL))
+				return -1;
+		}
+		if (!edit_new(m, EDIT_APPEND, ekey, ekeylen, NULL))
+			return -1;
+	}
+
+	if (!edit_new_n(m, EDIT_REPLACE, ekey, ekeylen, xml, len))
+		return -1;
+	return 0;
+}
+
 char *
 mxml_expand_key(struct mxml *m, const char *key)
 {
@@ -443,9 +980,9 @@ mxml_expand_key(struct mxml *m, const char *key)
 
 	first = key;
 	while ((brack = strstr(first, "[$]"))) {
-		const char *content;
-		size_t contentsz;
-		unsigned int total;
+		char etkey[KEY_MAX];
+		int etkeylen;
+		unsigned int total = 0;
 		const char *endbrack = brack + 3;
 		int tkeylen = endbrack - key;
 		char *tkey = strndup(key, tkeylen);
@@ -453,9 +990,9 @@ mxml_expand_key(struct mxml *m, const char *key)
 		if (!tkey)
 			return NULL;
 		tkey[tkeylen - 2] = '#';
-		content = find_expand_key(m, tkey, &contentsz);
-		if (!content || parse_uint(content, contentsz, &total) < 0)
-			total = 0;
+		etkeylen = expand_key(m, etkey, sizeof etkey, tkey);
+		if (etkeylen >= 0)
+			list_total(m, etkey, etkeylen, &total);
 		free(tkey);
 
 		n = snprintf(&m->expandbuf[outlen], sizeof m->expandbuf - outlen,
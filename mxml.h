@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdint.h>
 
 /** Lightweight, in-memory XML parser */
 struct mxml;
@@ -10,7 +11,7 @@ struct mxml;
  *     <li>Does not use "<tag/>"-style empty tags
  *     <li>Does not use attributes
  *     <li>Is encoded in UTF-8 or ASCII
- *     <li>Only uses entities &lt; &amp; &gt;
+ *     <li>Only uses entities &lt; &amp; &gt; &quot; &apos; and &#N;
  *     <li>Only has text in leaf elements
  * </ul>
  * @param xml Pointer to read-only, in-memory XML source.
@@ -20,6 +21,32 @@ struct mxml;
  */
 struct mxml *mxml_new(const char *xml, size_t xml_len);
 
+/**
+ * Opens an XML file.
+ * The file is mapped read-only into memory, and is treated
+ * as for #mxml_new().
+ * Lookups use an index of the file's elements. The index is kept in
+ * a sidecar file named by appending ".mxi" to @a path. The sidecar is
+ * reused while it matches the XML file's device, inode, size,
+ * modification time and checksum; otherwise it is rebuilt and saved.
+ * Failing to save the sidecar is not an error.
+ * @param path the XML file to open
+ * @returns a context structure. Free it with #mxml_free().
+ * @retval NULL the file could not be opened or mapped; see #errno.
+ */
+struct mxml *mxml_open_file(const char *path);
+
+/**
+ * Builds an index of the document's elements, so that lookups
+ * need not scan the document.
+ * Large documents are split into chunks that are scanned concurrently.
+ * This replaces any existing index.
+ * @param nthreads the number of threads to use; 0 uses one per CPU.
+ * @retval 0  success
+ * @retval -1 [ENOMEM] out of memory, or a key was too long
+ */
+int mxml_build_index(struct mxml *m, unsigned int nthreads);
+
 /**
  * Closes the XML file opened by #xml_open().
  * All edits made will be lost
@@ -47,6 +74,47 @@ void mxml_free(struct mxml *m);
  */
 char *mxml_get(struct mxml *m, const char *key);
 
+/**
+ * Gets the unsigned integer value of an element.
+ * The value is parsed where it lies, without being copied.
+ * Leading and trailing whitespace is permitted.
+ * @param key the key to get; see #mxml_get()
+ * @param value_return storage for the value
+ * @retval 0  success
+ * @retval -1 [ENOENT] the key does not exist
+ * @retval -1 [EINVAL] the key was malformed, or the value is not
+ *                     an unsigned integer
+ * @retval -1 [ERANGE] the value is too large
+ */
+int mxml_get_uint(struct mxml *m, const char *key, unsigned int *value_return);
+
+/**
+ * Gets the signed 64-bit integer value of an element.
+ * @see mxml_get_uint()
+ * @retval -1 [ERANGE] the value is out of range
+ */
+int mxml_get_int64(struct mxml *m, const char *key, int64_t *value_return);
+
+/**
+ * Gets the boolean value of an element: "1", "true", "yes" or "on"
+ * give 1, and "0", "false", "no" or "off" give 0, in any case.
+ * @see mxml_get_uint()
+ * @retval -1 [EINVAL] the value is not a boolean
+ */
+int mxml_get_bool(struct mxml *m, const char *key, int *value_return);
+
+/**
+ * Finds the value of an element in a table of strings.
+ * The value is compared where it lies, without being copied.
+ * @param key   the key to get; see #mxml_get()
+ * @param table the strings to compare with, ending with NULL
+ * @returns the index of the first string in @a table equal to the value
+ * @retval -1 [ENOENT] the key does not exist
+ * @retval -1 [EINVAL] the key was malformed, or the value is not in
+ *                     @a table
+ */
+int mxml_get_enum(struct mxml *m, const char *key, const char *const *table);
+
 /**
  * Tests if the tag described by the key exists.
  * @retval 0  the key does not exist
@@ -55,6 +123,46 @@ char *mxml_get(struct mxml *m, const char *key);
  */
 int mxml_exists(struct mxml *m, const char *key);
 
+/** A pre-expanded key, for repeated lookups */
+struct mxml_key;
+
+/**
+ * Compiles a key for repeated use with #mxml_get_key().
+ * The key is expanded once. Any "[$]" or "[+]" parts are
+ * resolved each time the compiled key is used.
+ * @param key The search key; see #mxml_get().
+ * @returns a compiled key. Free it with #mxml_key_free().
+ * @retval NULL [EINVAL] the key was malformed
+ * @retval NULL [ENOMEM] the key was too long
+ * @retval NULL [ENOMEM] out of memory
+ */
+struct mxml_key *mxml_key_compile(struct mxml *m, const char *key);
+
+/**
+ * Releases a key compiled by #mxml_key_compile().
+ * @param key (optional) the compiled key. NULL is acceptable.
+ */
+void mxml_key_free(struct mxml_key *key);
+
+/**
+ * Gets the text value of an XML element using a compiled key.
+ * This behaves the same as #mxml_get().
+ * @param key The compiled key from #mxml_key_compile().
+ * @returns pointer to a buffer containing the unescaped content.
+ *          The buffer will be invalidated by the next call to #mxml_get(),
+ *          #mxml_get_key() or #mxml_free().
+ * @retval NULL [ENOENT] the key does not exist
+ * @retval NULL [ENOMEM] not enough memory to copy the value
+ */
+char *mxml_get_key(struct mxml *m, const struct mxml_key *key);
+
+/**
+ * Tests if the tag described by a compiled key exists.
+ * @retval 0  the key does not exist
+ * @retval 1  the key does exist
+ */
+int mxml_exists_key(struct mxml *m, const struct mxml_key *key);
+
 /**
  * Deletes the element (and its children) from the document.
  * @param key the key to delete.
@@ -67,6 +175,19 @@ int mxml_exists(struct mxml *m, const char *key);
  */
 int mxml_delete(struct mxml *m, const char *key);
 
+/**
+ * Deletes every element whose key matches a pattern, and their children.
+ * The pattern is an expanded key that may have "*" and "**" segments,
+ * as for #mxml_query(). It is recorded as a single edit, which also
+ * applies to matching elements in the document that are not yet known.
+ * List totals are not changed.
+ * @param pattern the key pattern, eg "a.users.*.disabled"
+ * @retval 0 success
+ * @retval -1 [EINVAL] the pattern is malformed
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_delete_matching(struct mxml *m, const char *pattern);
+
 /**
  * Updates the text value of an existing element.
  * @retval 0  success
@@ -90,6 +211,62 @@ int mxml_update(struct mxml *m, const char *key, const char *value);
  */
 int mxml_append(struct mxml *m, const char *key, const char *value);
 
+/**
+ * Appends many elements to the end of a list.
+ * This is like calling #mxml_append() for each item's fields using
+ * the key "list[+]", except that the list total is read once and
+ * only updated once, after all the items have been appended.
+ * Nothing is appended if any of the new items' keys already exist.
+ * If memory runs out, some items may have been appended without the
+ * total being updated.
+ * @param list    the list key, eg "a.port" for the list of
+ *                "a.ports.port<N>" elements
+ * @param n       the number of items to append
+ * @param fields  the tag names of each item's child elements
+ * @param nfields the number of @a fields. If 0, each item is a leaf
+ *                element with value @a values[i].
+ * @param values  an array of @a n * @a nfields values, where
+ *                @a values[i * @a nfields + f] is the value of item i's
+ *                field f. A NULL value omits that field.
+ * @retval 0  success
+ * @retval -1 [EEXIST] an item after the list's total already exists
+ * @retval -1 [EINVAL] the list key is malformed
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_list_append_many(struct mxml *m, const char *list, unsigned int n,
+	const char *const *fields, unsigned int nfields,
+	const char *const *values);
+
+/**
+ * Removes an element from the middle of a list, and renumbers the
+ * elements after it so that the list has no hole. The list total,
+ * if present, is decremented.
+ * The removal is a single edit, however long the list; the
+ * renumbering happens as the document is written.
+ * @param list  the list key, eg "a.port"
+ * @param index the number of the element to remove, from 1
+ * @retval 0  success
+ * @retval -1 [EINVAL] the list key or index is malformed
+ * @retval -1 [ENOENT] the element does not exist
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_list_remove(struct mxml *m, const char *list, unsigned int index);
+
+/**
+ * Finds the first item of a list that has a field with a value.
+ * The handle builds an index of the field's values on the first
+ * search, and re-reads only the items edited before later searches.
+ * @param list  the list key, eg "a.user"
+ * @param field the field key relative to each item, eg "name"
+ * @param value the decoded value to find
+ * @returns the index of the item, eg 2 for "a.user[2]"
+ * @retval -1 [ENOENT] no item has the value
+ * @retval -1 [EINVAL] the list or field key is malformed
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_list_find(struct mxml *m, const char *list, const char *field,
+	const char *value);
+
 /**
  * Updates, creates or deletes an element.
  * If the value is NULL, then this function is the same as #mxml_delete().
@@ -103,6 +280,229 @@ int mxml_append(struct mxml *m, const char *key, const char *value);
  */
 int mxml_set(struct mxml *m, const char *key, const char *value);
 
+/**
+ * Sets an element, as if by #mxml_set(), without copying its value.
+ * The journal refers to the caller's buffer, which must stay valid
+ * and unchanged until #mxml_free(), as lookups and writes read it.
+ * Edits that set the same buffer with the same @a free_fn share it,
+ * and @a free_fn is called once, when the last of them is freed.
+ * @param key     the key to set
+ * @param value   the text value, which need not be NUL-terminated
+ * @param len     the length of @a value in bytes
+ * @param free_fn (optional) called with @a value when it is
+ *                no longer needed; it is not called on error
+ * @retval 0  success
+ * @retval -1 [EINVAL] the key is malformed
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_set_nocopy(struct mxml *m, const char *key, const char *value,
+	size_t len, void (*free_fn)(void *value));
+
+/**
+ * Moves an element and its descendants to a new key.
+ * The element becomes the last child of the destination's parent,
+ * which is created if needed. The move is a single edit, however
+ * large the subtree; the subtree is copied as the document is written.
+ * @param from the key of the element to move
+ * @param to   the element's new key
+ * @retval 0  success
+ * @retval -1 [EINVAL] a key is malformed, @a to is a top-level key,
+ *                     or @a to lies under @a from
+ * @retval -1 [ENOENT] @a from does not exist
+ * @retval -1 [EEXIST] @a to already exists
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_move(struct mxml *m, const char *from, const char *to);
+
+/**
+ * Replaces the content of an element with an XML fragment.
+ * The element and its parents are created if needed.
+ * The replacement is a single edit, however large the fragment;
+ * lookups of keys inside the element search the fragment.
+ * @param key  the element whose content is replaced
+ * @param xml  the new content, eg "<a>1</a><b>2</b>", which is copied
+ * @param len  the length of @a xml in bytes
+ * @retval 0  success
+ * @retval -1 [EINVAL] the key is malformed, or the fragment has
+ *                     unbalanced tags
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_replace_subtree(struct mxml *m, const char *key, const char *xml,
+	size_t len);
+
+/**
+ * Finds the raw XML content of an element, without decoding it.
+ * @param key        the element's key
+ * @param len_return storage for the length of the content
+ * @returns pointer to the content, which is not NUL-terminated,
+ *          and remains valid until the handle is freed
+ * @retval NULL [ENOENT] the element does not exist
+ * @retval NULL [EBUSY] edits have been made inside the element, so
+ *                      its content would not show them. This includes
+ *                      an element whose value has been set, and one
+ *                      moved or renumbered by a list removal.
+ * @retval NULL [EINVAL] the key is malformed
+ */
+const char *mxml_get_subtree_span(struct mxml *m, const char *key,
+	size_t *len_return);
+
+/**
+ * Creates a handle over the content of one element, without copying it.
+ * Keys given to the new handle are relative to the element; for
+ * example the sub-document of "config.ports" knows "config.ports.port1"
+ * as "port1". Its edits are its own until merged with #mxml_merge_sub().
+ * The parent must not be freed before the sub-document.
+ * @param key the element's key
+ * @returns a new handle; release it with #mxml_free()
+ * @retval NULL [ENOENT] the element does not exist
+ * @retval NULL [EBUSY] edits have been made inside the element
+ * @retval NULL [EINVAL] the key is malformed
+ * @retval NULL [ENOMEM] out of memory
+ */
+struct mxml *mxml_new_sub(struct mxml *m, const char *key);
+
+/**
+ * Merges a sub-document's edits into its parent's journal.
+ * Only the edits made since the last merge are merged.
+ * @param m   the parent of @a sub
+ * @param sub a handle from #mxml_new_sub()
+ * @retval 0  success
+ * @retval -1 [EINVAL] @a sub is not a sub-document
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_merge_sub(struct mxml *m, struct mxml *sub);
+
+/** A found element, for lookups relative to it */
+struct mxml_node;
+
+/**
+ * Finds an element, for repeated lookups under it.
+ * The node remains usable until the next edit of the document.
+ * @param key the element's key; see #mxml_get()
+ * @returns a new node; release it with #mxml_node_free()
+ * @retval NULL [ENOENT] the element does not exist
+ * @retval NULL [EBUSY] edits have been made inside the element
+ * @retval NULL [EINVAL] the key is malformed
+ * @retval NULL [ENOMEM] out of memory
+ */
+struct mxml_node *mxml_find_node(struct mxml *m, const char *key);
+
+/**
+ * Gets the text value of an element under a node.
+ * Only the node's content is searched.
+ * @param relkey the key relative to the node, eg "name", without
+ *               any "[...]" parts. NULL or "" gets the node's own value.
+ * @returns the unescaped content, as by #mxml_get()
+ * @retval NULL [ENOENT] the key does not exist
+ * @retval NULL [ESTALE] the document has been edited since the node
+ *                       was found
+ * @retval NULL [EINVAL] the key is malformed
+ */
+char *mxml_node_get(struct mxml *m, const struct mxml_node *node,
+	const char *relkey);
+
+/** Returns the expanded key of a node, eg "a.cats.cat7" */
+const char *mxml_node_key(const struct mxml_node *node);
+
+/**
+ * Finds the first child element of a node.
+ * @returns a new node; release it with #mxml_node_free()
+ * @retval NULL [ENOENT] the node has no child elements
+ * @retval NULL [ESTALE] the document has been edited since the node
+ *                       was found
+ * @retval NULL [ENOMEM] out of memory
+ */
+struct mxml_node *mxml_node_first_child(struct mxml *m,
+	const struct mxml_node *node);
+
+/**
+ * Finds the element that follows a node in its parent.
+ * @returns a new node; release it with #mxml_node_free()
+ * @retval NULL [ENOENT] the node is its parent's last child element
+ * @retval NULL [ESTALE] the document has been edited since the node
+ *                       was found
+ * @retval NULL [EBUSY] edits have been made inside the node's parent
+ * @retval NULL [ENOMEM] out of memory
+ */
+struct mxml_node *mxml_node_next_sibling(struct mxml *m,
+	const struct mxml_node *node);
+
+/** Releases a node */
+void mxml_node_free(struct mxml_node *node);
+
+/** A subscription to edits under a key */
+struct mxml_subscription;
+
+/**
+ * Subscribes to the edits of an element and its descendants.
+ * Every journal edit calls the callback, including the parents
+ * and list totals that an edit implies, and edits of the element's
+ * parents. The callback is called after the edit is made, and may
+ * read the document, but must not subscribe or unsubscribe.
+ * @param prefix the element's key; "" subscribes to all edits
+ * @param cb     called with the key edited, the destination of a
+ *               move, or the pattern given to #mxml_delete_matching()
+ * @returns a subscription; it is released by #mxml_unsubscribe()
+ *          or #mxml_free()
+ * @retval NULL [EINVAL] the key is malformed
+ * @retval NULL [ENOMEM] out of memory
+ */
+struct mxml_subscription *mxml_subscribe(struct mxml *m, const char *prefix,
+	void (*cb)(void *context, const char *key), void *context);
+
+/** Cancels and releases a subscription */
+void mxml_unsubscribe(struct mxml *m, struct mxml_subscription *sub);
+
+/**
+ * Tests if the journal holds edits of an element, its descendants
+ * or its parents. Pattern deletes count as edits of the elements
+ * that their literal prefix names.
+ * The cost depends on the depth of the key, not the number of edits.
+ * @param prefix the element's key; "" tests for any edit
+ * @retval 1  the element may have been edited
+ * @retval 0  the element is unedited
+ * @retval -1 [EINVAL] the key is malformed
+ */
+int mxml_is_dirty(struct mxml *m, const char *prefix);
+
+/** A key and value to set; see #mxml_apply_batch() */
+struct mxml_pair {
+	const char *key;
+	const char *value;	/* NULL means to delete */
+};
+
+/**
+ * Sets many keys, as if by #mxml_set() on each pair in order.
+ * Consecutive pairs that set values are applied together: their
+ * existence is found in one pass over the document, and a key set
+ * more than once gets one edit. [$] and [+] count the items added
+ * by earlier pairs. Pairs that delete, use [#] or set a list's total
+ * are applied on their own.
+ * Unlike #mxml_set(), a [+] pair adds one to the list's total even
+ * when an item beyond the total already exists.
+ * If an error occurs, the pairs before the failing one may
+ * have been applied.
+ * @param pairs the keys and values to set
+ * @param n     the number of @a pairs
+ * @retval 0  success
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_apply_batch(struct mxml *m, const struct mxml_pair *pairs,
+	unsigned int n);
+
+/**
+ * Sets keys from "key=value" lines, as written by #mxml_write_pairs().
+ * The escapes "\\" and "\n" in values are converted back.
+ * Empty lines, and lines starting with '#', are ignored.
+ * The pairs are applied with #mxml_apply_batch().
+ * @param text the lines of text
+ * @param len  the length of @a text in bytes
+ * @retval 0  success
+ * @retval -1 [EINVAL] a line has no '='
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_load_pairs(struct mxml *m, const char *text, size_t len);
+
 /**
  * Expands a key containing [$] into its [integer] form.
  * @param key  the tag to expand
@@ -133,6 +533,114 @@ size_t mxml_write(const struct mxml *m,
 	size_t (*writefn)(const void *ptr, size_t size, size_t nmemb, void *context),
 	void *context);
 
+/**
+ * Writes the document and its edits to a stream, using several threads.
+ * The document is partitioned between the children of its root
+ * element, and each partition is flattened concurrently into memory
+ * before being passed to @a writefn in order, from the calling thread.
+ * The output is identical to that of #mxml_write().
+ * Falls back to #mxml_write() when there are too few children of
+ * the root element, or when an edit lies outside them.
+ * @param nthreads the maximum number of threads to use
+ * @param writefn  output callback function, as for #mxml_write()
+ * @param context  Context value passed to @a writefn.
+ * @returns the sum of the returned values from @a writefn.
+ * @retval -1 if @a writefn returned -1
+ * @retval -1 [ENOMEM] could not allocate memory
+ */
+size_t mxml_write_parallel(const struct mxml *m, unsigned int nthreads,
+	size_t (*writefn)(const void *ptr, size_t size, size_t nmemb, void *context),
+	void *context);
+
+/**
+ * Calls a function for each leaf element of the document, with edits.
+ * A leaf is an element with no child elements. Its key is passed in
+ * expanded form, and its value is decoded as by #mxml_get().
+ * The leaves are visited in the same order as #mxml_write() would
+ * emit them, in a single pass over the document.
+ * @param prefix  (optional) only visit this expanded key and those
+ *                under it. NULL or "" visits the whole document.
+ * @param cb      callback function. The key and value strings are only
+ *                valid during the call. If it returns non-zero, the
+ *                iteration stops.
+ * @param context Context value passed to @a cb.
+ * @retval 0  all leaves were visited
+ * @retval -1 [ENOMEM] could not allocate memory
+ * @returns the non-zero value returned by @a cb
+ */
+int mxml_foreach_pair(const struct mxml *m, const char *prefix,
+	int (*cb)(void *context, const char *key, const char *value),
+	void *context);
+
+/**
+ * Counts the child elements of an element.
+ * Only the element's content and the edits of its children are
+ * examined; an indexed document gives the count directly.
+ * @param key the element's key
+ * @returns the number of child elements
+ * @retval -1 [ENOENT] the element does not exist
+ * @retval -1 [EINVAL] the key is malformed
+ * @retval -1 [ENOMEM] out of memory
+ */
+int mxml_count_children(struct mxml *m, const char *key);
+
+/**
+ * Calls a function for a range of the child elements of an element,
+ * in document order. An indexed document finds the range directly.
+ * @param key     the element's key
+ * @param offset  the number of children to pass over
+ * @param limit   the most children to visit
+ * @param cb      callback function, given the child's expanded key,
+ *                which is only valid during the call. If it returns
+ *                non-zero, the visit stops.
+ * @param context Context value passed to @a cb.
+ * @retval 0  the children were visited
+ * @retval -1 [ENOENT] the element does not exist
+ * @retval -1 [EINVAL] the key is malformed
+ * @retval -1 [ENOMEM] out of memory
+ * @returns the non-zero value returned by @a cb
+ */
+int mxml_children(struct mxml *m, const char *key, unsigned int offset,
+	unsigned int limit, int (*cb)(void *context, const char *key),
+	void *context);
+
+/**
+ * Calls a function for each element whose key matches a pattern.
+ * The pattern is an expanded key in which a "*" segment matches any
+ * one tag and a "**" segment matches any number of tags, including
+ * none; eg "a.cats.*.name" or "a.**.name". The document and its edits
+ * are visited in one pass that skips elements which cannot contain
+ * a match.
+ * @param pattern the key pattern
+ * @param cb      callback function, given the element's expanded key
+ *                and its value decoded as by #mxml_get(). The strings
+ *                are only valid during the call. If it returns
+ *                non-zero, the query stops.
+ * @param context Context value passed to @a cb.
+ * @retval 0  all matching elements were visited
+ * @retval -1 [EINVAL] the pattern is malformed
+ * @retval -1 [ENOMEM] could not allocate memory
+ * @returns the non-zero value returned by @a cb
+ */
+int mxml_query(const struct mxml *m, const char *pattern,
+	int (*cb)(void *context, const char *key, const char *value),
+	void *context);
+
+/**
+ * Writes the leaf elements of the document as "key=value" lines.
+ * Backslashes and newlines in values are written as "\\" and "\n".
+ * @param prefix  (optional) only write this expanded key and those
+ *                under it; see #mxml_foreach_pair().
+ * @param writefn output callback function, as for #mxml_write()
+ * @param context Context value passed to @a writefn.
+ * @returns the sum of the returned values from @a writefn.
+ * @retval -1 if @a writefn returned -1
+ * @retval -1 [ENOMEM] could not allocate memory
+ */
+size_t mxml_write_pairs(const struct mxml *m, const char *prefix,
+	size_t (*writefn)(const void *ptr, size_t size, size_t nmemb, void *context),
+	void *context);
+
 /**
  * Extract a list of all the keys in the document.
  * The key list is derived from the XML document and edits, and
@@ -151,3 +659,45 @@ char **mxml_keys(const struct mxml *m, unsigned int *nkeys_return);
  * @param keys (optional) array of keys. NULL is acceptable.
  */
 void mxml_free_keys(char **keys, unsigned int nkeys);
+
+/**
+ * Writes a snapshot of the document, with edits, to a file.
+ * A snapshot holds the flattened XML and a prebuilt index of its
+ * elements, so that #mxml_open_snapshot() can serve lookups without
+ * scanning the document.
+ * The snapshot also records the size and checksum of the XML it
+ * holds, for #mxml_snapshot_matches(). When edits have been made,
+ * that is the output of #mxml_write(), not the source given to
+ * #mxml_new().
+ * The file is written to a unique temporary name and renamed into place.
+ * @param path the snapshot file to write
+ * @retval 0  success
+ * @retval -1 [ENOMEM] out of memory
+ * @retval -1 the file could not be written; see #errno.
+ */
+int mxml_export_snapshot(const struct mxml *m, const char *path);
+
+/**
+ * Opens a snapshot written by #mxml_export_snapshot().
+ * The snapshot is mapped read-only into memory, and its index
+ * is used for all lookups.
+ * Edits may be made as for #mxml_new().
+ * @param path the snapshot file to open
+ * @returns a context structure. Free it with #mxml_free().
+ * @retval NULL [EINVAL] the file is not a valid snapshot
+ *                       or is from an incompatible version
+ * @retval NULL the file could not be opened or mapped; see #errno.
+ */
+struct mxml *mxml_open_snapshot(const char *path);
+
+/**
+ * Tests if an opened snapshot holds exactly some XML source.
+ * Use this to detect a stale snapshot.
+ * @param xml     the XML source
+ * @param xml_len the length of the XML source
+ * @retval 1 the snapshot holds XML of the same size and checksum
+ * @retval 0 the snapshot holds different XML,
+ *           or @a m was not opened by #mxml_open_snapshot().
+ */
+int mxml_snapshot_matches(const struct mxml *m, const char *xml,
+	size_t xml_len);
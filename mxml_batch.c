@@ -0,0 +1,511 @@
+#define _GNU_SOURCE /* qsort_r */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * Batches of key/value pairs are applied as if by #mxml_set() in turn,
+ * but runs of plain sets are applied together:
+ *
+ *  1. Each key in the run is expanded, and it and its parent keys
+ *     are gathered as "probes", sorted so that a key's parents
+ *     precede it ('.' sorts below every other character).
+ *  2. One traversal of the flattened document marks which probes
+ *     already exist.
+ *  3. In the run's order, each existing key gets a SET edit, and each
+ *     new key gets APPENDs for its missing parents and itself. Keys
+ *     set more than once in the run get one edit with the last value.
+ *
+ * Keys with [$] and [+] are resolved as they are gathered, from a table
+ * of the list totals that the run has changed. A [+] set also sets its
+ * list's total, which is applied after the key's parents, as by
+ * #mxml_append(). Unlike #mxml_set(), the total counts a [+] item
+ * even if an item beyond the total already exists.
+ *
+ * Pairs that delete, use [#] or set a total are applied one at a time.
+ */
+
+/* A key (or parent key) referred to by a run of sets */
+struct probe {
+	uint32_t off;		/* Offset of the key in batch.text */
+	uint32_t len;
+	int exists;
+	int seen;		/* A set of this key was seen */
+	const char *value;	/* The last value set */
+};
+
+/* A set within a run */
+struct batch_set {
+	uint32_t off;		/* Offset of the expanded key in batch.text */
+	uint32_t len;
+	const char *value;
+	int first;		/* This is the first set of its key */
+	struct probe *probe;	/* The key's probe */
+	/* A [+] set also sets its list's total */
+	uint32_t totaloff;	/* Offset of "tags.total" in batch.text */
+	uint32_t totallen;	/* 0 when there is no total to set */
+	uint32_t totalvalueoff;	/* Offset of the new total in batch.text */
+	const char *totalvalue;
+	struct probe *totalprobe;
+};
+
+/* The total of a list, as changed by a run; keyed by pool node */
+struct batch_total {
+	uint32_t id;		/* Pool node of "tags.total", plus 1 */
+	unsigned int total;
+};
+
+struct batch {
+	struct mxml *m;
+	char *text;		/* Expanded keys */
+	size_t textlen;
+	size_t textalloc;
+	struct batch_set *sets;
+	unsigned int nsets;
+	struct probe *probes;
+	unsigned int nprobes;
+	struct batch_total *totals; /* Open-addressed */
+	unsigned int ntotalslots;
+	/* The total set by the pair being resolved */
+	int bumped;
+	char bumpkey[KEY_MAX];
+	int bumpkeylen;
+	unsigned int bumptotal;
+	int failed;		/* A total could not be interned */
+};
+
+/* Room for an expanded key, its total key and the total's value */
+#define BATCH_PAIR_MAX	(2 * KEY_MAX + sizeof "4294967295")
+
+/** Tests if a pair must be applied on its own */
+static int
+pair_is_dynamic(const struct mxml_pair *pair)
+{
+	size_t len = strlen(pair->key);
+
+	/* A total set directly would reorder with the run's [+] sets */
+	return !pair->value || strstr(pair->key, "[#]") ||
+	    (len >= 6 && strcmp(pair->key + len - 6, ".total") == 0);
+}
+
+/**
+ * Finds a list's total in the run's table, adding it if missing.
+ * @param isnew_return set to 1 if the list was added
+ * @retval NULL [ENOMEM] the total key could not be interned
+ */
+static struct batch_total *
+batch_total_slot(struct batch *b, const char *totalkey, int totalkeylen,
+	int *isnew_return)
+{
+	struct mxml *m = b->m;
+	uint32_t h;
+	long id;
+
+	if (!m->pool && !(m->pool = pool_new())) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	id = pool_intern_key(m->pool, totalkey, totalkeylen);
+	if (id == -1)
+		return NULL;
+	for (h = id * 0x9e3779b1u; ; h++) {
+		struct batch_total *t = &b->totals[h & (b->ntotalslots - 1)];
+
+		*isnew_return = !t->id;
+		if (!t->id)
+			t->id = id + 1;
+		if (t->id == id + 1)
+			return t;
+	}
+}
+
+/** Gives the total of a list for #key_resolve_fn(), as the run has
+ *  changed it. The first [+] of a key adds one to its list's total. */
+static unsigned int
+batch_total(void *context, const char *totalkey, int totalkeylen, int incr)
+{
+	struct batch *b = context;
+	struct batch_total *t;
+	int isnew;
+
+	t = batch_total_slot(b, totalkey, totalkeylen, &isnew);
+	if (!t) {
+		b->failed = 1;
+		return 0;
+	}
+	if (isnew)
+		list_total(b->m, totalkey, totalkeylen, &t->total);
+	if (!incr)
+		return t->total;
+	if (b->bumped)
+		return t->total + 1;
+	t->total++;
+	b->bumped = 1;
+	memcpy(b->bumpkey, totalkey, totalkeylen);
+	b->bumpkeylen = totalkeylen;
+	b->bumptotal = t->total;
+	return t->total;
+}
+
+/** Compares keys so that "a.b" < "a.b.c" < "a.b-c" */
+static int
+keycmp(const char *a, uint32_t alen, const char *b, uint32_t blen)
+{
+	uint32_t i;
+
+	for (i = 0; i < alen && i < blen; i++) {
+		unsigned char ca = a[i] == '.' ? 0 : a[i];
+		unsigned char cb = b[i] == '.' ? 0 : b[i];
+		if (ca != cb)
+			return ca < cb ? -1 : 1;
+	}
+	return alen < blen ? -1 : alen > blen;
+}
+
+static int
+probe_cmp(const void *a, const void *b, void *text)
+{
+	const struct probe *pa = a;
+	const struct probe *pb = b;
+
+	return keycmp((const char *)text + pa->off, pa->len,
+		      (const char *)text + pb->off, pb->len);
+}
+
+/** Finds a key among the sorted probes */
+static struct probe *
+probe_find(const struct batch *b, const char *key, uint32_t keylen)
+{
+	unsigned int lo = 0, hi = b->nprobes;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		const struct probe *p = &b->probes[mid];
+		int cmp = keycmp(b->text + p->off, p->len, key, keylen);
+
+		if (cmp == 0)
+			return &b->probes[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/** Marks the probes that the document's elements match */
+static size_t
+probe_token(void *context, const struct token *token)
+{
+	struct batch *b = context;
+	struct probe *p;
+
+	if (token->type == TOK_OPEN &&
+	    (p = probe_find(b, token->key, token->keylen)))
+		p->exists = 1;
+	return 0;
+}
+
+/**
+ * Gathers a run of sets and their probes.
+ * @retval -1 [ENOMEM]
+ */
+static int
+batch_gather(struct mxml *m, struct batch *b,
+	const struct mxml_pair *pairs, unsigned int n)
+{
+	unsigned int i, j;
+	unsigned int nprobes = 0;
+
+	b->textlen = 0;
+	b->nsets = 0;
+	b->nprobes = 0;
+	for (i = 0; i < n; i++) {
+		struct batch_set *set = &b->sets[b->nsets];
+		char *key;
+		int len;
+
+		if (b->textlen + BATCH_PAIR_MAX > b->textalloc) {
+			size_t alloc = b->textalloc ? b->textalloc * 2 : 8192;
+			char *text = realloc(b->text, alloc);
+
+			if (!text)
+				return -1;
+			b->text = text;
+			b->textalloc = alloc;
+		}
+		key = b->text + b->textlen;
+		b->bumped = 0;
+		if (strstr(pairs[i].key, "[$]") || strstr(pairs[i].key, "[+]")) {
+			struct mxml_key *k = key_compile(m, pairs[i].key);
+			const char *ekey;
+
+			if (!k)
+				continue; /* ignored, as by mxml_set() */
+			ekey = key_resolve_fn(m, k, key, &len, batch_total, b);
+			free(k);
+			if (b->failed)
+				return -1;
+			if (!ekey)
+				continue;
+			if (ekey != key)
+				memcpy(key, ekey, len);
+		} else {
+			len = expand_key(m, key, KEY_MAX, pairs[i].key);
+			if (len < 0)
+				continue; /* ignored, as by mxml_set() */
+		}
+		set->off = b->textlen;
+		set->len = len;
+		set->value = pairs[i].value;
+		set->totallen = 0;
+		set->totalprobe = NULL;
+		b->textlen += len;
+		b->nsets++;
+		for (j = 0; j < len; j++)
+			if (key[j] == '.')
+				nprobes++;
+		nprobes++;
+
+		if (b->bumped) {
+			/* Keep "tags.total" and its new value */
+			set->totaloff = b->textlen;
+			set->totallen = b->bumpkeylen;
+			memcpy(b->text + b->textlen, b->bumpkey, b->bumpkeylen);
+			b->textlen += b->bumpkeylen;
+			set->totalvalueoff = b->textlen;
+			b->textlen += sprintf(b->text + b->textlen, "%u",
+			    b->bumptotal) + 1;
+			nprobes++;
+		}
+	}
+
+	b->probes = malloc((nprobes ? nprobes : 1) * sizeof *b->probes);
+	if (!b->probes)
+		return -1;
+	for (i = 0; i < b->nsets; i++) {
+		const struct batch_set *set = &b->sets[i];
+		const char *key = b->text + set->off;
+
+		for (j = 0; j <= set->len; j++)
+			if (j == set->len || key[j] == '.') {
+				struct probe *p = &b->probes[b->nprobes++];
+				p->off = set->off;
+				p->len = j;
+				p->exists = 0;
+				p->seen = 0;
+			}
+		if (set->totallen) {
+			struct probe *p = &b->probes[b->nprobes++];
+			p->off = set->totaloff;
+			p->len = set->totallen;
+			p->exists = 0;
+			p->seen = 0;
+		}
+	}
+
+	/* Sort and merge the probes */
+	qsort_r(b->probes, b->nprobes, sizeof *b->probes, probe_cmp, b->text);
+	for (i = j = 0; i < b->nprobes; i++)
+		if (!j || probe_cmp(&b->probes[j - 1], &b->probes[i],
+		    b->text) != 0)
+			b->probes[j++] = b->probes[i];
+	b->nprobes = j;
+
+	/* Find each set's probe; later sets of a key win */
+	for (i = 0; i < b->nsets; i++) {
+		struct batch_set *set = &b->sets[i];
+		struct probe *p = probe_find(b, b->text + set->off, set->len);
+
+		set->probe = p;
+		set->first = !p->seen;
+		p->seen = 1;
+		p->value = set->value;
+		if (set->totallen) {
+			set->totalprobe = probe_find(b,
+			    b->text + set->totaloff, set->totallen);
+			set->totalvalue = b->text + set->totalvalueoff;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Applies a run of plain sets.
+ * @retval -1 [ENOMEM]
+ */
+static int
+batch_apply_run(struct mxml *m, struct batch *b,
+	const struct mxml_pair *pairs, unsigned int n)
+{
+	unsigned int i;
+	unsigned int nslots = 0;
+	int ret = -1;
+
+	/* Each pair refers to at most one list per '[' */
+	for (i = 0; i < n; i++) {
+		const char *s;
+
+		for (s = pairs[i].key; (s = strchr(s, '[')); s++)
+			nslots++;
+	}
+	for (b->ntotalslots = 16; b->ntotalslots < 2 * nslots; )
+		b->ntotalslots *= 2;
+	b->totals = calloc(b->ntotalslots, sizeof *b->totals);
+	if (!b->totals) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (batch_gather(m, b, pairs, n) == -1)
+		goto out;
+	if (flatten_edits(m, probe_token, b) == -1)
+		goto out;
+
+	for (i = 0; i < b->nsets; i++) {
+		const struct batch_set *set = &b->sets[i];
+		const char *key = b->text + set->off;
+		struct probe *parent;
+		const char *dot;
+
+		if (set->first && !set->probe->exists) {
+			/* Append the missing parents, outermost first */
+			for (dot = memchr(key, '.', set->len); dot;
+			     dot = memchr(dot + 1, '.',
+			     set->len - (dot + 1 - key)))
+			{
+				parent = probe_find(b, key, dot - key);
+				if (parent->exists)
+					continue;
+				if (!edit_new(m, EDIT_APPEND, key, dot - key,
+				    NULL))
+					goto out;
+				parent->exists = 1;
+			}
+		}
+		if (set->totallen) {
+			if (!edit_new(m, set->totalprobe->exists ? EDIT_SET :
+			    EDIT_APPEND, b->text + set->totaloff,
+			    set->totallen, set->totalvalue))
+				goto out;
+			set->totalprobe->exists = 1;
+		}
+		if (!set->first)
+			continue;
+		if (!edit_new(m, set->probe->exists ? EDIT_SET : EDIT_APPEND,
+		    key, set->len, set->probe->value))
+			goto out;
+		set->probe->exists = 1;
+	}
+	ret = 0;
+out:
+	free(b->probes);
+	b->probes = NULL;
+	free(b->totals);
+	b->totals = NULL;
+	return ret;
+}
+
+int
+mxml_apply_batch(struct mxml *m, const struct mxml_pair *pairs, unsigned int n)
+{
+	struct batch b;
+	unsigned int i, j;
+	int ret = 0;
+
+	memset(&b, 0, sizeof b);
+	b.m = m;
+	b.sets = malloc((n ? n : 1) * sizeof *b.sets);
+	if (!b.sets)
+		return -1;
+	for (i = 0; i < n && ret == 0; i = j) {
+		if (pair_is_dynamic(&pairs[i])) {
+			ret = mxml_set(m, pairs[i].key, pairs[i].value);
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < n && !pair_is_dynamic(&pairs[j]); j++)
+			;
+		ret = batch_apply_run(m, &b, pairs + i, j - i);
+	}
+	free(b.sets);
+	free(b.text);
+	return ret;
+}
+
+/** Removes the escapes written by #mxml_write_pairs(), in place.
+ *  @returns the new length */
+static size_t
+unescape_pair_value(char *s, size_t len)
+{
+	char *o = s;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] == '\\' && i + 1 < len) {
+			i++;
+			*o++ = s[i] == 'n' ? '\n' : s[i];
+		} else
+			*o++ = s[i];
+	}
+	return o - s;
+}
+
+int
+mxml_load_pairs(struct mxml *m, const char *text, size_t len)
+{
+	struct mxml_pair *pairs = NULL;
+	unsigned int npairs = 0;
+	unsigned int nlines = 1;
+	char *copy;
+	char *line;
+	char *end;
+	size_t i;
+	int ret;
+
+	/* Pairs point into a private, NUL-delimited copy of the text */
+	for (i = 0; i < len; i++)
+		if (text[i] == '\n')
+			nlines++;
+	copy = malloc(len + 1);
+	pairs = malloc(nlines * sizeof *pairs);
+	if (!copy || !pairs) {
+		free(copy);
+		free(pairs);
+		return -1;
+	}
+	memcpy(copy, text, len);
+	copy[len] = '\0';
+
+	for (line = copy; line < copy + len; line = end + 1) {
+		char *eq;
+
+		end = memchr(line, '\n', copy + len - line);
+		if (!end)
+			end = copy + len;
+		*end = '\0';
+		if (!*line || *line == '#')
+			continue; /* blank line or comment */
+		eq = strchr(line, '=');
+		if (!eq) {
+			free(copy);
+			free(pairs);
+			errno = EINVAL;
+			return -1;
+		}
+		*eq = '\0';
+		eq[1 + unescape_pair_value(eq + 1, end - (eq + 1))] = '\0';
+		pairs[npairs].key = line;
+		pairs[npairs].value = eq + 1;
+		npairs++;
+	}
+
+	ret = mxml_apply_batch(m, pairs, npairs);
+	free(copy);
+	free(pairs);
+	return ret;
+}
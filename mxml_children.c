@@ -0,0 +1,247 @@
+#define _GNU_SOURCE /* memrchr */
+#include <string.h>
+#include <errno.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * The children of an element are counted and visited without listing
+ * the document's keys. Depending on the edits that affect them:
+ *
+ *  - none: they are taken from the index, whose entries' children are
+ *    found once, or else by a scan of the element's content;
+ *  - edits of the children: the element alone is flattened with the
+ *    edits under it;
+ *  - edits of the element or its parents, moves, or pattern deletes:
+ *    the whole document is flattened.
+ */
+
+struct children_context {
+	const char *key;	/* The parent */
+	int keylen;
+	unsigned int n;		/* Children seen */
+	unsigned int offset, limit;
+	int counting;		/* All children are to be seen */
+	int done;		/* The children needed have been seen */
+	int (*cb)(void *context, const char *key);
+	void *context;
+	int ret;		/* Non-zero value returned by cb */
+	char child[KEY_MAX + 1];
+};
+
+enum children_edits {
+	CHILDREN_UNEDITED,
+	CHILDREN_EDITED,	/* Edits of the children */
+	CHILDREN_DOC_EDITED	/* Edits that need the whole document */
+};
+
+static enum children_edits
+children_edited(const struct mxml *m, const char *ekey, int ekeylen)
+{
+	enum children_edits ret = CHILDREN_UNEDITED;
+	const struct edit *e;
+
+	for (e = m->edits; e; e = e->next) {
+		int keylen = strlen(e->key);
+
+		if (e->op == EDIT_MOVE || e->op == EDIT_DELETE_MATCHING)
+			return CHILDREN_DOC_EDITED;
+		if (keylen <= ekeylen && memcmp(e->key, ekey, keylen) == 0 &&
+		    (keylen == ekeylen || ekey[keylen] == '.'))
+			return CHILDREN_DOC_EDITED;
+		/* Edits below the children leave them unchanged */
+		if (keylen > ekeylen && memcmp(e->key, ekey, ekeylen) == 0 &&
+		    e->key[ekeylen] == '.' &&
+		    !memchr(e->key + ekeylen + 1, '.', keylen - ekeylen - 1))
+			ret = CHILDREN_EDITED;
+	}
+	return ret;
+}
+
+/**
+ * Visits one child.
+ * @retval 1  no more children need be seen
+ * @retval -1 the callback stopped the visit
+ */
+static int
+children_visit(struct children_context *c, const char *key, int keylen)
+{
+	unsigned int i = c->n++;
+
+	if (i < c->offset || i - c->offset >= c->limit)
+		return !c->counting && i >= c->offset;
+	if (keylen > KEY_MAX) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(c->child, key, keylen);
+	c->child[keylen] = '\0';
+	c->ret = c->cb(c->context, c->child);
+	return c->ret ? -1 : 0;
+}
+
+static size_t
+children_token(void *context, const struct token *token)
+{
+	struct children_context *c = context;
+
+	if (token->type == TOK_OPEN && token->keylen > c->keylen &&
+	    token->key[c->keylen] == '.' &&
+	    memcmp(token->key, c->key, c->keylen) == 0 &&
+	    !memchr(token->key + c->keylen + 1, '.',
+	    token->keylen - c->keylen - 1))
+	{
+		int ret = children_visit(c, token->key, token->keylen);
+
+		if (ret == 1)
+			c->done = 1;
+		return ret ? -1 : 0;
+	}
+	return 0;
+}
+
+/** Visits the children of an unedited element found in the index */
+static int
+children_from_index(struct mxml *m, struct children_context *c)
+{
+	struct index *ix = m->index;
+	const struct index_entry *e;
+	const uint32_t *kids;
+	uint32_t nkids;
+	uint32_t i;
+	int ret;
+
+	e = index_find(ix, c->key, c->keylen);
+	if (!e)
+		return -1;
+	kids = index_children(ix, e - ix->entries, &nkids);
+	if (!kids)
+		return -1;
+	c->n = c->offset < nkids ? c->offset : nkids;
+	for (i = c->n; i < nkids && i - c->offset < c->limit; i++) {
+		const struct index_entry *k = &ix->entries[kids[i]];
+
+		if (k->keyoff > ix->keysz || k->keylen > ix->keysz - k->keyoff) {
+			errno = EINVAL; /* corrupt index */
+			return -1;
+		}
+		if ((ret = children_visit(c, ix->keys + k->keyoff,
+		    k->keylen)))
+			return ret;
+	}
+	c->n = nkids;
+	return 0;
+}
+
+/** Visits the children of an unedited element by scanning it */
+static int
+children_scan(struct children_context *c, const char *span, size_t spansz)
+{
+	char key[KEY_MAX];
+	struct cursor cur;
+	int ret;
+
+	memcpy(key, c->key, c->keylen);
+	key[c->keylen] = '.';
+	cur.pos = span;
+	cur.end = span + spansz;
+	cursor_skip_content(&cur);
+	while (!cursor_is_at_eof(&cur) && !cursor_is_at(&cur, "</")) {
+		const char *tag;
+		int taglen;
+		size_t size;
+
+		cursor_eat_element(&cur, &tag, &taglen, &size);
+		if (c->keylen + 1 + taglen > KEY_MAX) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memcpy(key + c->keylen + 1, tag, taglen);
+		if ((ret = children_visit(c, key, c->keylen + 1 + taglen)))
+			return ret == 1 ? 0 : ret;
+		cursor_skip_content(&cur);
+	}
+	return 0;
+}
+
+/** Flattens an element, whose children have been edited, with the
+ *  edits under it */
+static int
+children_flatten(struct mxml *m, struct children_context *c,
+	const char *span, size_t spansz)
+{
+	const char *start;
+	struct cursor cur;
+
+	/* From the element's <tag> to the end of its </tag> */
+	start = memrchr(m->start, '<', span - m->start);
+	cur.pos = span + spansz;
+	cur.end = m->start + m->size;
+	cursor_skip_to_ch(&cur, '>');
+	cursor_eatch(&cur, '>');
+	return flatten_element(m, start, cur.pos - start, c->key, c->keylen,
+	    children_token, c);
+}
+
+static int
+children(struct mxml *m, struct children_context *c)
+{
+	char ekey[KEY_MAX];
+	int ekeylen;
+	const char *span;
+	size_t spansz;
+	enum children_edits edited;
+	size_t ret;
+
+	ekeylen = expand_key(m, ekey, sizeof ekey, c->key);
+	if (ekeylen < 0)
+		return -1;
+	span = find_key(m, ekey, ekeylen, &spansz);
+	if (!span)
+		return -1;
+	c->key = ekey;
+	c->keylen = ekeylen;
+
+	edited = children_edited(m, ekey, ekeylen);
+	if (edited == CHILDREN_UNEDITED && m->index)
+		return children_from_index(m, c);
+	if (edited == CHILDREN_UNEDITED)
+		return children_scan(c, span, spansz);
+	if (edited == CHILDREN_EDITED)
+		ret = children_flatten(m, c, span, spansz);
+	else
+		ret = flatten_edits(m, children_token, c);
+	return ret == -1 && !c->done ? -1 : 0;
+}
+
+int
+mxml_count_children(struct mxml *m, const char *key)
+{
+	struct children_context c;
+
+	memset(&c, 0, sizeof c);
+	c.key = key;
+	c.counting = 1;
+	if (children(m, &c) == -1)
+		return -1;
+	return c.n;
+}
+
+int
+mxml_children(struct mxml *m, const char *key, unsigned int offset,
+	unsigned int limit, int (*cb)(void *context, const char *key),
+	void *context)
+{
+	struct children_context c;
+
+	memset(&c, 0, sizeof c);
+	c.key = key;
+	c.offset = offset;
+	c.limit = limit;
+	c.cb = cb;
+	c.context = context;
+	if (children(m, &c) == -1 && !c.ret)
+		return -1;
+	return c.ret;
+}
@@ -169,3 +169,33 @@ cursor_skip_to_close(struct cursor *c)
 	}
 }
 
+/**
+ * Advance the cursor over an element.
+ * The cursor must be at the element's "<tag", and is left after its
+ * "</tag>".
+ * @param tag_return    storage for the start of the tag name
+ * @param taglen_return storage for the length of the tag name
+ * @param size_return   storage for the length of the element's content
+ * @returns the start of the element's content
+ */
+const char *
+cursor_eat_element(struct cursor *c, const char **tag_return,
+	int *taglen_return, size_t *size_return)
+{
+	const char *data;
+
+	cursor_eatch(c, '<');
+	*tag_return = c->pos;
+	while (!cursor_is_at_eof(c) && *c->pos != '>' &&
+	       !isspace((unsigned char)*c->pos))
+		c->pos++;
+	*taglen_return = c->pos - *tag_return;
+	cursor_skip_to_ch(c, '>'); /* TODO attributes */
+	cursor_eatch(c, '>');
+	data = c->pos;
+	cursor_skip_to_close(c);
+	*size_return = c->pos - data;
+	cursor_skip_to_ch(c, '>'); /* Skip over </tag> */
+	cursor_eatch(c, '>');
+	return data;
+}
@@ -1,8 +1,10 @@
 #include <string.h>
+#include <strings.h>	/* strncasecmp */
 #include <ctype.h>
 #include <limits.h>
 #include <errno.h>
 #include <stdio.h>	/* snprintf */
+#include <stdlib.h>
 
 #include "mxml_int.h"
 
@@ -47,6 +49,81 @@ inval:
 	return -1;
 }
 
+/**
+ * Parse a signed 64-bit integer, with an optional leading '-' or '+'.
+ * Leading and trailing whitespace is permitted.
+ * @param retval (optional) storage for the returned integer
+ * @retval 0 success
+ * @retval -1 [ERANGE] the integer in @a s was out of range
+ * @retval -1 [EINVAL] the input was not an integer.
+ */
+int
+parse_int64(const char *s, int n, int64_t *retval)
+{
+	uint64_t val = 0;
+	uint64_t max = INT64_MAX;
+	int neg = 0;
+
+	while (n && isspace(*s))
+		n--, s++;
+	if (n && (*s == '-' || *s == '+')) {
+		neg = *s == '-';
+		n--, s++;
+	}
+	if (neg)
+		max = (uint64_t)INT64_MAX + 1;
+	if (!(n && isdigit(*s)))
+		goto inval;
+	while (n && isdigit(*s)) {
+		if (val > (max - (*s - '0')) / 10) {
+			errno = ERANGE;
+			return -1;
+		}
+		val = (val * 10) + (*s - '0');
+		n--, s++;
+	}
+	while (n && isspace(*s))
+		n--, s++;
+	if (n)
+		goto inval;
+	if (retval)
+		*retval = neg ? (int64_t)(0 - val) : (int64_t)val;
+	return 0;
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Parse a boolean: "1", "true", "yes" or "on" for true, and
+ * "0", "false", "no" or "off" for false, in any case.
+ * Leading and trailing whitespace is permitted.
+ * @param retval (optional) storage for the returned 1 or 0
+ * @retval 0 success
+ * @retval -1 [EINVAL] the input was not a boolean.
+ */
+int
+parse_bool(const char *s, int n, int *retval)
+{
+	static const char *const words[] = {
+		"0", "1", "false", "true", "no", "yes", "off", "on"
+	};
+	unsigned int i;
+
+	while (n && isspace(*s))
+		n--, s++;
+	while (n && isspace(s[n - 1]))
+		n--;
+	for (i = 0; i < sizeof words / sizeof words[0]; i++)
+		if (strlen(words[i]) == n && strncasecmp(words[i], s, n) == 0) {
+			if (retval)
+				*retval = i & 1;
+			return 0;
+		}
+	errno = EINVAL;
+	return -1;
+}
+
 /**
  * Expands a user key into a fully-dotted form.
  * For example, "foo.bar[4].baz" expands to "foo.bars.bar4.baz".
@@ -54,16 +131,23 @@ inval:
  *              "foo.bar[$]" expands to "foo.bars.bar<N>"
  *              "foo.bar[+]" expands to "foo.bars.bar<N+1>"
  *		where <N> is the current foo.bars.total value.
+ * When @a holes is non-NULL, the [$] and [+] forms are not resolved.
+ * Instead, their <N> is omitted from @a outbuf and its position
+ * is recorded in the next element of @a holes.
  * @param outbuf   the return buffer for the expanded key
  * @param outbufsz the size of the return buffer
  * @param key   the source key to expand
+ * @param holes (optional) storage for unresolved list references
+ * @param nholes_return (optional) storage for the number of @a holes used
  * @returns length of expanded key in @a outbuf
  * @retval -1 [ENOMEM] if the expanded key exhausted the buffer
  * @retval -1 [EINVAL] the key was malformed
  */
-int
-expand_key(struct mxml *m, char *outbuf, size_t outbufsz, const char *key)
+static int
+expand_key_holes(struct mxml *m, char *outbuf, size_t outbufsz,
+	const char *key, struct keyhole *holes, unsigned int *nholes_return)
 {
+	unsigned int nholes = 0;
 	char * const end = outbuf + outbufsz;
 	char *b = outbuf;
 	const char *tagstart;	/* points into key after last . */
@@ -142,15 +226,20 @@ expand_key(struct mxml *m, char *outbuf, size_t outbufsz, const char *key)
 				/* tag[#] => tags.total */
 				if (key[1] != ']' || key[2] != '\0')
 					goto invalid; /* [#] must be last */
+			} else if (holes) {
+				/* defer resolving "tags.tag<N>" */
+				b = b_save; /* back up to "tags." */
+				holes[nholes].totalat = b - outbuf;
+				for (w = tagstart; *w != '['; w++)
+					OUTB(*w); /* "tags.tag" */
+				holes[nholes].at = b - outbuf;
+				holes[nholes].incr = (*key == '+');
+				nholes++;
 			} else if (*key == '$' || *key == '+') {
 				unsigned int total;
-				size_t totalsz = 0;
-				/* fetch the value for ".tags.total" */
-				const char *totalstr = find_key(m,
-				    outbuf, b - outbuf, &totalsz);
-				/* convert it into a number */
-				if (parse_uint(totalstr, totalsz, &total) < 0)
-					total = 0; /* default to 0 */
+				/* fetch the value for ".tags.total",
+				 * defaulting to 0 */
+				list_total(m, outbuf, b - outbuf, &total);
 				if (*key == '+')
 					total++;
 				b = b_save; /* back up to "tags." */
@@ -171,6 +260,8 @@ expand_key(struct mxml *m, char *outbuf, size_t outbufsz, const char *key)
 	if (tagstart == b)
 		goto invalid;	/* empty or no tag after last . */
 	OUTNUL();
+	if (nholes_return)
+		*nholes_return = nholes;
 	return b - outbuf;
 nomem:
 	errno = ENOMEM;
@@ -185,3 +276,129 @@ invalid:
 #undef OUTB
 }
 
+int
+expand_key(struct mxml *m, char *outbuf, size_t outbufsz, const char *key)
+{
+	return expand_key_holes(m, outbuf, outbufsz, key, NULL, NULL);
+}
+
+/**
+ * Compiles a user key into an expanded key template.
+ * The [$] and [+] forms are left as holes, to be filled in
+ * later by #key_resolve().
+ * @returns a new compiled key; free it with #free().
+ * @retval NULL [ENOMEM] out of memory, or the key was too long
+ * @retval NULL [EINVAL] the key was malformed
+ */
+struct mxml_key *
+key_compile(struct mxml *m, const char *key)
+{
+	char ekey[KEY_MAX];
+	int ekeylen;
+	struct keyhole holes[KEY_MAX / 2];
+	unsigned int nholes = 0;
+	const char *s;
+	struct mxml_key *k;
+
+	/* Each hole expands to at least two chars, "s." */
+	for (s = key; (s = strchr(s, '[')); s++)
+		if (++nholes > KEY_MAX / 2) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	ekeylen = expand_key_holes(m, ekey, sizeof ekey, key,
+		holes, &nholes);
+	if (ekeylen < 0)
+		return NULL;
+	k = malloc(sizeof *k + nholes * sizeof *holes + ekeylen + 1);
+	if (!k)
+		return NULL;
+	memcpy(k->holes, holes, nholes * sizeof *holes);
+	k->nholes = nholes;
+	k->tmpl = (char *)&k->holes[nholes];
+	memcpy(k->tmpl, ekey, ekeylen + 1);
+	k->tmpllen = ekeylen;
+	k->is_total = (s = strrchr(key, '[')) && strcmp(s, "[#]") == 0;
+	return k;
+}
+
+/**
+ * Resolves the holes of a compiled key into an expanded key.
+ * Each hole is filled with the current value of its list's total,
+ * plus one for the [+] form.
+ * @param outbuf storage for the expanded key, at least #KEY_MAX bytes.
+ * @returns the expanded key; either @a outbuf or the key's own template.
+ * @retval NULL [ENOMEM] the expanded key exhausted the buffer
+ */
+const char *
+key_resolve(struct mxml *m, const struct mxml_key *k, char *outbuf,
+	int *len_return)
+{
+	return key_resolve_fn(m, k, outbuf, len_return, NULL, NULL);
+}
+
+/**
+ * Resolves the holes of a compiled key, with the lists' totals
+ * given by a function.
+ * @param total_fn (optional) returns the total of a list, given its
+ *                 total key, "tags.total", and whether the hole is
+ *                 a [+]; by default, #list_total() is used
+ * @see key_resolve()
+ */
+const char *
+key_resolve_fn(struct mxml *m, const struct mxml_key *k, char *outbuf,
+	int *len_return,
+	unsigned int (*total_fn)(void *context, const char *totalkey,
+	    int totalkeylen, int incr),
+	void *context)
+{
+	unsigned int i;
+	int from = 0;		/* template copied so far */
+	int b = 0;		/* output length so far */
+
+	if (!k->nholes) {
+		*len_return = k->tmpllen;
+		return k->tmpl;
+	}
+	for (i = 0; i < k->nholes; i++) {
+		const struct keyhole *h = &k->holes[i];
+		unsigned int total;
+		int totalat;
+		int n;
+
+		/* Copy up to and including "tags.", then use the
+		 * output buffer to form the key "tags.total" */
+		if (b + (h->totalat - from) + 5 >= KEY_MAX)
+			goto nomem;
+		memcpy(outbuf + b, k->tmpl + from, h->totalat - from);
+		b += h->totalat - from;
+		totalat = b;
+		memcpy(outbuf + b, "total", 5);
+		if (total_fn)
+			total = total_fn(context, outbuf, b + 5, h->incr);
+		else {
+			list_total(m, outbuf, b + 5, &total);
+			total += h->incr;
+		}
+
+		/* Replace "total" with "tag<N>" */
+		b = totalat;
+		if (b + (h->at - h->totalat) >= KEY_MAX)
+			goto nomem;
+		memcpy(outbuf + b, k->tmpl + h->totalat, h->at - h->totalat);
+		b += h->at - h->totalat;
+		n = snprintf(outbuf + b, KEY_MAX - b, "%u", total);
+		if (b + n >= KEY_MAX)
+			goto nomem;
+		b += n;
+		from = h->at;
+	}
+	if (b + (k->tmpllen - from) >= KEY_MAX)
+		goto nomem;
+	memcpy(outbuf + b, k->tmpl + from, k->tmpllen - from + 1);
+	*len_return = b + k->tmpllen - from;
+	return outbuf;
+nomem:
+	errno = ENOMEM;
+	return NULL;
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * Opening an XML file maps it, and uses an index of its elements.
+ * The index is persisted in a sidecar file next to the XML file,
+ * so that it need not be rebuilt each time the file is opened:
+ *
+ *     struct sidecar_header
+ *     (serialized index; see mxml_index.c)
+ *
+ * The sidecar records the identity of the XML file it indexes.
+ * If any of those differ, the sidecar is ignored and replaced.
+ */
+
+#define SIDECAR_MAGIC		0x4d584d49	/* "MXMI" */
+#define SIDECAR_VERSION		1
+#define SIDECAR_SUFFIX		".mxi"
+
+struct sidecar_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t filesz;	/* Total size of the sidecar file */
+	uint64_t dev;		/* Identity of the XML file... */
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t sum;		/* #index_checksum() of the XML content */
+	struct index_layout index;
+};
+
+/** Fills in the XML file's identity fields of a sidecar header */
+static void
+sidecar_ident(struct sidecar_header *h, const struct stat *st, uint64_t sum)
+{
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->size = st->st_size;
+	h->mtime_sec = st->st_mtim.tv_sec;
+	h->mtime_nsec = st->st_mtim.tv_nsec;
+	h->sum = sum;
+}
+
+/**
+ * Loads the index from a sidecar file.
+ * @param ipath the sidecar file
+ * @param st    the status of the XML file
+ * @param sum   the checksum of the XML content
+ * @returns the index, which owns the sidecar mapping
+ * @retval NULL the sidecar is missing, invalid or stale
+ */
+static struct index *
+sidecar_load(const char *ipath, const struct stat *st, uint64_t sum)
+{
+	struct sidecar_header want;
+	const struct sidecar_header *h;
+	struct stat ist;
+	struct index *ix;
+	void *map;
+	int fd;
+
+	fd = open(ipath, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &ist) == -1 || ist.st_size < sizeof *h) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	h = map;
+	sidecar_ident(&want, st, sum);
+	if (h->magic != SIDECAR_MAGIC ||
+	    h->version != SIDECAR_VERSION ||
+	    h->filesz != ist.st_size ||
+	    h->dev != want.dev || h->ino != want.ino ||
+	    h->size != want.size ||
+	    h->mtime_sec != want.mtime_sec ||
+	    h->mtime_nsec != want.mtime_nsec ||
+	    h->sum != want.sum ||
+	    !(ix = index_map(map, h->filesz, &h->index)))
+	{
+		munmap(map, ist.st_size);
+		return NULL;
+	}
+	ix->map = map;
+	ix->mapsz = ist.st_size;
+	return ix;
+}
+
+/**
+ * Saves an index to a sidecar file.
+ * The file is written to a unique temporary name and renamed
+ * into place.
+ * @retval 0 success
+ * @retval -1 the sidecar could not be written
+ */
+static int
+sidecar_save(const char *ipath, const struct stat *st, uint64_t sum,
+	const struct index *ix)
+{
+	struct sidecar_header h;
+	char *tmppath;
+	int fd;
+	int failed;
+
+	memset(&h, 0, sizeof h);
+	h.magic = SIDECAR_MAGIC;
+	h.version = SIDECAR_VERSION;
+	sidecar_ident(&h, st, sum);
+	h.filesz = index_layout(ix, sizeof h, &h.index);
+
+	fd = replace_open(ipath, &tmppath);
+	if (fd == -1)
+		return -1;
+	failed = write_all(fd, &h, sizeof h) == -1 ||
+		 index_write(fd, ix, sizeof h) == -1;
+	return replace_commit(fd, tmppath, ipath, failed);
+}
+
+struct mxml *
+mxml_open_file(const char *path)
+{
+	struct stat st;
+	struct mxml *m;
+	void *map = NULL;
+	char *ipath;
+	uint64_t sum;
+	int fd;
+	int saved_errno;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	m = mxml_new(map ? map : "", st.st_size);
+	if (!m) {
+		if (map)
+			munmap(map, st.st_size);
+		return NULL;
+	}
+	m->map = map;
+	m->mapsz = st.st_size;
+
+	/* Use the sidecar index, or rebuild and save it. The index is
+	 * only an accelerator, so failures here are not errors. */
+	saved_errno = errno;
+	ipath = malloc(strlen(path) + sizeof SIDECAR_SUFFIX);
+	if (ipath) {
+		sprintf(ipath, "%s" SIDECAR_SUFFIX, path);
+		sum = index_checksum(m->start, m->size);
+		m->index = sidecar_load(ipath, &st, sum);
+		if (!m->index) {
+			m->index = index_build(m->start, m->size, 0);
+			if (m->index)
+				sidecar_save(ipath, &st, sum, m->index);
+		}
+		free(ipath);
+	}
+	errno = saved_errno;
+	return m;
+}
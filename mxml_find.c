@@ -1,22 +1,79 @@
 #define _GNU_SOURCE /* memrchr */
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 
 #include "mxml_int.h"
 
-/** Tests if key @a child is equal to, or a descendent of @a parent.
- *  That is, is parent equal to, or a prefix of child? */
-static int
-is_key_self_or_child(const char *child, int childlen,
-		     const char *parent, int parentlen)
+/** Finds the first child element with a given tag in some content.
+ *  @param span   the content of the parent element
+ *  @param sz_return storage for the length of the child's content
+ *  @returns pointer to the child's content
+ *  @retval NULL no such child
+ */
+static const char *
+find_child(const char *span, size_t spansz, const char *tag,
+	unsigned int taglen, size_t *sz_return)
 {
-	if (childlen < parentlen)
-		return 0;
-	if (childlen == parentlen)
-		return strncmp(child, parent, childlen) == 0;
-	if (child[parentlen] != '.')
-		return 0;
-	return strncmp(child, parent, parentlen) == 0;
+	struct cursor c;
+	const char *ret;
+
+	c.pos = span;
+	c.end = span + spansz;
+
+	/* Hunt forward for the first opening <tag> or closing </parent> */
+	cursor_skip_content(&c); /* Leaves cursor at eof or '<' */
+	while (!cursor_is_at_eof(&c) && !cursor_is_at(&c, "</")) {
+		/* We found a direct child of the parent */
+		cursor_eatch(&c, '<');
+		if (cursor_eatn(&c, tag, taglen) && /* It starts with "<tag" */
+		    (cursor_is_at(&c, ">") || cursor_eat_white(&c)))
+		{
+			/* We matched "<tag>" or "<tag " */
+			cursor_skip_to_ch(&c, '>'); /* TODO attributes */
+			cursor_eatch(&c, '>');
+			ret = c.pos; /* Content starts after '>' */
+			cursor_skip_to_close(&c); /* cursor is now at </tag> */
+			*sz_return = c.pos - ret;
+			return ret;
+		}
+		/* We found "<othertag" */
+		cursor_skip_to_ch(&c, '>'); /* TODO assumes no attributes */
+		cursor_skip_to_close(&c); /* Skip to matching unmatched </ */
+		/* XXX assumes well-formed xml, ie we are at </othertag> */
+		cursor_skip_to_ch(&c, '>'); /* Skip over </othertag> */
+		cursor_skip_content(&c);
+	}
+	return NULL;	/* No more tags found in the parent */
+}
+
+/** Finds a key relative to some content.
+ *  @param span   the content of an element
+ *  @param relkey a key relative to the element, or "" for the element
+ *  @returns pointer to the content of the relative key's element
+ *  @retval NULL [ENOENT] not found
+ */
+const char *
+find_in_span(const char *span, size_t spansz, const char *relkey,
+	int relkeylen, size_t *sz_return)
+{
+	const char *end = relkey + relkeylen;
+
+	*sz_return = spansz;
+	while (relkey < end) {
+		const char *dot = memchr(relkey, '.', end - relkey);
+		const char *tagend = dot ? dot : end;
+
+		span = find_child(span, spansz, relkey, tagend - relkey,
+		    &spansz);
+		if (!span) {
+			errno = ENOENT;
+			return NULL;
+		}
+		*sz_return = spansz;
+		relkey = dot ? dot + 1 : end;
+	}
+	return span;
 }
 
 /** Finds element key and returns its inner content span.
@@ -32,11 +89,24 @@ find_key_noedit(struct mxml *m, const char *reqkey, int reqkeylen,
 	const char *dot;
 	const char *parent_text;
 	size_t parent_sz;
-	struct cursor c;
 	const char *tag;
 	unsigned int taglen;
 	const char *ret;
 
+	if (m->index) {
+		/* The index holds every element of the document */
+		const struct index_entry *e = index_find(m->index,
+			reqkey, reqkeylen);
+		if (!e)
+			return NULL;
+		if (e->off > m->size || e->size > m->size - e->off) {
+			errno = ENOENT; /* corrupt index */
+			return NULL;
+		}
+		*sz_return = e->size;
+		return m->start + e->off;
+	}
+
 #if HAVE_CACHE
 	/* Search the cache for an exact match */
 	ret = cache_get(m, reqkey, reqkeylen, sz_return);
@@ -55,43 +125,124 @@ find_key_noedit(struct mxml *m, const char *reqkey, int reqkeylen,
 			return NULL;	/* Could not find parent */
 		tag = dot + 1;
 		taglen = reqkeylen - (tag - reqkey);
+
+		/* List elements are found through the list's table */
+		ret = list_element(m, reqkey, dot - reqkey,
+		    parent_text, parent_sz, tag, taglen, sz_return);
+		if (ret || errno != EAGAIN) {
+			if (!ret)
+				errno = ENOENT;
+			return ret;
+		}
 	} else {
 		parent_text = m->start;
 		parent_sz = m->size;
 		tag = reqkey;
 		taglen = reqkeylen;
 	}
-	c.pos = parent_text;
-	c.end = parent_text + parent_sz;
-
-	/* Hunt forward for the first opening <tag> or closing </parent> */
-	cursor_skip_content(&c); /* Leaves cursor at eof or '<' */
-	while (!cursor_is_at_eof(&c) && !cursor_is_at(&c, "</")) {
-		/* We found a direct child of the parent */
-		cursor_eatch(&c, '<');
-		if (cursor_eatn(&c, tag, taglen) && /* It starts with "<tag" */
-		    (cursor_is_at(&c, ">") || cursor_eat_white(&c)))
-		{
-			/* We matched "<tag>" or "<tag " */
-			cursor_skip_to_ch(&c, '>'); /* TODO attributes */
-			cursor_eatch(&c, '>');
-			ret = c.pos; /* Content starts after '>' */
-			cursor_skip_to_close(&c); /* cursor is now at </tag> */
-			*sz_return = c.pos - ret;
+	ret = find_child(parent_text, parent_sz, tag, taglen, sz_return);
+	if (!ret) {
+		errno = ENOENT;
+		return NULL;
+	}
 #if HAVE_CACHE
-			cache_set(m, reqkey, reqkeylen, ret, *sz_return);
+	cache_set(m, reqkey, reqkeylen, ret, *sz_return);
 #endif
-			return ret;
-		}
-		/* We found "<othertag" */
-		cursor_skip_to_ch(&c, '>'); /* TODO assumes no attributes */
-		cursor_skip_to_close(&c); /* Skip to matching unmatched </ */
-		/* XXX assumes well-formed xml, ie we are at </othertag> */
-		cursor_skip_to_ch(&c, '>'); /* Skip over </othertag> */
-		cursor_skip_content(&c);
+	return ret;
+}
+
+/**
+ * Renumbers a key that lies after an element removed from a list,
+ * giving the key the element had before the removal.
+ * @param e      the EDIT_LIST_REMOVE edit
+ * @param reqkey a key under the edit's list container
+ * @param outbuf storage of KEY_MAX bytes for the renumbered key
+ * @param len_return storage for the length of the renumbered key
+ * @returns @a outbuf, or @a reqkey if the key is not renumbered
+ * @retval NULL [ENOENT] the renumbered key is too long to exist
+ */
+static const char *
+list_remove_key(const struct mxml *m, const struct edit *e,
+	const char *reqkey, int reqkeylen, char *outbuf, int *len_return)
+{
+	int clen = m->pool->nodes[e->keyid].keylen;
+	const char *tag = reqkey + clen + 1;
+	const char *dot;
+	int taglen;
+	unsigned int n;
+	int ndigits;
+	int len;
+
+	*len_return = reqkeylen;
+	if (reqkeylen <= clen + 1)
+		return reqkey;
+	dot = memchr(tag, '.', reqkeylen - (clen + 1));
+	taglen = dot ? dot - tag : reqkeylen - (clen + 1);
+	if (!list_elem_number(reqkey, clen, tag, taglen, &n) ||
+	    n < e->listindex)
+		return reqkey;
+	/* Replace "tag<n>" with "tag<n+1>" */
+	ndigits = snprintf(NULL, 0, "%u", n);
+	len = snprintf(outbuf, KEY_MAX, "%.*s%u%.*s",
+	    (int)(tag + taglen - ndigits - reqkey), reqkey, n + 1,
+	    reqkeylen - (int)(tag + taglen - reqkey), tag + taglen);
+	if (len >= KEY_MAX) {
+		errno = ENOENT; /* No such key can exist */
+		return NULL;
 	}
-	errno = ENOENT;
-	return NULL;	/* No more tags found in the parent */
+	*len_return = len;
+	return outbuf;
+}
+
+/** Tests if a key lies strictly under another */
+static int
+is_under(const char *key, const char *parent, int parentlen)
+{
+	return strncmp(key, parent, parentlen) == 0 && key[parentlen] == '.';
+}
+
+/**
+ * Tests if an element's content span in the document (or in a
+ * replacement fragment) would not show all of its edits.
+ * This includes an element found through a move or a list removal,
+ * whose older edits are under another key, and an element whose
+ * value was set, whose content is the edit's text.
+ * @param ekey the expanded key of the element
+ */
+int
+subtree_is_edited(const struct mxml *m, const char *ekey, int ekeylen)
+{
+	const struct edit *e;
+	int matched;
+	char renumbered[KEY_MAX];
+	int len;
+
+	for (e = m->edits; e; e = e->next) {
+		int is_key = strncmp(e->key, ekey, ekeylen) == 0 &&
+			!e->key[ekeylen];
+
+		if (is_under(e->key, ekey, ekeylen))
+			return 1;
+		if ((e->op == EDIT_SET || e->op == EDIT_APPEND) && is_key)
+			return 1;
+		if (e->op == EDIT_LIST_REMOVE && (is_key ||
+		    (ekeylen > strlen(e->key) &&
+		     is_under(ekey, e->key, strlen(e->key)) &&
+		     list_remove_key(m, e, ekey, ekeylen, renumbered,
+		     &len) != ekey)))
+			return 1;
+		/* ekey may be the prefix of a longer string */
+		if (e->op == EDIT_MOVE && (is_under(e->value, ekey, ekeylen) ||
+		    (ekeylen >= e->valuelen &&
+		     memcmp(ekey, e->value, e->valuelen) == 0 &&
+		     (ekeylen == e->valuelen || ekey[e->valuelen] == '.'))))
+			return 1;
+		if (e->op == EDIT_DELETE_MATCHING &&
+		    pattern_descends(e->pattern,
+		    pattern_walk(e->pattern, ekey, ekeylen, &matched)))
+			return 1;
+	}
+	return 0;
 }
 
 /**
@@ -107,32 +258,115 @@ find_key(struct mxml *m, const char *reqkey, int reqkeylen, size_t *sz_return)
 	const struct edit *e;
 	int implied_by_append = 0;
 	const char *ret;
+	uint32_t path[KEY_MAX + 1];	/* Pool nodes of reqkey's prefixes */
+	unsigned int depth = 0;
+	int complete = 0;
+	char renumbered[2][KEY_MAX];	/* reqkey before moves and removals */
+	unsigned int nrenumbered = 0;
+	int clen;
+	unsigned int ddepth;
+
+	/* Key comparisons are made on the journal pool's nodes.
+	 * path[d] is the node of reqkey's first d tags, and an edit
+	 * key of depth d is a prefix of reqkey iff it is path[d].
+	 * When reqkey is incomplete (not fully in the pool),
+	 * no edit has reqkey or a descendant of it as its key. */
+	if (m->edits)
+		depth = pool_find_path(m->pool, reqkey, reqkeylen,
+		    path, KEY_MAX, &complete);
 
 	/* Look in the most recent edits, first */
 	for (e = m->edits; e; e = e->next) {
+		uint32_t edepth = m->pool->nodes[e->keyid].depth;
+
 		switch (e->op) {
 		case EDIT_DELETE:
-			if (is_key_self_or_child(reqkey, reqkeylen,
-			    e->key, strlen(e->key)))
+			if (edepth ? edepth <= depth && path[edepth] == e->keyid
+				   : complete && !depth)
 			{
 				errno = ENOENT;
 				return NULL;
 			}
 			break;
+		case EDIT_DELETE_MATCHING:
+			if (pattern_match(e->pattern, reqkey, reqkeylen)) {
+				errno = ENOENT;
+				return NULL;
+			}
+			break;
 		case EDIT_APPEND:
 			/* Remember for later the appending of a descendent
 			 * as it implies the creation of a parent */
-			if (is_key_self_or_child(e->key, strlen(e->key),
-			    reqkey, reqkeylen))
+			if (complete && edepth >= depth && (depth || !edepth) &&
+			    pool_ancestor(m->pool, e->keyid, depth) == path[depth])
 				implied_by_append = 1;
 			/* Fallthrough */
 		case EDIT_SET:
-			if (strncmp(e->key, reqkey, reqkeylen) == 0 &&
-			    e->key[reqkeylen] == '\0')
+			if (complete && e->keyid == path[depth]) {
+				*sz_return = e->valuelen;
+				return e->value;
+			}
+			break;
+		case EDIT_MOVE:
+			ddepth = m->pool->nodes[e->destid].depth;
+			if (ddepth <= depth && path[ddepth] == e->destid) {
+				/* Earlier edits and the document knew
+				 * the destination's subtree at its source */
+				char *out = renumbered[nrenumbered++ % 2];
+				int destlen = m->pool->nodes[e->destid].keylen;
+				int keylen = strlen(e->key);
+
+				if (keylen + reqkeylen - destlen >= KEY_MAX) {
+					errno = ENOENT;
+					return NULL;
+				}
+				memcpy(out, e->key, keylen);
+				memmove(out + keylen, reqkey + destlen,
+				    reqkeylen - destlen);
+				reqkey = out;
+				reqkeylen = keylen + reqkeylen - destlen;
+				depth = pool_find_path(m->pool, reqkey,
+				    reqkeylen, path, KEY_MAX, &complete);
+			} else if (edepth <= depth && path[edepth] == e->keyid) {
+				errno = ENOENT; /* Moved away */
+				return NULL;
+			}
+			break;
+		case EDIT_REPLACE:
+			if (edepth > depth || path[edepth] != e->keyid)
+				break;
+			/* The fragment is all of the element's content */
+			clen = m->pool->nodes[e->keyid].keylen;
+			ret = find_in_span(e->value, e->valuelen,
+			    reqkey + clen + (reqkeylen > clen),
+			    reqkeylen - clen - (reqkeylen > clen), sz_return);
+			if (!ret && implied_by_append) {
+				ret = "";
+				*sz_return = 0;
+			}
+			return ret;
+		case EDIT_LIST_REMOVE:
+			if (edepth > depth || path[edepth] != e->keyid)
+				break;
+			clen = m->pool->nodes[e->keyid].keylen;
+			if (e->valuelen && reqkeylen == clen + 6 &&
+			    memcmp(reqkey + clen, ".total", 6) == 0)
 			{
-				*sz_return = strlen(e->value);
+				*sz_return = e->valuelen;
 				return e->value;
 			}
+			/* Earlier edits and the document knew reqkey
+			 * by its number before the removal */
+			ret = list_remove_key(m, e, reqkey, reqkeylen,
+			    renumbered[nrenumbered % 2], &reqkeylen);
+			if (!ret)
+				return NULL;
+			if (ret != reqkey) {
+				reqkey = ret;
+				nrenumbered++;
+				depth = pool_find_path(m->pool, reqkey,
+				    reqkeylen, path, KEY_MAX, &complete);
+			}
 			break;
 		}
 	}
@@ -35,9 +35,13 @@
  *    the carrier will make it change direction.
  *
  * Tokens come in three types: OPEN, VALUE and CLOSE.
- * A token holds its full tag path context (the dotted tag path) and can be
- * inspected at every level by the edits. Tokens corresponding to
+ * A token refers to its full tag path context (the dotted tag path) and can
+ * be inspected at every level by the edits. Tokens corresponding to
  * the same XML element have the same context string.
+ * Tokens do not copy their path. Tokens from the XML source point into the
+ * source's path stack, which is only changed when the next token is scanned;
+ * by then the carrier has drained and no edit is holding a token.
+ * Tokens made by edits point at the edit's own key.
  *
  * Edit entires can perform several operations on a token carrier:
  *   DELETE: If a descending token matches the path, remove it.
@@ -49,6 +53,21 @@
  *           In the ascending case, when in state 1,2,3 send down the new
  *           VALUE, new CLOSE then finally the original, held CLOSE, each time
  *           advancing the state.
+ *   LIST_REMOVE: Drop descending tokens of the removed list element, and
+ *           send down renumbered copies of the tokens of the elements
+ *           after it. The total is replaced as by SET.
+ *   MOVE:   Before the tokens start moving, the source subtree is captured
+ *           from the XML source, or by flattening the older edits on their
+ *           own if any of them touch it. Descending tokens
+ *           of the source are removed. Like APPEND, the descending CLOSE
+ *           of the destination's parent is held aside while the captured
+ *           tokens are sent down, renamed to the destination.
+ *   REPLACE: Like SET, but after the descending OPEN passes, the tokens
+ *           of the XML fragment are sent down, and any other tokens inside
+ *           the element are dropped.
+ *   DELETE_MATCHING: Like DELETE, but when a descending token's key
+ *           matches the pattern, it and the tokens inside its element
+ *           are removed.
  */
 
 /* An edit entry state union.
@@ -59,6 +78,10 @@ struct editstate {
 		EDIT_KIND_DELETE,
 		EDIT_KIND_SET,
 		EDIT_KIND_APPEND,
+		EDIT_KIND_LIST_REMOVE,
+		EDIT_KIND_MOVE,
+		EDIT_KIND_REPLACE,
+		EDIT_KIND_DELETE_MATCHING,
 		EDIT_KIND_WRITE
 	} kind;
 	const struct edit *edit;
@@ -70,20 +93,22 @@ struct editstate {
 			unsigned int parentlen;
 			const char *value;
 			int valuelen;
+			int escape;
 			enum {
 				APPEND_IDLE,
 				APPEND_SENT_OPEN,
 				APPEND_SENT_VALUE,
 				APPEND_SENT_CLOSE
 			} state;
+			char *tagdata;	/* "</tag>" in the tag arena */
+			unsigned int tagdatalen;
 			struct token *held_token;
 			struct token sent_token;
-			char tagdata[128];
 		} append;
 		struct xmlstate {
 			struct cursor cursor;
 			struct token token;
-			char key[KEY_MAX];
+			char *key;	/* Path stack of KEY_MAX bytes */
 			int keylen;
 			int init;
 		} xml;
@@ -99,6 +124,50 @@ struct editstate {
 			const char *key;
 			unsigned int keylen;
 		} del;
+		struct {
+			const struct pattern *pattern;
+			int dropping;	/* Inside a matching element */
+			unsigned int droplen; /* Length of its key */
+		} match;
+		struct removestate {
+			const char *key;	/* The container, "tags" */
+			unsigned int keylen;
+			unsigned int index;	/* The element removed */
+			int settotal;
+			struct setstate total;	/* Sets "tags.total" */
+			struct token token;	/* A renumbered token */
+			char *keybuf;		/* KEY_MAX+1 bytes in the arena */
+			char *tagbuf;		/* Renumbered tag text */
+			size_t tagbufsz;
+		} remove;
+		struct movestate {
+			const char *from;	/* The source key */
+			unsigned int fromlen;
+			const char *to;		/* The destination key */
+			unsigned int tolen;
+			unsigned int parentlen;	/* Length of to's parent */
+			struct moved_token {	/* The captured subtree */
+				int type;
+				size_t keyoff;	/* Offsets into text[] */
+				int keylen;
+				size_t valueoff;
+				int valuelen;
+				int escape;
+			} *tokens;
+			unsigned int ntokens, tokenalloc;
+			unsigned int next;	/* Next of tokens[] to send */
+			char *text;		/* Keys and values of tokens[] */
+			size_t textlen, textalloc;
+			int borrowed;		/* tokens[] belongs elsewhere */
+			struct token *held_token;
+			struct token sent_token;
+		} move;
+		struct replacestate {
+			const char *key;
+			unsigned int keylen;
+			int sending;		/* Sending the fragment */
+			struct xmlstate fragment;
+		} replace;
 	};
 };
 
@@ -121,30 +190,51 @@ parent_len(const char *key, unsigned int keylen)
 }
 
 /**
- * Creates an edit state array from match m->edits.
+ * Creates an edit state array from some edits.
+ * The array is allocated together with the XML source's path stack
+ * and an arena holding the close tags of appended elements.
+ * @param edits  the edits, most recent first
+ * @param nedits the number of @a edits
+ * @param src    the XML source range to tokenize
  * @param n_return storage for the length of the array returned.
  * @returns new array; caller should #free() it eventually.
  */
 static struct editstate *
-make_editstates(const struct mxml *m, unsigned int *n_return)
+make_editstates(const struct edit *const *edits, unsigned int nedits,
+	const struct flatten_src *src, unsigned int *n_return)
 {
 	unsigned int n = 0;
+	unsigned int i;
 	const struct edit *edit;
 	struct editstate *states, *es;
+	size_t arenasz = 0;
+	char *arena;
 
-	n = 2;
-	for (edit = m->edits; edit; edit = edit->next)
-		n++;
-	states = calloc(n, sizeof *states);
+	if (src->keylen > KEY_MAX)
+		goto nomem;
+	for (i = 0; i < nedits; i++)
+		if (edits[i]->op == EDIT_APPEND)
+			arenasz += strlen(last_tag(edits[i]->key)) +
+				sizeof "</>";
+		else if (edits[i]->op == EDIT_REPLACE)
+			arenasz += KEY_MAX;
+		else if (edits[i]->op == EDIT_LIST_REMOVE)
+			arenasz += KEY_MAX + 1 + strlen(edits[i]->key) +
+				sizeof ".total";
+
+	n = nedits + 2;
+	states = calloc(1, n * sizeof *states + KEY_MAX + arenasz);
 	if (!states)
 		goto nomem;
+	arena = (char *)(states + n) + KEY_MAX;
 
 	/* The bottom of the state list is the output writer */
 	es = states;
 	es->kind = EDIT_KIND_WRITE;
 	es++;
 
-	for (edit = m->edits; edit; edit = edit->next, es++) {
+	for (i = 0; i < nedits; i++, es++) {
+		edit = edits[i];
 		es->edit = edit;
 		switch (edit->op) {
 		case EDIT_DELETE:
@@ -155,11 +245,11 @@ make_editstates(const struct mxml *m, unsigned int *n_return)
 		case EDIT_SET:
 			es->kind = EDIT_KIND_SET;
 			es->set.token.type = TOK_VALUE;
-			strncpy(es->set.token.key, edit->key,
-				sizeof es->set.token.key);
+			es->set.token.key = edit->key;
 			es->set.token.keylen = strlen(edit->key);
 			es->set.token.value = edit->value;
-			es->set.token.valuelen = -1;
+			es->set.token.valuelen = edit->valuelen;
+			es->set.token.escape = !edit->verbatim;
 			break;
 		case EDIT_APPEND:
 			es->kind = EDIT_KIND_APPEND;
@@ -169,29 +259,88 @@ make_editstates(const struct mxml *m, unsigned int *n_return)
 			es->append.parentlen = parent_len(es->append.key,
 			    es->append.keylen);
 			es->append.value = edit->value;
-			es->append.valuelen = -1;
-			if (snprintf(es->append.tagdata,
-			    sizeof es->append.tagdata, "</%s>",
-			    last_tag(edit->key)) >= sizeof es->append.tagdata)
-				goto nomem;
+			es->append.valuelen = edit->valuelen;
+			es->append.escape = !edit->verbatim;
+			es->append.tagdata = arena;
+			es->append.tagdatalen = sprintf(arena, "</%s>",
+			    last_tag(edit->key));
+			arena += es->append.tagdatalen + 1;
+			break;
+		case EDIT_LIST_REMOVE:
+			es->kind = EDIT_KIND_LIST_REMOVE;
+			es->remove.key = edit->key;
+			es->remove.keylen = strlen(edit->key);
+			es->remove.index = edit->listindex;
+			es->remove.keybuf = arena;
+			arena += KEY_MAX + 1;
+			es->remove.settotal = edit->valuelen != 0;
+			es->remove.total.token.type = TOK_VALUE;
+			es->remove.total.token.key = arena;
+			es->remove.total.token.keylen = sprintf(arena,
+			    "%s.total", edit->key);
+			arena += es->remove.total.token.keylen + 1;
+			es->remove.total.token.value = edit->value;
+			es->remove.total.token.valuelen = edit->valuelen;
+			es->remove.total.token.escape = !edit->verbatim;
+			break;
+		case EDIT_REPLACE:
+			es->kind = EDIT_KIND_REPLACE;
+			es->replace.key = edit->key;
+			es->replace.keylen = strlen(edit->key);
+			es->replace.fragment.key = arena;
+			arena += KEY_MAX;
+			break;
+		case EDIT_DELETE_MATCHING:
+			es->kind = EDIT_KIND_DELETE_MATCHING;
+			es->match.pattern = edit->pattern;
+			break;
+		case EDIT_MOVE:
+			es->kind = EDIT_KIND_MOVE;
+			es->move.from = edit->key;
+			es->move.fromlen = strlen(edit->key);
+			es->move.to = edit->value;
+			es->move.tolen = edit->valuelen;
+			es->move.parentlen = parent_len(edit->value,
+			    edit->valuelen);
 			break;
 		}
 	}
 
 	/* The top of the state list is the XML token source */
 	es->kind = EDIT_KIND_XML;
-	es->xml.cursor.pos = m->start;
-	es->xml.cursor.end = m->start + m->size;
+	es->xml.cursor.pos = src->start;
+	es->xml.cursor.end = src->start + src->size;
+	es->xml.key = (char *)(states + n);
+	memcpy(es->xml.key, src->key, src->keylen);
+	es->xml.keylen = src->keylen;
+	es->xml.init = src->keylen != 0; /* already inside an element */
 	es++;
 
 	*n_return = n;
 	return states;
 nomem:
-	free(states);
 	errno = ENOMEM;
 	return NULL;
 }
 
+/** Releases an edit state array and the buffers its states hold */
+static void
+free_editstates(struct editstate *states, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (states[i].kind == EDIT_KIND_LIST_REMOVE)
+			free(states[i].remove.tagbuf);
+		else if (states[i].kind == EDIT_KIND_MOVE &&
+		    !states[i].move.borrowed)
+		{
+			free(states[i].move.tokens);
+			free(states[i].move.text);
+		}
+	free(states);
+}
+
 /**
  * Generates the next token from the XML source.
  * This function advances x->cursor and fills in x->token.
@@ -216,7 +365,7 @@ xml_tokenize(struct xmlstate *x)
 		token->type = TOK_VALUE;
 		cursor_skip_content(c);
 		token->valuelen = c->pos - token->value;
-		memcpy(token->key, x->key, x->keylen);
+		token->key = x->key;
 		token->keylen = x->keylen;
 		x->init = 1;
 		return 0;
@@ -241,7 +390,7 @@ xml_tokenize(struct xmlstate *x)
 
 	if (token->type == TOK_OPEN) {
 		/* Append .tag to x->key */
-		if (x->keylen + 1 + taglen > sizeof x->key) {
+		if (x->keylen + 1 + taglen > KEY_MAX) {
 			errno = ENOMEM;
 			return -1;
 		}
@@ -254,7 +403,7 @@ xml_tokenize(struct xmlstate *x)
 		x->keylen += taglen;
 	}
 
-	memcpy(token->key, x->key, x->keylen);
+	token->key = x->key;
 	token->keylen = x->keylen;
 
 	if (token->type == TOK_CLOSE) {
@@ -344,10 +493,12 @@ process_append(struct appendstate *app, struct token **carrier)
 {
 	struct token *token = *carrier;
 
-	/* Is this the parental CLOSE token that triggers us? */
-	if (token && token->type == TOK_CLOSE &&
+	/* Is this the parental CLOSE token that triggers us?
+	 * Top-level elements are appended at the end of the source. */
+	if (token && ((token->type == TOK_CLOSE &&
 	    app->parentlen == token->keylen &&
-	    memcmp(app->key, token->key, token->keylen) == 0)
+	    memcmp(app->key, token->key, token->keylen) == 0) ||
+	    (token->type == TOK_EOF && !app->parentlen)))
 	{
 		/* It matches. We hold the </parent> CLOSE token
 		 * in our private state; then we send our own
@@ -358,10 +509,11 @@ process_append(struct appendstate *app, struct token **carrier)
 		app->held_token = token;
 		app->tagdata[1] = '<';
 		newtok->type = TOK_OPEN;
-		memcpy(app->sent_token.key, app->key,
-		    app->sent_token.keylen = app->keylen);
+		newtok->key = app->key;
+		newtok->keylen = app->keylen;
 		newtok->value = &app->tagdata[1];
-		newtok->valuelen = strlen(newtok->value);
+		newtok->valuelen = app->tagdatalen - 1;
+		newtok->escape = 0;
 		*carrier = newtok;
 		app->state = APPEND_SENT_OPEN;
 		return 0;
@@ -381,6 +533,7 @@ process_append(struct appendstate *app, struct token **carrier)
 			token->type = TOK_VALUE;
 			token->value = app->value;
 			token->valuelen = app->valuelen;
+			token->escape = app->escape;
 			app->state = APPEND_SENT_VALUE;
 			return 0;
 		} /* else fallthrough */
@@ -391,7 +544,8 @@ process_append(struct appendstate *app, struct token **carrier)
 		app->tagdata[0] = '<';
 		app->tagdata[1] = '/';
 		token->value = app->tagdata;
-		token->valuelen = strlen(token->value);
+		token->valuelen = app->tagdatalen;
+		token->escape = 0;
 		app->state = APPEND_SENT_CLOSE;
 		return 0;
 	case APPEND_SENT_CLOSE:
@@ -402,6 +556,278 @@ process_append(struct appendstate *app, struct token **carrier)
 	};
 }
 
+/**
+ * Renumbers the text of a list element's tag, eg "<cat5 x>" to "<cat4 x>".
+ * @param n the element's new number
+ * @retval -1 [ENOMEM]
+ */
+static int
+renumber_tag(struct removestate *rm, const struct token *token,
+	const char *tag, int taglen, unsigned int n)
+{
+	const char *v = token->value;
+	int vlen = token->valuelen;
+	int skip = token->type == TOK_CLOSE ? 2 : 1;	/* "</" or "<" */
+	int ndigits = snprintf(NULL, 0, "%u", n + 1);
+	size_t need = vlen + 1;
+
+	rm->token.value = v;
+	rm->token.valuelen = vlen;
+	if (vlen < skip + taglen || memcmp(v + skip, tag, taglen) != 0)
+		return 0; /* Not the tag's text; leave it */
+	if (need > rm->tagbufsz) {
+		char *buf = realloc(rm->tagbuf, need);
+
+		if (!buf) {
+			errno = ENOMEM;
+			return -1;
+		}
+		rm->tagbuf = buf;
+		rm->tagbufsz = need;
+	}
+	rm->token.valuelen = sprintf(rm->tagbuf, "%.*s%u%.*s",
+	    skip + taglen - ndigits, v, n,
+	    vlen - (skip + taglen), v + skip + taglen);
+	rm->token.value = rm->tagbuf;
+	return 0;
+}
+
+/**
+ * Handle the list remove state receiving the token carrier.
+ * Tokens of the removed element are dropped, and the tokens of the
+ * elements after it are replaced with renumbered copies.
+ */
+static size_t
+process_list_remove(struct removestate *rm, struct token **carrier)
+{
+	struct token *token = *carrier;
+	const char *tag;
+	const char *dot;
+	int taglen;
+	unsigned int n;
+	int ndigits;
+
+	if (rm->settotal) {
+		process_set(&rm->total, carrier);
+		if (*carrier != token)
+			return 0;
+	}
+	if (!token || token->type == TOK_EOF ||
+	    token->keylen <= rm->keylen + 1 ||
+	    token->key[rm->keylen] != '.' ||
+	    memcmp(token->key, rm->key, rm->keylen) != 0)
+		return 0;
+
+	tag = token->key + rm->keylen + 1;
+	dot = memchr(tag, '.', token->keylen - (rm->keylen + 1));
+	taglen = dot ? dot - tag : token->keylen - (int)(rm->keylen + 1);
+	if (!list_elem_number(rm->key, rm->keylen, tag, taglen, &n) ||
+	    n < rm->index)
+		return 0;
+	if (n == rm->index) {
+		*carrier = NULL; /* drop */
+		return 0;
+	}
+
+	/* Copy the token, replacing "tag<n>" with "tag<n-1>" */
+	rm->token = *token;
+	ndigits = snprintf(NULL, 0, "%u", n);
+	rm->token.keylen = snprintf(rm->keybuf, KEY_MAX + 1, "%.*s%u%.*s",
+	    (int)(tag + taglen - ndigits - token->key), token->key, n - 1,
+	    token->keylen - (int)(tag + taglen - token->key), tag + taglen);
+	rm->token.key = rm->keybuf;
+	if (!dot && token->type != TOK_VALUE && token->value &&
+	    renumber_tag(rm, token, tag, taglen, n - 1) == -1)
+		return -1;
+	*carrier = &rm->token;
+	return 0;
+}
+
+/** Tests if a key is @a prefix, or lies under it */
+static int
+key_is_under(const char *key, unsigned int keylen, const char *prefix,
+	unsigned int prefixlen)
+{
+	return prefixlen <= keylen &&
+		(prefixlen == keylen || key[prefixlen] == '.') &&
+		memcmp(key, prefix, prefixlen) == 0;
+}
+
+/** Appends text to a move's captured text.
+ *  @returns the offset of the text
+ *  @retval -1 [ENOMEM] */
+static size_t
+move_text(struct movestate *mv, const char *s, size_t len)
+{
+	size_t off = mv->textlen;
+
+	if (mv->textlen + len > mv->textalloc) {
+		size_t alloc = mv->textalloc ? mv->textalloc : 1024;
+		char *text;
+
+		while (mv->textlen + len > alloc)
+			alloc *= 2;
+		text = realloc(mv->text, alloc);
+		if (!text) {
+			errno = ENOMEM;
+			return -1;
+		}
+		mv->text = text;
+		mv->textalloc = alloc;
+	}
+	memcpy(mv->text + mv->textlen, s, len);
+	mv->textlen += len;
+	return off;
+}
+
+/**
+ * Captures a token of the source subtree, renamed to the destination.
+ * The source element's own tag text is renamed too.
+ */
+static size_t
+move_capture(void *context, const struct token *token)
+{
+	struct movestate *mv = context;
+	struct moved_token *mt;
+	const char *fromtag = last_tag(mv->from);
+	size_t fromtaglen = strlen(fromtag);
+
+	if (!key_is_under(token->key, token->keylen, mv->from, mv->fromlen))
+		return 0;
+	if (mv->ntokens == mv->tokenalloc) {
+		unsigned int alloc = mv->tokenalloc ? mv->tokenalloc * 2 : 64;
+		struct moved_token *tokens = realloc(mv->tokens,
+		    alloc * sizeof *tokens);
+
+		if (!tokens) {
+			errno = ENOMEM;
+			return -1;
+		}
+		mv->tokens = tokens;
+		mv->tokenalloc = alloc;
+	}
+	mt = &mv->tokens[mv->ntokens];
+	mt->type = token->type;
+	mt->escape = token->escape;
+
+	/* to + the key's remainder after from */
+	mt->keylen = mv->tolen + token->keylen - mv->fromlen;
+	if ((mt->keyoff = move_text(mv, mv->to, mv->tolen)) == -1 ||
+	    move_text(mv, token->key + mv->fromlen,
+	    token->keylen - mv->fromlen) == -1)
+		return -1;
+
+	if (token->keylen == mv->fromlen && token->type != TOK_VALUE) {
+		/* Rename "<from ...>" or "</from>" to the destination's tag */
+		int skip = token->type == TOK_CLOSE ? 2 : 1;
+		const char *totag = last_tag(mv->to);
+		size_t totaglen = mv->tolen - (totag - mv->to);
+
+		if (token->valuelen >= skip + fromtaglen &&
+		    memcmp(token->value + skip, fromtag, fromtaglen) == 0)
+		{
+			mt->valuelen = token->valuelen - fromtaglen + totaglen;
+			if ((mt->valueoff = move_text(mv, token->value, skip))
+			    == -1 || move_text(mv, totag, totaglen) == -1 ||
+			    move_text(mv, token->value + skip + fromtaglen,
+			    token->valuelen - skip - fromtaglen) == -1)
+				return -1;
+			mv->ntokens++;
+			return 0;
+		}
+	}
+	mt->valuelen = token->valuelen;
+	if ((mt->valueoff = move_text(mv, token->value, token->valuelen))
+	    == -1)
+		return -1;
+	mv->ntokens++;
+	return 0;
+}
+
+/**
+ * Handle the move state receiving the token carrier.
+ * This is like APPEND, but sends down the captured subtree.
+ */
+static size_t
+process_move(struct movestate *mv, struct token **carrier)
+{
+	struct token *token = *carrier;
+	const struct moved_token *mt;
+
+	if (token && key_is_under(token->key, token->keylen,
+	    mv->from, mv->fromlen))
+	{
+		*carrier = NULL; /* drop */
+		return 0;
+	}
+	if (token && token->type == TOK_CLOSE && mv->ntokens &&
+	    mv->parentlen == token->keylen &&
+	    memcmp(mv->to, token->key, token->keylen) == 0)
+	{
+		mv->held_token = token;
+		mv->next = 0;
+		token = NULL;
+	}
+	if (token || !mv->held_token)
+		return 0;
+
+	if (mv->next == mv->ntokens) {
+		/* send the held </parent> token */
+		*carrier = mv->held_token;
+		mv->held_token = NULL;
+		return 0;
+	}
+	mt = &mv->tokens[mv->next++];
+	token = &mv->sent_token;
+	token->type = mt->type;
+	token->key = mv->text + mt->keyoff;
+	token->keylen = mt->keylen;
+	token->value = mv->text + mt->valueoff;
+	token->valuelen = mt->valuelen;
+	token->escape = mt->escape;
+	*carrier = token;
+	return 0;
+}
+
+/**
+ * Handle the replace state receiving the token carrier.
+ * After the element's OPEN has passed, each time the carrier returns
+ * it is filled with the fragment's next token.
+ */
+static size_t
+process_replace(struct editstate *s, struct token **carrier)
+{
+	struct replacestate *rp = &s->replace;
+	struct xmlstate *x = &rp->fragment;
+	struct token *token = *carrier;
+
+	if (token && key_is_under(token->key, token->keylen,
+	    rp->key, rp->keylen))
+	{
+		if (token->keylen == rp->keylen && token->type == TOK_OPEN) {
+			/* Start the fragment, inside the element */
+			x->cursor.pos = s->edit->value;
+			x->cursor.end = s->edit->value + s->edit->valuelen;
+			memcpy(x->key, rp->key, rp->keylen);
+			x->keylen = rp->keylen;
+			x->init = 1;
+			rp->sending = 1;
+		} else if (token->keylen > rp->keylen ||
+		    token->type == TOK_VALUE)
+			*carrier = NULL; /* drop the old content */
+		return 0;
+	}
+	if (token || !rp->sending)
+		return 0;
+	if (xml_tokenize(x) == -1)
+		return -1;
+	if (x->token.type == TOK_EOF)
+		rp->sending = 0;
+	else
+		*carrier = &x->token;
+	return 0;
+}
+
 static size_t
 process_token(struct editstate *s, struct token **carrier)
 {
@@ -421,10 +847,34 @@ process_token(struct editstate *s, struct token **carrier)
 		     memcmp(token->key, s->del.key, s->del.keylen) == 0)
 			*carrier = NULL;
 		return 0;
+	case EDIT_KIND_DELETE_MATCHING:
+		if (!token || token->type == TOK_EOF)
+			return 0;
+		if (s->match.dropping) {
+			if (token->type == TOK_CLOSE &&
+			    token->keylen == s->match.droplen)
+				s->match.dropping = 0;
+			*carrier = NULL;
+		} else if (pattern_match(s->match.pattern, token->key,
+		    token->keylen))
+		{
+			if (token->type == TOK_OPEN) {
+				s->match.dropping = 1;
+				s->match.droplen = token->keylen;
+			}
+			*carrier = NULL;
+		}
+		return 0;
 	case EDIT_KIND_SET:
 		return process_set(&s->set, carrier);
 	case EDIT_KIND_APPEND:
 		return process_append(&s->append, carrier);
+	case EDIT_KIND_LIST_REMOVE:
+		return process_list_remove(&s->remove, carrier);
+	case EDIT_KIND_MOVE:
+		return process_move(&s->move, carrier);
+	case EDIT_KIND_REPLACE:
+		return process_replace(s, carrier);
 	case EDIT_KIND_WRITE:
 		if (!token)
 			return 0; /* special initial case */
@@ -438,6 +888,35 @@ process_token(struct editstate *s, struct token **carrier)
 }
 
 
+/**
+ * Collects the edits whose keys lie strictly under a key.
+ * @param key the key, or NULL to collect all the edits
+ * @param n_return storage for the number of edits collected
+ * @returns new array of edits, most recent first; caller should
+ *          #free() it
+ */
+static const struct edit **
+collect_edits(const struct mxml *m, const char *key, int keylen,
+	unsigned int *n_return)
+{
+	const struct edit **edits;
+	const struct edit *edit;
+	unsigned int nedits = 0;
+
+	for (edit = m->edits; edit; edit = edit->next)
+		nedits++;
+	edits = malloc((nedits ? nedits : 1) * sizeof *edits);
+	if (!edits)
+		return NULL;
+	nedits = 0;
+	for (edit = m->edits; edit; edit = edit->next)
+		if (!key || (strncmp(edit->key, key, keylen) == 0 &&
+		    edit->key[keylen] == '.'))
+			edits[nedits++] = edit;
+	*n_return = nedits;
+	return edits;
+}
+
 /**
  * Flatten the edit list and XML source document into a token stream.
  */
@@ -446,16 +925,67 @@ flatten_edits(const struct mxml *m,
 	      size_t (*fn)(void *context, const struct token *token),
 	      void *context)
 {
-	size_t ret = 0;
-	struct editstate *states, *curstate;
-	unsigned int nstates = 0;
-	struct token *token;	/* token carrier */
+	const struct edit **edits;
+	unsigned int nedits;
+	struct flatten_src src;
+	size_t ret;
 
-	/* Compute the edit filter chain */
-	states = make_editstates(m, &nstates);
-	if (!states)
+	edits = collect_edits(m, NULL, 0, &nedits);
+	if (!edits)
 		return -1;
 
+	src.start = m->start;
+	src.size = m->size;
+	src.key = "";
+	src.keylen = 0;
+	ret = flatten_range(edits, nedits, &src, fn, context);
+	free(edits);
+	return ret;
+}
+
+/**
+ * Flatten one element of the XML source with the edits under it.
+ * @param start the element's open tag
+ * @param size  the length of the element, to the end of its close tag
+ * @param key   the element's key
+ */
+size_t
+flatten_element(const struct mxml *m, const char *start, size_t size,
+	const char *key, int keylen,
+	size_t (*fn)(void *context, const struct token *token),
+	void *context)
+{
+	const struct edit **edits;
+	unsigned int nedits;
+	struct flatten_src src;
+	size_t ret;
+
+	edits = collect_edits(m, key, keylen, &nedits);
+	if (!edits)
+		return -1;
+
+	src.start = start;
+	src.size = size;
+	src.key = key;
+	src.keylen = parent_len(key, keylen);
+	ret = flatten_range(edits, nedits, &src, fn, context);
+	free(edits);
+	return ret;
+}
+
+/**
+ * Drives tokens through an edit state chain into its writer.
+ * @param states the chain, from the writer to the XML source
+ */
+static size_t
+run_editstates(struct editstate *states, unsigned int nstates,
+	       size_t (*fn)(void *context, const struct token *token),
+	       void *context)
+{
+	size_t ret = 0;
+	struct editstate *curstate;
+	struct token *token;	/* token carrier */
+
 #ifdef DEBUG
 	fprintf(stderr, "\nmxml_write %u states", nstates);
 #endif
@@ -487,9 +1017,8 @@ flatten_edits(const struct mxml *m,
 			}
 			if (token->value) {
 				fprintf(stderr, " %s" C_END "\"" C_STR,
-				    token->valuelen == -1 ? "(user) " : "");
-				fputesc(stderr, token->value, token->valuelen == -1
-				    ? strlen(token->value) : token->valuelen);
+				    token->escape ? "(user) " : "");
+				fputesc(stderr, token->value, token->valuelen);
 				fprintf(stderr, C_END "\"");
 			}
 		}
@@ -504,17 +1033,19 @@ flatten_edits(const struct mxml *m,
 			    curstate->del.key);
 			break;
 		case EDIT_KIND_SET:
-			fprintf(stderr, "SET " C_KEY "%.*s" C_END "=\"" C_STR "%s" C_END "\"",
+			fprintf(stderr, "SET " C_KEY "%.*s" C_END "=\"" C_STR "%.*s" C_END "\"",
 			    curstate->set.token.keylen,
 			    curstate->set.token.key,
+			    (int)curstate->set.token.valuelen,
 			    curstate->set.token.value);
 			break;
 		case EDIT_KIND_APPEND:
-			fprintf(stderr, "APPEND " C_KEY "%.*s" C_END "|" C_KEY "%.*s" C_END "=\"" C_STR "%s" C_END "\" %s",
+			fprintf(stderr, "APPEND " C_KEY "%.*s" C_END "|" C_KEY "%.*s" C_END "=\"" C_STR "%.*s" C_END "\" %s",
 			    curstate->append.parentlen,
 			    curstate->append.key,
 			    curstate->append.keylen - curstate->append.parentlen,
 			    curstate->append.key + curstate->append.parentlen,
+			    (int)curstate->edit->valuelen,
 			    curstate->edit->value,
 			    curstate->append.state == APPEND_IDLE ? "IDLE" :
 			    curstate->append.state == APPEND_SENT_OPEN ? "SENT_OPEN" :
@@ -522,6 +1053,27 @@ flatten_edits(const struct mxml *m,
 			    curstate->append.state == APPEND_SENT_CLOSE ? "SENT_CLOSE" :
 			    "?");
 			break;
+		case EDIT_KIND_LIST_REMOVE:
+			fprintf(stderr, "LIST_REMOVE " C_KEY "%.*s" C_END " %u",
+			    curstate->remove.keylen,
+			    curstate->remove.key,
+			    curstate->remove.index);
+			break;
+		case EDIT_KIND_REPLACE:
+			fprintf(stderr, "REPLACE " C_KEY "%.*s" C_END "%s",
+			    curstate->replace.keylen, curstate->replace.key,
+			    curstate->replace.sending ? " SENDING" : "");
+			break;
+		case EDIT_KIND_DELETE_MATCHING:
+			fprintf(stderr, "DELETE_MATCHING " C_KEY "%s" C_END,
+			    curstate->match.pattern->text);
+			break;
+		case EDIT_KIND_MOVE:
+			fprintf(stderr, "MOVE " C_KEY "%.*s" C_END " -> "
+			    C_KEY "%.*s" C_END,
+			    curstate->move.fromlen, curstate->move.from,
+			    curstate->move.tolen, curstate->move.to);
+			break;
 		case EDIT_KIND_WRITE:
 			fprintf(stderr, "WRITE"); break;
 		default:
@@ -536,8 +1088,8 @@ flatten_edits(const struct mxml *m,
 		/* Process the token carrier with the current edit entry,
 		 * which may involve output, which we accumulate in ret. */
 		n = process_token(curstate, &token);
-		if (n < 0)
-			return n;
+		if (n == -1)
+			return -1;
 		ret += n;
 
 		/* If the carrier is empty, it floats up to the XML source;
@@ -549,9 +1101,158 @@ flatten_edits(const struct mxml *m,
 		else
 			curstate = NULL; /* Fell off the bottom */
 	}
-	free(states);
 #ifdef DEBUG
 	fprintf(stderr, " EOF: return %zd\n", ret);
 #endif
 	return ret;
 }
+
+/** Tests if an edit may change the subtree at a key */
+static int
+edit_touches(const struct edit *e, const char *key, unsigned int keylen)
+{
+	unsigned int elen;
+
+	if (e->op == EDIT_DELETE_MATCHING)
+		return 1;
+	elen = strlen(e->key);
+	if (key_is_under(key, keylen, e->key, elen) ||
+	    key_is_under(e->key, elen, key, keylen))
+		return 1;
+	return e->op == EDIT_MOVE &&
+	    (key_is_under(key, keylen, e->value, e->valuelen) ||
+	     key_is_under(e->value, e->valuelen, key, keylen));
+}
+
+/**
+ * Captures a move's source subtree by tokenizing only its element
+ * in the XML source.
+ * @retval 0 captured, or the source does not exist
+ * @retval 1 the source is not an element inside @a src
+ * @retval -1 on error
+ */
+static int
+capture_move_span(struct movestate *mv, const struct flatten_src *src)
+{
+	const char *relkey = mv->from;
+	const char *data;
+	size_t size;
+	struct cursor c;
+	struct flatten_src esrc;
+	struct editstate *xs;
+	unsigned int nxs;
+	size_t ret;
+
+	if (src->keylen) {
+		if (mv->fromlen <= src->keylen || !key_is_under(mv->from,
+		    mv->fromlen, src->key, src->keylen))
+			return 1;
+		relkey += src->keylen + 1;
+	}
+	data = find_in_span(src->start, src->size, relkey,
+	    mv->fromlen - (relkey - mv->from), &size);
+	if (!data)
+		return 0;
+
+	/* From "<tag>" to "</tag>" */
+	esrc.start = memrchr(src->start, '<', data - src->start);
+	c.pos = data + size;
+	c.end = src->start + src->size;
+	cursor_skip_to_ch(&c, '>');
+	cursor_eatch(&c, '>');
+	esrc.size = c.pos - esrc.start;
+	esrc.key = mv->from;
+	esrc.keylen = parent_len(mv->from, mv->fromlen);
+
+	xs = make_editstates(NULL, 0, &esrc, &nxs);
+	if (!xs)
+		return -1;
+	ret = run_editstates(xs, nxs, move_capture, mv);
+	free_editstates(xs, nxs);
+	return ret == -1 ? -1 : 0;
+}
+
+/**
+ * Captures the source subtrees of the moves in an edit state chain.
+ * A move whose source no older edit touches is captured from the
+ * XML source's span of the element. Otherwise, the subtree is found
+ * by running the edits older than the move, which reuse the subtrees
+ * already captured for the older moves.
+ * @retval -1 on error
+ */
+static int
+capture_moves(struct editstate *states, const struct edit *const *edits,
+	unsigned int nedits, const struct flatten_src *src)
+{
+	unsigned int i, j;
+
+	for (i = nedits; i-- > 0; ) {
+		struct movestate *mv = &states[1 + i].move;
+		struct editstate *sub;
+		unsigned int nsub;
+		size_t ret;
+
+		if (states[1 + i].kind != EDIT_KIND_MOVE)
+			continue;
+		for (j = i + 1; j < nedits; j++)
+			if (edit_touches(edits[j], mv->from, mv->fromlen))
+				break;
+		if (j == nedits) {
+			int r = capture_move_span(mv, src);
+
+			if (r == -1)
+				return -1;
+			if (r == 0)
+				continue;
+		}
+		sub = make_editstates(edits + i + 1, nedits - i - 1, src,
+		    &nsub);
+		if (!sub)
+			return -1;
+		/* sub[j] is the state of edits[i + j] */
+		for (j = 1; j + 1 < nsub; j++)
+			if (sub[j].kind == EDIT_KIND_MOVE) {
+				const struct movestate *mv =
+					&states[1 + i + j].move;
+				sub[j].move.tokens = mv->tokens;
+				sub[j].move.ntokens = mv->ntokens;
+				sub[j].move.text = mv->text;
+				sub[j].move.borrowed = 1;
+			}
+		ret = run_editstates(sub, nsub, move_capture, mv);
+		free_editstates(sub, nsub);
+		if (ret == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Flatten some edits and a range of the XML source into a token stream.
+ * @param edits  the edits to apply, most recent first
+ * @param nedits the number of @a edits
+ * @param src    the range of XML to tokenize. If it lies within
+ *               an element, then that element's key is given,
+ *               and the range must start at a tag or text.
+ */
+size_t
+flatten_range(const struct edit *const *edits, unsigned int nedits,
+	      const struct flatten_src *src,
+	      size_t (*fn)(void *context, const struct token *token),
+	      void *context)
+{
+	struct editstate *states;
+	unsigned int nstates = 0;
+	size_t ret;
+
+	/* Compute the edit filter chain */
+	states = make_editstates(edits, nedits, src, &nstates);
+	if (!states)
+		return -1;
+	if (capture_moves(states, edits, nedits, src) == -1)
+		ret = -1;
+	else
+		ret = run_editstates(states, nstates, fn, context);
+	free_editstates(states, nstates);
+	return ret;
+}
@@ -0,0 +1,760 @@
+#define _GNU_SOURCE /* memrchr */
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mxml_int.h"
+
+/*
+ * An optional structural index over the XML document.
+ *
+ * The index records the key path and content span of every element
+ * in the base document (edits are not indexed; they are consulted
+ * first by #find_key()). Entries are held in document order, and
+ * a separate order[] array sorts them by key hash for lookup.
+ *
+ * The index arrays are plain, fixed-width data so that they can be
+ * written to a file and used directly from its mapping. A serialized
+ * index is laid out as
+ *
+ *     struct index_entry entries[nentries]   (document order)
+ *     uint32_t order[nentries]               (sorted by hash)
+ *     char keys[keysz]                       (key text heap)
+ *
+ * with each section starting on an 8-byte boundary.
+ */
+
+#define ALIGN8(n)	(((n) + 7) & ~(uint64_t)7)
+
+/** Computes the FNV-1a hash of a key */
+uint32_t
+index_hash(const char *key, int keylen)
+{
+	uint32_t h = 2166136261u;
+
+	while (keylen--) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Computes a 64-bit checksum of some data.
+ * This is FNV-1a applied to 8-byte words, for speed on large files.
+ */
+uint64_t
+index_checksum(const char *data, size_t size)
+{
+	uint64_t h = 14695981039346656037ull;
+	uint64_t w;
+
+	for (; size >= sizeof w; size -= sizeof w, data += sizeof w) {
+		memcpy(&w, data, sizeof w);
+		h ^= w;
+		h *= 1099511628211ull;
+	}
+	while (size--) {
+		h ^= (unsigned char)*data++;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/* A growable array used while building the index */
+struct vec {
+	void *data;
+	size_t len;	/* in elements */
+	size_t alloc;	/* in elements */
+};
+
+/** Ensures room for @a n more elements of size @a elsz in @a v */
+static int
+vec_reserve(struct vec *v, size_t n, size_t elsz)
+{
+	size_t alloc = v->alloc ? v->alloc : 64;
+	void *data;
+
+	if (v->len + n <= v->alloc)
+		return 0;
+	while (v->len + n > alloc)
+		alloc *= 2;
+	data = realloc(v->data, alloc * elsz);
+	if (!data)
+		return -1;
+	v->data = data;
+	v->alloc = alloc;
+	return 0;
+}
+
+/* An (entry hash, entry index) pair for sorting */
+struct hashidx {
+	uint32_t hash;
+	uint32_t idx;
+};
+
+static int
+hashidx_cmp(const void *a, const void *b)
+{
+	const struct hashidx *ha = a, *hb = b;
+
+	if (ha->hash != hb->hash)
+		return ha->hash < hb->hash ? -1 : 1;
+	return ha->idx < hb->idx ? -1 : ha->idx > hb->idx;
+}
+
+/**
+ * Builds the order[] array of an index from its entries.
+ * @retval -1 [ENOMEM] out of memory
+ */
+static int
+index_sort(struct index_entry *entries, uint32_t n, uint32_t *order)
+{
+	struct hashidx *hi;
+	uint32_t i;
+
+	hi = malloc((n ? n : 1) * sizeof *hi);
+	if (!hi)
+		return -1;
+	for (i = 0; i < n; i++) {
+		hi[i].hash = entries[i].hash;
+		hi[i].idx = i;
+	}
+	qsort(hi, n, sizeof *hi, hashidx_cmp);
+	for (i = 0; i < n; i++)
+		order[i] = hi[i].idx;
+	free(hi);
+	return 0;
+}
+
+/*
+ * Building the index happens in three phases:
+ *
+ *  1. The document is split into chunks, which are scanned concurrently
+ *     for OPEN and CLOSE tag events. Each chunk is speculatively started
+ *     at a '<'. Each chunk's scan stops at the first tag at or beyond
+ *     the next chunk's start, and if that isn't exactly where the next
+ *     chunk started (e.g. the split fell inside a comment or CDATA),
+ *     the next chunk is rescanned from where the previous one stopped.
+ *  2. The chunks' depth changes are prefix-summed to find the deepest
+ *     nesting, and then the events are stitched together in order to
+ *     form the entries' key paths and content spans.
+ *  3. The entries' key hashes are computed concurrently, and then sorted.
+ */
+
+#define INDEX_MIN_CHUNK	(256 * 1024)	/* Don't split finer than this */
+
+/* A tag event found by scanning a chunk */
+struct tagevent {
+	uint64_t off;		/* OPEN: content offset; CLOSE: "</" offset */
+	uint64_t tagoff;	/* OPEN: tag name offset */
+	uint32_t taglen;	/* OPEN: tag name length */
+	uint32_t is_close;
+};
+
+/* A chunk of the document being scanned for tag events */
+struct chunk {
+	const char *start;	/* The document */
+	const char *from;	/* Where scanning starts, at a '<' */
+	const char *to;		/* Where the next chunk starts */
+	const char *end;	/* End of the document */
+	const char *stop;	/* Where scanning stopped */
+	struct vec events;
+	int depth;		/* Nesting change over the chunk */
+	int maxdepth;		/* Deepest relative nesting in the chunk */
+	int failed;
+};
+
+/** Scans a chunk for tag events. Sets ch->failed on error. */
+static void
+chunk_scan(struct chunk *ch)
+{
+	struct cursor c;
+
+	c.pos = ch->from;
+	c.end = ch->end;
+	ch->events.len = 0;
+	ch->depth = ch->maxdepth = 0;
+	ch->failed = 0;
+	for (;;) {
+		struct tagevent *ev;
+
+		cursor_skip_content(&c); /* Leaves cursor at eof or '<' */
+		if (cursor_is_at_eof(&c) || c.pos >= ch->to)
+			break;
+		if (vec_reserve(&ch->events, 1, sizeof *ev) == -1) {
+			ch->failed = 1;
+			break;
+		}
+		ev = &((struct tagevent *)ch->events.data)[ch->events.len++];
+		if (cursor_is_at(&c, "</")) {
+			ev->off = c.pos - ch->start;
+			ev->is_close = 1;
+			ch->depth--;
+		} else {
+			const char *tag;
+
+			cursor_eatch(&c, '<');
+			tag = c.pos;
+			while (!cursor_is_at_eof(&c) && *c.pos != '>' &&
+			       !isspace(*c.pos))
+				c.pos++;
+			ev->tagoff = tag - ch->start;
+			ev->taglen = c.pos - tag;
+			ev->is_close = 0;
+			if (++ch->depth > ch->maxdepth)
+				ch->maxdepth = ch->depth;
+		}
+		cursor_skip_to_ch(&c, '>'); /* TODO attributes */
+		cursor_eatch(&c, '>');
+		if (!ev->is_close)
+			ev->off = c.pos - ch->start;
+	}
+	ch->stop = c.pos;
+}
+
+static void *
+chunk_thread(void *arg)
+{
+	chunk_scan(arg);
+	return NULL;
+}
+
+/* A range of entries to hash */
+struct hashjob {
+	struct index_entry *entries;
+	const char *keys;
+	uint32_t from, to;
+};
+
+static void *
+hash_thread(void *arg)
+{
+	struct hashjob *job = arg;
+	uint32_t i;
+
+	for (i = job->from; i < job->to; i++) {
+		struct index_entry *e = &job->entries[i];
+		e->hash = index_hash(job->keys + e->keyoff, e->keylen);
+	}
+	return NULL;
+}
+
+/**
+ * Runs a function over an array of jobs, using a thread for each.
+ * If a thread cannot be started, its job is run in this thread.
+ */
+static void
+run_jobs(void *(*fn)(void *), void *jobs, size_t jobsz, unsigned int n)
+{
+	pthread_t *threads;
+	char *started;
+	unsigned int i;
+
+	threads = malloc(n * sizeof *threads);
+	started = calloc(n, 1);
+	for (i = 0; i < n; i++) {
+		void *job = (char *)jobs + i * jobsz;
+		if (i && threads && started &&
+		    pthread_create(&threads[i], NULL, fn, job) == 0)
+			started[i] = 1;
+		else if (i)
+			fn(job);
+	}
+	fn(jobs);	/* This thread takes the first job */
+	for (i = 1; i < n; i++)
+		if (started && started[i])
+			pthread_join(threads[i], NULL);
+	free(threads);
+	free(started);
+}
+
+/**
+ * Scans an XML document and builds an index of its elements.
+ * @param start the XML document
+ * @param size  the length of the XML document
+ * @param nthreads the number of threads to use; 0 means one per CPU.
+ * @returns a new index; release it with #index_free().
+ * @retval NULL [ENOMEM] out of memory, or a key was too long
+ */
+struct index *
+index_build(const char *start, size_t size, unsigned int nthreads)
+{
+	struct chunk *chunks = NULL;
+	unsigned int nchunks;
+	unsigned int i;
+	char key[KEY_MAX];
+	int keylen = 0;
+	int depth, maxdepth;
+	struct vec entries = { 0 };
+	struct vec keys = { 0 };
+	uint32_t *stack = NULL;		/* of open entry indicies */
+	int sp = 0;
+	int stackmax;
+	struct index *ix = NULL;
+	uint32_t *order = NULL;
+	struct hashjob *hashjobs = NULL;
+
+	if (!nthreads) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? ncpu : 1;
+	}
+	nchunks = size / INDEX_MIN_CHUNK;
+	if (nchunks > nthreads)
+		nchunks = nthreads;
+	if (!nchunks)
+		nchunks = 1;
+
+	/* Phase 1: find the tag events in each chunk */
+	chunks = calloc(nchunks, sizeof *chunks);
+	if (!chunks)
+		goto nomem;
+	for (i = 0; i < nchunks; i++) {
+		const char *from = start + size / nchunks * i;
+		const char *lt;
+
+		if (i && (lt = memchr(from, '<', start + size - from)))
+			from = lt;
+		else if (i)
+			from = start + size;
+		chunks[i].start = start;
+		chunks[i].from = from;
+		chunks[i].end = start + size;
+		if (i)
+			chunks[i - 1].to = from;
+	}
+	chunks[nchunks - 1].to = start + size;
+	run_jobs(chunk_thread, chunks, sizeof *chunks, nchunks);
+	for (i = 0; i < nchunks; i++) {
+		if (i && chunks[i].from != chunks[i - 1].stop) {
+			/* Mis-speculated; the previous chunk's scan
+			 * ended elsewhere. Rescan from there. */
+			chunks[i].from = chunks[i - 1].stop;
+			if (chunks[i].to < chunks[i].from)
+				chunks[i].to = chunks[i].from;
+			chunk_scan(&chunks[i]);
+		}
+		if (chunks[i].failed)
+			goto nomem;
+	}
+
+	/* Phase 2: stitch the events together into entries.
+	 * The prefix sum of depths gives the stack size needed. */
+	depth = maxdepth = 0;
+	for (i = 0; i < nchunks; i++) {
+		if (depth + chunks[i].maxdepth > maxdepth)
+			maxdepth = depth + chunks[i].maxdepth;
+		depth += chunks[i].depth;
+	}
+	stackmax = maxdepth ? maxdepth : 1;
+	stack = malloc(stackmax * sizeof *stack);
+	if (!stack)
+		goto nomem;
+	for (i = 0; i < nchunks; i++) {
+		const struct tagevent *ev = chunks[i].events.data;
+		const struct tagevent *evend = ev + chunks[i].events.len;
+
+		for (; ev < evend; ev++) {
+			struct index_entry *e;
+
+			if (ev->is_close) {
+				/* Close the innermost open element */
+				const char *dot;
+
+				if (!sp)
+					continue;
+				e = &((struct index_entry *)entries.data)
+					[stack[--sp]];
+				e->size = ev->off - e->off;
+				dot = memrchr(key, '.', keylen);
+				keylen = dot ? dot - key : 0;
+				continue;
+			}
+
+			/* Append .tag to key */
+			if (keylen + 1 + ev->taglen > sizeof key)
+				goto nomem;
+			if (keylen)
+				key[keylen++] = '.';
+			memcpy(&key[keylen], start + ev->tagoff, ev->taglen);
+			keylen += ev->taglen;
+
+			if (sp == stackmax) {
+				/* Unbalanced closes upset the prefix sum */
+				uint32_t *newstack = realloc(stack,
+					2 * stackmax * sizeof *stack);
+				if (!newstack)
+					goto nomem;
+				stack = newstack;
+				stackmax *= 2;
+			}
+			if (vec_reserve(&entries, 1, sizeof *e) == -1 ||
+			    vec_reserve(&keys, keylen, 1) == -1)
+				goto nomem;
+			e = &((struct index_entry *)entries.data)[entries.len];
+			e->keylen = keylen;
+			e->keyoff = keys.len;
+			e->off = ev->off;
+			e->size = size - e->off; /* until closed */
+			memcpy((char *)keys.data + keys.len, key, keylen);
+			keys.len += keylen;
+			stack[sp++] = entries.len++;
+		}
+		free(chunks[i].events.data);
+		chunks[i].events.data = NULL;
+	}
+
+	/* Phase 3: hash the keys, and sort */
+	hashjobs = calloc(nchunks, sizeof *hashjobs);
+	if (!hashjobs)
+		goto nomem;
+	for (i = 0; i < nchunks; i++) {
+		hashjobs[i].entries = entries.data;
+		hashjobs[i].keys = keys.data;
+		hashjobs[i].from = entries.len / nchunks * i;
+		hashjobs[i].to = i + 1 < nchunks ?
+			entries.len / nchunks * (i + 1) : entries.len;
+	}
+	run_jobs(hash_thread, hashjobs, sizeof *hashjobs, nchunks);
+
+	ix = malloc(sizeof *ix);
+	order = malloc((entries.len ? entries.len : 1) * sizeof *order);
+	if (!ix || !order)
+		goto nomem;
+	if (index_sort(entries.data, entries.len, order) == -1)
+		goto nomem;
+	ix->entries = entries.data;
+	ix->order = order;
+	ix->keys = keys.data;
+	ix->keysz = keys.len;
+	ix->nentries = entries.len;
+	ix->owned = 1;
+	ix->map = NULL;
+	ix->mapsz = 0;
+	ix->firstchild = NULL;
+	ix->children = NULL;
+	free(hashjobs);
+	free(stack);
+	free(chunks);
+	return ix;
+nomem:
+	if (chunks)
+		for (i = 0; i < nchunks; i++)
+			free(chunks[i].events.data);
+	free(chunks);
+	free(hashjobs);
+	free(ix);
+	free(order);
+	free(entries.data);
+	free(keys.data);
+	free(stack);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/** Releases an index built by #index_build() */
+void
+index_free(struct index *ix)
+{
+	if (!ix)
+		return;
+	if (ix->owned) {
+		free((void *)ix->entries);
+		free((void *)ix->order);
+		free((void *)ix->keys);
+	}
+	free(ix->firstchild);
+	free(ix->children);
+	if (ix->map)
+		munmap(ix->map, ix->mapsz);
+	free(ix);
+}
+
+/**
+ * Finds the child elements of an index entry.
+ * The children of every entry are found together, on first use, from
+ * the nesting of the entries' content spans. They are held in memory
+ * only, so the index's file format is unchanged.
+ * @param parent the entry's position in entries[], or nentries for
+ *               the top-level elements
+ * @param n_return storage for the number of children
+ * @returns the positions in entries[] of the children, in document order
+ * @retval NULL [ENOMEM] out of memory
+ */
+const uint32_t *
+index_children(struct index *ix, uint32_t parent, uint32_t *n_return)
+{
+	uint32_t n = ix->nentries;
+
+	if (!ix->firstchild) {
+		uint32_t *first = calloc(n + 3, sizeof *first);
+		uint32_t *children = malloc((n ? n : 1) * sizeof *children);
+		uint32_t *parents = malloc((n ? n : 1) * sizeof *parents);
+		uint32_t *stack = malloc((n ? n : 1) * sizeof *stack);
+		uint32_t sp = 0;
+		uint32_t i;
+
+		if (!first || !children || !parents || !stack) {
+			free(first);
+			free(children);
+			free(parents);
+			free(stack);
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		/* Each entry's parent is the innermost span holding it */
+		for (i = 0; i < n; i++) {
+			const struct index_entry *e = &ix->entries[i];
+
+			while (sp && (e->off < ix->entries[stack[sp - 1]].off ||
+			    e->off - ix->entries[stack[sp - 1]].off >=
+			    ix->entries[stack[sp - 1]].size))
+				sp--;
+			parents[i] = sp ? stack[sp - 1] : n;
+			stack[sp++] = i;
+			first[parents[i] + 2]++;
+		}
+		for (i = 2; i < n + 3; i++)
+			first[i] += first[i - 1];
+		for (i = 0; i < n; i++)
+			children[first[parents[i] + 1]++] = i;
+		free(parents);
+		free(stack);
+		ix->firstchild = first;
+		ix->children = children;
+	}
+	*n_return = ix->firstchild[parent + 1] - ix->firstchild[parent];
+	return ix->children + ix->firstchild[parent];
+}
+
+/**
+ * Finds the first element in document order with the expanded key.
+ * @returns the index entry
+ * @retval NULL [ENOENT] no element has the key
+ */
+const struct index_entry *
+index_find(const struct index *ix, const char *key, int keylen)
+{
+	uint32_t hash = index_hash(key, keylen);
+	uint32_t lo = 0, hi = ix->nentries;
+
+	/* Find the first entry in order[] with the hash */
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (ix->order[mid] >= ix->nentries)
+			goto corrupt;
+		if (ix->entries[ix->order[mid]].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < ix->nentries; lo++) {
+		const struct index_entry *e;
+
+		if (ix->order[lo] >= ix->nentries)
+			goto corrupt;
+		e = &ix->entries[ix->order[lo]];
+		if (e->hash != hash)
+			break;
+		if (e->keyoff > ix->keysz || e->keylen > ix->keysz - e->keyoff)
+			goto corrupt;
+		if (e->keylen == keylen &&
+		    memcmp(ix->keys + e->keyoff, key, keylen) == 0)
+			return e;
+	}
+corrupt:
+	errno = ENOENT;
+	return NULL;
+}
+
+/**
+ * Computes where the sections of a serialized index will be placed.
+ * @param off the file offset at which the index will be written
+ * @param l   storage for the layout
+ * @returns the file offset just after the index
+ */
+uint64_t
+index_layout(const struct index *ix, uint64_t off, struct index_layout *l)
+{
+	memset(l, 0, sizeof *l);
+	l->nentries = ix->nentries;
+	l->entries_off = ALIGN8(off);
+	l->order_off = ALIGN8(l->entries_off +
+		(uint64_t)ix->nentries * sizeof *ix->entries);
+	l->keys_off = ALIGN8(l->order_off +
+		(uint64_t)ix->nentries * sizeof *ix->order);
+	l->keysz = ix->keysz;
+	return l->keys_off + l->keysz;
+}
+
+/** Writes all of a buffer, or fails */
+int
+write_all(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+
+	while (size) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/**
+ * Creates a uniquely named temporary file beside @a path, so that
+ * concurrent writers of the same file do not share one.
+ * @param tmppath_return storage for the temporary file's name,
+ *                       to be passed to #replace_commit()
+ * @returns a file descriptor open for writing
+ * @retval -1 the file could not be created; see #errno.
+ */
+int
+replace_open(const char *path, char **tmppath_return)
+{
+	char *tmppath;
+	int fd;
+
+	tmppath = malloc(strlen(path) + sizeof ".XXXXXX");
+	if (!tmppath) {
+		errno = ENOMEM;
+		return -1;
+	}
+	sprintf(tmppath, "%s.XXXXXX", path);
+	fd = mkstemp(tmppath);
+	if (fd == -1 || fchmod(fd, 0644) == -1) {
+		int saved_errno = errno;
+
+		if (fd != -1) {
+			close(fd);
+			unlink(tmppath);
+		}
+		free(tmppath);
+		errno = saved_errno;
+		return -1;
+	}
+	*tmppath_return = tmppath;
+	return fd;
+}
+
+/**
+ * Completes a file begun by #replace_open(). The file is synced and
+ * renamed over @a path, or removed if @a failed or on error, so that
+ * readers never see a partial file. @a tmppath is released.
+ * @retval 0 success
+ * @retval -1 the file was not replaced; see #errno.
+ */
+int
+replace_commit(int fd, char *tmppath, const char *path, int failed)
+{
+	int saved_errno;
+
+	if (!failed && fsync(fd) == -1)
+		failed = 1;
+	if (close(fd) == -1)
+		failed = 1;
+	if (!failed && rename(tmppath, path) == 0) {
+		free(tmppath);
+		return 0;
+	}
+	saved_errno = errno;
+	unlink(tmppath);
+	free(tmppath);
+	errno = saved_errno;
+	return -1;
+}
+
+/** Writes zeros to pad the file from @a off to an 8-byte boundary */
+int
+write_pad(int fd, uint64_t off)
+{
+	static const char zeros[8];
+
+	return write_all(fd, zeros, ALIGN8(off) - off);
+}
+
+/**
+ * Writes the sections of an index to a file.
+ * @param fd  the file, positioned at offset @a off
+ * @param off the offset that was given to #index_layout().
+ * @retval 0 success
+ * @retval -1 write error
+ */
+int
+index_write(int fd, const struct index *ix, uint64_t off)
+{
+	struct index_layout l;
+
+	index_layout(ix, off, &l);
+	if (write_pad(fd, off) == -1 ||
+	    write_all(fd, ix->entries,
+		ix->nentries * sizeof *ix->entries) == -1 ||
+	    write_pad(fd, l.entries_off +
+		ix->nentries * sizeof *ix->entries) == -1 ||
+	    write_all(fd, ix->order, ix->nentries * sizeof *ix->order) == -1 ||
+	    write_pad(fd, l.order_off +
+		ix->nentries * sizeof *ix->order) == -1 ||
+	    write_all(fd, ix->keys, ix->keysz) == -1)
+		return -1;
+	return 0;
+}
+
+/** Tests that a section lies within a mapping */
+static int
+section_ok(uint64_t mapsz, uint64_t off, uint64_t size)
+{
+	return off % 8 == 0 && off <= mapsz && size <= mapsz - off;
+}
+
+/**
+ * Creates an index that refers to a serialized index in a mapping.
+ * The mapping is not released by #index_free().
+ * Only the section bounds are checked here; the entries are
+ * bounds-checked as they are used by #index_find().
+ * @param map   the mapped file
+ * @param mapsz the size of the mapped file
+ * @param l     the layout of the index within the file
+ * @returns a new index that refers into @a map
+ * @retval NULL [EINVAL] the layout does not fit the mapping
+ * @retval NULL [ENOMEM] out of memory
+ */
+struct index *
+index_map(const void *map, uint64_t mapsz, const struct index_layout *l)
+{
+	struct index *ix;
+
+	if (!section_ok(mapsz, l->entries_off,
+		(uint64_t)l->nentries * sizeof (struct index_entry)) ||
+	    !section_ok(mapsz, l->order_off,
+		(uint64_t)l->nentries * sizeof (uint32_t)) ||
+	    !section_ok(mapsz, l->keys_off, l->keysz))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	ix = malloc(sizeof *ix);
+	if (!ix)
+		return NULL;
+	ix->entries = (const void *)((const char *)map + l->entries_off);
+	ix->order = (const void *)((const char *)map + l->order_off);
+	ix->keys = (const char *)map + l->keys_off;
+	ix->keysz = l->keysz;
+	ix->nentries = l->nentries;
+	ix->owned = 0;
+	ix->map = NULL;
+	ix->mapsz = 0;
+	ix->firstchild = NULL;
+	ix->children = NULL;
+	return ix;
+}
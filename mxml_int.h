@@ -1,4 +1,5 @@
 #include <stdlib.h>	/* size_t */
+#include <stdint.h>
 
 #define HAVE_CACHE	1	/* Enable cache by default */
 
@@ -21,17 +22,196 @@ struct mxml {
 	} cache[CACHE_MAX];
 	unsigned int cache_next;
 #endif
+	struct pool *pool;	/* Journal strings; allocated by first edit */
+	struct index *index;	/* (optional) index of start[] */
+	struct list **lists;	/* Hash table of list containers */
+	unsigned int nlists, listslots;
+	unsigned long listgen;	/* Count of edits that may remove lists */
+	uint64_t listparents[32]; /* Bloom filter of the lists' parents */
+	void *map;		/* (optional) file mapping to release */
+	size_t mapsz;
 	char *buffer;		/* used by mxml_get() */
 	size_t buffersz;
 	char expandbuf[KEY_MAX]; /* used by mxml_expand_key() */
+	char *prefix;		/* Sub-document: key of the parent's element */
+	const struct edit *merged; /* Sub-document: last edit merged */
+	unsigned long gen;	/* Count of edits; see struct mxml_node */
+	struct watch *watches;	/* By pool node; see mxml_watch.c */
+	uint32_t nwatches;
+};
+
+/* A found element; see mxml_node.c */
+struct mxml_node {
+	unsigned long gen;	/* mxml.gen when found */
+	const char *data;	/* The element's content */
+	size_t size;
+	const char *parentend;	/* End of the parent's content */
+	int keylen;
+	char key[KEY_MAX + 1];
 };
 
 /* An edit record. These are always held unintegrated */
 struct edit {
 	struct edit *next;
-	char *key;
-	char *value;	/* Must be NULL when op=EDIT_DELETE */
-	enum edit_op { EDIT_DELETE, EDIT_SET, EDIT_APPEND } op;
+	const char *key;	/* Interned in the journal pool */
+	uint32_t keyid;		/* Pool node of the key */
+	const char *value;	/* Must be "" when op=EDIT_DELETE */
+	size_t valuelen;
+	int verbatim;	/* value has no characters needing XML-encoding */
+	enum edit_op {
+		EDIT_DELETE,
+		EDIT_SET,
+		EDIT_APPEND,
+		EDIT_LIST_REMOVE,	/* key is a list container, "tags"; value
+					   is the new "tags.total", or "" */
+		EDIT_MOVE,		/* value is the destination key */
+		EDIT_REPLACE,		/* value is the new content, as XML */
+		EDIT_DELETE_MATCHING	/* key is a pattern of keys to delete */
+	} op;
+	unsigned int listindex;	/* EDIT_LIST_REMOVE: the element removed */
+	uint32_t destid;	/* EDIT_MOVE: pool node of the destination */
+	struct pattern *pattern; /* EDIT_DELETE_MATCHING: the compiled key */
+	struct edit_ref *ref;	/* (optional) value is not in the pool */
+};
+
+/* A caller-owned value shared by edits; see #mxml_set_nocopy() */
+struct edit_ref {
+	const char *value;
+	void (*free_fn)(void *value);
+	unsigned int refs;	/* Edits holding the value */
+};
+
+/* A compiled key pattern, eg "a.*.b" or "a.**"; see mxml_pattern.c */
+#define PATTERN_SEGS_MAX	63
+struct pattern {
+	const char *text;
+	unsigned int nsegs;
+	struct pattern_seg {
+		int off;	/* Offset of the segment in text[] */
+		int len;
+		enum {
+			PATTERN_TAG,
+			PATTERN_ANY,	/* "*", any one tag */
+			PATTERN_ANYS	/* "**", any number of tags */
+		} type;
+	} segs[];
+};
+
+/* Interned journal strings; see mxml_pool.c */
+struct pool_str {
+	const char *s;
+	uint32_t len;
+	uint32_t hash;
+};
+struct strtab {
+	struct pool_str *strs;
+	uint32_t n, alloc;
+	uint32_t *slots;	/* Open-addressed; id+1 or 0 */
+	uint32_t nslots;
+};
+struct pool_node {
+	uint32_t parent;	/* Node of the key's parent */
+	uint32_t atom;		/* Last tag of the key */
+	uint32_t depth;		/* Number of tags in the key */
+	uint32_t keylen;
+	const char *key;	/* (lazy) the dotted key */
+};
+struct pool {
+	struct strtab atoms;	/* Tag names */
+	struct strtab values;	/* Short values */
+	struct pool_node *nodes;
+	uint32_t nnodes, nodealloc;
+	uint32_t *nodetab;	/* (parent, atom) hash; id+1 or 0 */
+	uint32_t nodeslots;
+	struct pool_chunk *chunks; /* Arena holding all the strings */
+	char *next;
+	size_t avail;
+};
+
+/* Subscriptions to, and edits of, a pool node; see mxml_watch.c */
+struct watch {
+	struct mxml_subscription *subs; /* Subscribed to this key */
+	uint32_t child;		/* First watched child, id+1 or 0 */
+	uint32_t sibling;	/* Next watched sibling, id+1 or 0 */
+	int linked;		/* On the parent's child list */
+	unsigned int nsubs;	/* Subscriptions to this key or below */
+	unsigned long here;	/* Edits of this key */
+	unsigned long below;	/* Edits of this key or below */
+};
+struct mxml_subscription {
+	struct mxml_subscription *next;
+	uint32_t node;		/* Pool node of the prefix */
+	void (*cb)(void *context, const char *key);
+	void *context;
+};
+
+/* Cached state of a list container, eg "a.tags"; see mxml_list.c */
+struct list {
+	struct list *next;	/* Hash chain */
+	uint32_t hash;
+	int keylen;
+	enum {
+		LIST_TOTAL_UNKNOWN,
+		LIST_TOTAL_MISSING,	/* There is no "a.tags.total" */
+		LIST_TOTAL_PRESENT
+	} total_state;		/* The edited document's total */
+	unsigned int total;
+	unsigned long gen;	/* mxml.listgen when total and fields held */
+	int scanned;		/* elems[] has been filled in */
+	int sparse;		/* Some elements are beyond elems[] */
+	unsigned int nelems;
+	struct list_elem {	/* Base document "a.tags.tag<N>" at [N-1] */
+		const char *data;	/* NULL if missing */
+		size_t size;
+	} *elems;
+	struct list_field *fields; /* Value indexes; see #mxml_list_find() */
+	char key[];
+};
+
+/* An element of the base document; see mxml_index.c */
+struct index_entry {
+	uint32_t hash;		/* #index_hash() of the key */
+	uint32_t keylen;
+	uint64_t keyoff;	/* Offset of the key in index.keys[] */
+	uint64_t off;		/* Offset of the content in mxml.start[] */
+	uint64_t size;		/* Size of the content */
+};
+
+/* An index of elements. Its arrays may lie in a file mapping. */
+struct index {
+	const struct index_entry *entries; /* in document order */
+	const uint32_t *order;	/* entries[] indicies, sorted by hash */
+	const char *keys;	/* entry key text */
+	uint64_t keysz;
+	uint32_t nentries;
+	int owned;		/* Arrays are to be free()d */
+	void *map;		/* (optional) mapping to release */
+	size_t mapsz;
+	uint32_t *firstchild;	/* (optional) see #index_children() */
+	uint32_t *children;
+};
+
+/* Placement of a serialized index within a file */
+struct index_layout {
+	uint64_t entries_off;
+	uint64_t order_off;
+	uint64_t keys_off;
+	uint64_t keysz;
+	uint32_t nentries;
+	uint32_t reserved;
+};
+
+/* A compiled key; see #mxml_key_compile() */
+struct mxml_key {
+	char *tmpl;		/* Expanded key, less the holes' numbers */
+	int tmpllen;
+	int is_total;		/* Key ended with "[#]" */
+	unsigned int nholes;
+	struct keyhole {	/* A deferred "tag[$]" or "tag[+]" */
+		int totalat;	/* Offset of "tag" after "tags." */
+		int at;		/* Offset to insert <N> after "tags.tag" */
+		int incr;	/* 1 for [+] */
+	} holes[];
 };
 
 /* A bounded text cursor */
@@ -42,27 +222,76 @@ struct cursor {
 
 struct token {
 	enum { TOK_EMPTY, TOK_EOF, TOK_OPEN, TOK_VALUE, TOK_CLOSE } type;
-	char key[KEY_MAX];
+	const char *key;	/* Not NUL-terminated; see flatten_range() */
 	int keylen;
 	const char *value;
-	int valuelen;		/* -1 if the value is NUL-terminated
-				 * and needs XML-encoding */
+	int valuelen;
+	int escape;		/* value is user text needing XML-encoding */
 };
 
 /* Export these functions */
 #define EXPORT __attribute__((visibility ("default")))
 EXPORT int mxml_append();
+EXPORT int mxml_children();
+EXPORT int mxml_count_children();
+EXPORT int mxml_apply_batch();
 EXPORT int mxml_delete();
+EXPORT int mxml_delete_matching();
 EXPORT int mxml_exists();
+EXPORT int mxml_exists_key();
+EXPORT struct mxml_node *mxml_find_node();
+EXPORT int mxml_foreach_pair();
+EXPORT int mxml_export_snapshot();
 EXPORT char *mxml_expand_key();
+EXPORT int mxml_build_index();
 EXPORT void mxml_free();
 EXPORT void mxml_free_keys();
 EXPORT char *mxml_get();
+EXPORT char *mxml_get_key();
+EXPORT int mxml_get_bool();
+EXPORT int mxml_get_enum();
+EXPORT int mxml_get_int64();
+EXPORT int mxml_get_uint();
+EXPORT const char *mxml_get_subtree_span();
+EXPORT struct mxml_key *mxml_key_compile();
+EXPORT void mxml_key_free();
 EXPORT char **mxml_keys();
+EXPORT int mxml_is_dirty();
+EXPORT int mxml_list_append_many();
+EXPORT int mxml_list_remove();
+EXPORT int mxml_list_find();
+EXPORT int mxml_load_pairs();
+EXPORT int mxml_merge_sub();
+EXPORT int mxml_move();
 EXPORT struct mxml *mxml_new();
+EXPORT struct mxml *mxml_new_sub();
+EXPORT struct mxml_node *mxml_node_first_child();
+EXPORT void mxml_node_free();
+EXPORT char *mxml_node_get();
+EXPORT const char *mxml_node_key();
+EXPORT struct mxml_node *mxml_node_next_sibling();
+EXPORT struct mxml *mxml_open_file();
+EXPORT struct mxml *mxml_open_snapshot();
+EXPORT int mxml_query();
+EXPORT int mxml_replace_subtree();
 EXPORT int mxml_set();
+EXPORT int mxml_set_nocopy();
+EXPORT int mxml_snapshot_matches();
+EXPORT struct mxml_subscription *mxml_subscribe();
+EXPORT void mxml_unsubscribe();
 EXPORT int mxml_update();
 EXPORT size_t mxml_write();
+EXPORT size_t mxml_write_pairs();
+EXPORT size_t mxml_write_parallel();
+
+/* mxml.c */
+size_t unencode_xml_span(const char *content, size_t contentsz);
+size_t unencode_xml_into(const char *content, size_t contentsz, char *out);
+char *unencode_xml(struct mxml *m, const char *content, size_t contentsz);
+struct edit *edit_new(struct mxml *m, enum edit_op op, const char *ekey,
+	int ekeylen, const char *value);
+struct edit *edit_new_n(struct mxml *m, enum edit_op op, const char *ekey,
+	int ekeylen, const char *value, size_t valuelen);
 
 /* mxml_cursor.c */
 int cursor_is_at_eof(const struct cursor *c);
@@ -73,6 +302,8 @@ int cursor_eat_white(struct cursor *c);
 void cursor_skip_to_ch(struct cursor *c, char ch);
 void cursor_skip_content(struct cursor *c);
 void cursor_skip_to_close(struct cursor *c);
+const char *cursor_eat_element(struct cursor *c, const char **tag_return,
+	int *taglen_return, size_t *size_return);
 
 /* mxml_cache.c */
 #if HAVE_CACHE
@@ -86,13 +317,97 @@ void cache_set(struct mxml *m, const char *ekey, int ekeylen,
 /* mxml_ekey.c */
 int expand_key(struct mxml *m, char *outbuf, size_t outbufsz, const char *key);
 int parse_uint(const char *s, int n, unsigned int *retval);
+int parse_int64(const char *s, int n, int64_t *retval);
+int parse_bool(const char *s, int n, int *retval);
+struct mxml_key *key_compile(struct mxml *m, const char *key);
+const char *key_resolve(struct mxml *m, const struct mxml_key *k,
+	char *outbuf, int *len_return);
+const char *key_resolve_fn(struct mxml *m, const struct mxml_key *k,
+	char *outbuf, int *len_return,
+	unsigned int (*total_fn)(void *context, const char *totalkey,
+	    int totalkeylen, int incr),
+	void *context);
+
 
+/* mxml_index.c */
+uint32_t index_hash(const char *key, int keylen);
+uint64_t index_checksum(const char *data, size_t size);
+struct index *index_build(const char *start, size_t size,
+	unsigned int nthreads);
+void index_free(struct index *ix);
+const uint32_t *index_children(struct index *ix, uint32_t parent,
+	uint32_t *n_return);
+const struct index_entry *index_find(const struct index *ix,
+	const char *key, int keylen);
+uint64_t index_layout(const struct index *ix, uint64_t off,
+	struct index_layout *l);
+int index_write(int fd, const struct index *ix, uint64_t off);
+struct index *index_map(const void *map, uint64_t mapsz,
+	const struct index_layout *l);
+int write_all(int fd, const void *data, size_t size);
+int write_pad(int fd, uint64_t off);
+int replace_open(const char *path, char **tmppath_return);
+int replace_commit(int fd, char *tmppath, const char *path, int failed);
 
 /* mxml_find.c */
 const char *find_key(struct mxml *m, const char *ekey,
 	int ekeylen, size_t *sz_return);
+const char *find_in_span(const char *span, size_t spansz, const char *relkey,
+	int relkeylen, size_t *sz_return);
+int subtree_is_edited(const struct mxml *m, const char *ekey, int ekeylen);
+
+/* mxml_pool.c */
+struct pool *pool_new(void);
+void pool_free(struct pool *p);
+long pool_intern_key(struct pool *p, const char *key, int keylen);
+const char *pool_key(struct pool *p, uint32_t id);
+const char *pool_value(struct pool *p, const char *value, size_t len);
+unsigned int pool_find_path(const struct pool *p, const char *key, int keylen,
+	uint32_t *path, unsigned int maxdepth, int *complete_return);
+uint32_t pool_ancestor(const struct pool *p, uint32_t id, unsigned int depth);
+
+/* mxml_list.c */
+int list_elem_number(const char *ckey, int ckeylen, const char *tag,
+	int taglen, unsigned int *n_return);
+int list_total(struct mxml *m, const char *totalkey, int totalkeylen,
+	unsigned int *total_return);
+const char *list_element(struct mxml *m, const char *ckey, int ckeylen,
+	const char *span, size_t spansz, const char *tag, int taglen,
+	size_t *sz_return);
+void list_edited(struct mxml *m, const struct edit *e);
+void list_free_all(struct mxml *m);
+
+/* mxml_watch.c */
+int watch_reserve(struct mxml *m);
+void watch_edited(struct mxml *m, const struct edit *e);
+void watch_free_all(struct mxml *m);
+
+/* mxml_pattern.c */
+struct pattern *pattern_new(const char *text, int textlen);
+uint64_t pattern_start(const struct pattern *p);
+uint64_t pattern_step(const struct pattern *p, uint64_t set, const char *tag,
+	int taglen);
+int pattern_accepts(const struct pattern *p, uint64_t set);
+int pattern_descends(const struct pattern *p, uint64_t set);
+uint64_t pattern_walk(const struct pattern *p, const char *key, int keylen,
+	int *matched_return);
+int pattern_match(const struct pattern *p, const char *key, int keylen);
 
 /* mxml_flatten.c */
+struct flatten_src {
+	const char *start;	/* XML to tokenize */
+	size_t size;
+	const char *key;	/* Key of element enclosing start[] or "" */
+	int keylen;
+};
 size_t flatten_edits(const struct mxml *m,
 	size_t (*fn)(void *context, const struct token *token),
 	void *context);
+size_t flatten_element(const struct mxml *m, const char *start, size_t size,
+	const char *key, int keylen,
+	size_t (*fn)(void *context, const struct token *token),
+	void *context);
+size_t flatten_range(const struct edit *const *edits, unsigned int nedits,
+	const struct flatten_src *src,
+	size_t (*fn)(void *context, const struct token *token),
+	void *context);
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <errno.h>
 
 #include "mxml.h"
 #include "mxml_int.h"
@@ -29,6 +30,29 @@ keys_token(void *context, const struct token *token)
 	return 0;
 }
 
+/** Extracts the keys directly from an index, in document order */
+static int
+keys_from_index(const struct index *ix, struct keys_context *c)
+{
+	uint32_t i;
+
+	c->keys = malloc((ix->nentries ? ix->nentries : 1) * sizeof *c->keys);
+	if (!c->keys)
+		return -1;
+	for (i = 0; i < ix->nentries; i++) {
+		const struct index_entry *e = &ix->entries[i];
+		if (e->keyoff > ix->keysz || e->keylen > ix->keysz - e->keyoff) {
+			errno = EINVAL; /* corrupt index */
+			return -1;
+		}
+		c->keys[i] = strndup(ix->keys + e->keyoff, e->keylen);
+		if (!c->keys[i])
+			return -1;
+		c->nkeys++;
+	}
+	return 0;
+}
+
 char **
 mxml_keys(const struct mxml *m, unsigned int *nkeys_return)
 {
@@ -36,6 +60,15 @@ mxml_keys(const struct mxml *m, unsigned int *nkeys_return)
 
 	c.keys = NULL;
 	c.nkeys = 0;
+	if (m->index && !m->edits) {
+		if (keys_from_index(m->index, &c) == -1) {
+			mxml_free_keys(c.keys, c.nkeys);
+			*nkeys_return = 0;
+			return NULL;
+		}
+		*nkeys_return = c.nkeys;
+		return c.keys;
+	}
 	if (flatten_edits(m, keys_token, &c) == -1) {
 		mxml_free_keys(c.keys, c.nkeys);
 		*nkeys_return = 0;
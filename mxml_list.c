@@ -0,0 +1,867 @@
+#define _GNU_SOURCE /* memrchr */
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * Opengear lists hold their elements and a count in a container:
+ *
+ *     <ports><port1>..</port1><port2>..</port2><total>2</total></ports>
+ *
+ * The list "a.port" has the container key "a.ports", the element
+ * keys "a.ports.port<N>" and the total key "a.ports.total".
+ *
+ * Each handle keeps a table of the list containers it has used:
+ *
+ *  - The total of the edited document, so that [$] and [+] need not
+ *    look it up each time. Edits that set the total key update it,
+ *    and other edits of it make it unknown again.
+ *  - The elements of the base document, by their numeric suffix,
+ *    found in a single pass over the container. Element lookups
+ *    that fall through the journal to the document then become
+ *    array accesses instead of sibling scans.
+ *  - Indexes of the decoded values of element fields in the edited
+ *    document, built when a list is first searched by a field. An
+ *    edit inside element N marks N's entries to be read again at
+ *    the next search.
+ *
+ * An edit finds the containers it is inside by looking up each of its
+ * parent keys. An edit at or above a container (such as deleting it)
+ * instead advances m->listgen, and each record's total and indexes
+ * are discarded when it is next found under an older generation.
+ * Whether a key is above any container is told by a Bloom filter of
+ * the containers' parent keys, so that most edits of values leave
+ * the records alone.
+ */
+
+#define LIST_SLOTS_MIN	64
+
+/* Elements numbered beyond this are left to the sibling scan, so that
+ * a sparse numbering cannot make elems[] much larger than its span */
+#define LIST_ELEMS_MAX(spansz)	((spansz) / 8)
+
+/* An index of field "f" over the elements "a.tags.tag<N>.f" */
+struct list_field {
+	struct list_field *next;
+	unsigned int n;		/* Elements 1..n are indexed */
+	unsigned int nslots;	/* Power of 2, at least 2n */
+	unsigned int *slots;	/* Hash buckets of element numbers, 0 ends */
+	struct list_value {
+		char *value;	/* Decoded value, or NULL if missing */
+		uint32_t hash;
+		unsigned int chain; /* Next in bucket, 0 ends */
+		int dirty;	/* Value must be read again */
+	} *values;		/* Element N at [N-1] */
+	int ndirty;
+	char field[];
+};
+
+static void
+field_free(struct list_field *f)
+{
+	unsigned int i;
+
+	for (i = 0; i < f->n; i++)
+		free(f->values[i].value);
+	free(f->values);
+	free(f->slots);
+	free(f);
+}
+
+static void
+list_fields_free(struct list *l)
+{
+	struct list_field *f;
+
+	while ((f = l->fields)) {
+		l->fields = f->next;
+		field_free(f);
+	}
+}
+
+#define LIST_PARENT_BIT(hash) \
+	((hash) % (sizeof ((struct mxml *)0)->listparents * 8))
+
+/** Tests if a key may be the parent of a list container */
+static int
+list_is_parent(const struct mxml *m, const char *key, int keylen)
+{
+	uint32_t bit = LIST_PARENT_BIT(index_hash(key, keylen));
+
+	return (m->listparents[bit / 64] >> (bit % 64)) & 1;
+}
+
+/** Finds a list container record
+ *  @param create allocate a new record if not found
+ *  @retval NULL [ENOENT] not found, or [ENOMEM] */
+static struct list *
+list_get(struct mxml *m, const char *ckey, int ckeylen, int create)
+{
+	uint32_t hash = index_hash(ckey, ckeylen);
+	struct list *l;
+	const char *dot;
+
+	if (m->listslots) {
+		for (l = m->lists[hash & (m->listslots - 1)]; l; l = l->next)
+			if (l->hash == hash && l->keylen == ckeylen &&
+			    memcmp(l->key, ckey, ckeylen) == 0)
+			{
+				if (l->gen != m->listgen) {
+					/* The container may have been
+					 * removed since */
+					l->total_state = LIST_TOTAL_UNKNOWN;
+					list_fields_free(l);
+					l->gen = m->listgen;
+				}
+				return l;
+			}
+	}
+	if (!create) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	/* Grow the table when it becomes loaded */
+	if (m->nlists >= m->listslots) {
+		unsigned int nslots = m->listslots ?
+			m->listslots * 2 : LIST_SLOTS_MIN;
+		struct list **slots = calloc(nslots, sizeof *slots);
+		unsigned int i;
+
+		if (!slots) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		for (i = 0; i < m->listslots; i++)
+			while ((l = m->lists[i])) {
+				m->lists[i] = l->next;
+				l->next = slots[l->hash & (nslots - 1)];
+				slots[l->hash & (nslots - 1)] = l;
+			}
+		free(m->lists);
+		m->lists = slots;
+		m->listslots = nslots;
+	}
+
+	l = calloc(1, sizeof *l + ckeylen + 1);
+	if (!l) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	l->hash = hash;
+	l->keylen = ckeylen;
+	memcpy(l->key, ckey, ckeylen);
+	l->total_state = LIST_TOTAL_UNKNOWN;
+	l->gen = m->listgen;
+	l->next = m->lists[hash & (m->listslots - 1)];
+	m->lists[hash & (m->listslots - 1)] = l;
+	m->nlists++;
+
+	for (dot = memchr(ckey, '.', ckeylen); dot;
+	     dot = memchr(dot + 1, '.', ckeylen - (dot + 1 - ckey)))
+	{
+		uint32_t bit = LIST_PARENT_BIT(index_hash(ckey, dot - ckey));
+
+		m->listparents[bit / 64] |= (uint64_t)1 << (bit % 64);
+	}
+	return l;
+}
+
+void
+list_free_all(struct mxml *m)
+{
+	unsigned int i;
+	struct list *l;
+
+	for (i = 0; i < m->listslots; i++)
+		while ((l = m->lists[i])) {
+			m->lists[i] = l->next;
+			list_fields_free(l);
+			free(l->elems);
+			free(l);
+		}
+	free(m->lists);
+	m->lists = NULL;
+	m->listslots = 0;
+	m->nlists = 0;
+}
+
+/**
+ * Finds the total of a list in the edited document.
+ * @param totalkey the expanded total key, "tags.total"
+ * @param total_return storage for the total, or 0 if it is
+ *                     missing or malformed
+ * @retval 1 the total key exists
+ * @retval 0 the total key does not exist
+ */
+int
+list_total(struct mxml *m, const char *totalkey, int totalkeylen,
+	unsigned int *total_return)
+{
+	int ckeylen = totalkeylen - (int)(sizeof ".total" - 1);
+	struct list *l = NULL;
+	const char *content;
+	size_t contentsz;
+	unsigned int total;
+	int saved_errno = errno;
+
+	if (ckeylen > 0)
+		l = list_get(m, totalkey, ckeylen, 1);
+	errno = saved_errno;
+	if (l && l->total_state != LIST_TOTAL_UNKNOWN) {
+		*total_return = l->total;
+		return l->total_state == LIST_TOTAL_PRESENT;
+	}
+
+	content = find_key(m, totalkey, totalkeylen, &contentsz);
+	if (!content || parse_uint(content, contentsz, &total) < 0)
+		total = 0;
+	if (l) {
+		l->total = total;
+		l->total_state = content ? LIST_TOTAL_PRESENT
+					 : LIST_TOTAL_MISSING;
+	}
+	*total_return = total;
+	return content != NULL;
+}
+
+/**
+ * Tests if @a tag is an element of the container whose last tag is
+ * @a ctag, eg "cat12" in "cats".
+ * @param n_return storage for the element's number
+ */
+static int
+list_elem_tag(const char *ctag, int ctaglen, const char *tag, int taglen,
+	unsigned int *n_return)
+{
+	int baselen = ctaglen - 1;	/* Length of "cat" */
+	unsigned int n = 0;
+	int i;
+
+	if (baselen < 1 || ctag[baselen] != 's' || taglen <= baselen ||
+	    memcmp(ctag, tag, baselen) != 0 || tag[baselen] == '0')
+		return 0;
+	for (i = baselen; i < taglen; i++) {
+		if (!isdigit((unsigned char)tag[i]) || n > (~0u - 9) / 10)
+			return 0;
+		n = n * 10 + (tag[i] - '0');
+	}
+	*n_return = n;
+	return 1;
+}
+
+/**
+ * Tests if @a tag is an element of the container @a ckey,
+ * eg "cat12" in "a.cats".
+ * @param n_return storage for the element's number
+ */
+int
+list_elem_number(const char *ckey, int ckeylen, const char *tag, int taglen,
+	unsigned int *n_return)
+{
+	const char *ctag = memrchr(ckey, '.', ckeylen);
+
+	ctag = ctag ? ctag + 1 : ckey;
+	return list_elem_tag(ctag, ckeylen - (ctag - ckey), tag, taglen,
+	    n_return);
+}
+
+/** Records the content of element @a n, if it is the first seen.
+ *  @retval -1 [ENOMEM] */
+static int
+list_elem_add(struct list *l, unsigned int n, unsigned int max,
+	const char *data, size_t size)
+{
+	if (n > max) {
+		l->sparse = 1;
+		return 0;
+	}
+	if (n > l->nelems) {
+		unsigned int nelems = l->nelems ? l->nelems : 16;
+		struct list_elem *elems;
+
+		while (nelems < n)
+			nelems *= 2;
+		elems = realloc(l->elems, nelems * sizeof *elems);
+		if (!elems) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(elems + l->nelems, 0,
+		    (nelems - l->nelems) * sizeof *elems);
+		l->elems = elems;
+		l->nelems = nelems;
+	}
+	/* The first of duplicate elements wins */
+	if (!l->elems[n - 1].data) {
+		l->elems[n - 1].data = data;
+		l->elems[n - 1].size = size;
+	}
+	return 0;
+}
+
+/** Records the elements found in a container's content */
+static int
+list_scan(struct list *l, const char *span, size_t spansz)
+{
+	const char *ctag = memrchr(l->key, '.', l->keylen);
+	int ctaglen;
+	struct cursor c;
+
+	ctag = ctag ? ctag + 1 : l->key;
+	ctaglen = l->keylen - (ctag - l->key);
+	c.pos = span;
+	c.end = span + spansz;
+
+	cursor_skip_content(&c);
+	while (!cursor_is_at_eof(&c) && !cursor_is_at(&c, "</")) {
+		const char *tag;
+		int taglen;
+		unsigned int n;
+		const char *data;
+		size_t size;
+
+		data = cursor_eat_element(&c, &tag, &taglen, &size);
+		if (list_elem_tag(ctag, ctaglen, tag, taglen, &n) &&
+		    list_elem_add(l, n, LIST_ELEMS_MAX(spansz),
+		    data, size) == -1)
+			return -1;
+		cursor_skip_content(&c);
+	}
+	l->scanned = 1;
+	return 0;
+}
+
+/**
+ * Finds a list element in the base document.
+ * @param ckey   the expanded container key, "tags"
+ * @param span   the container's content in the base document
+ * @param tag    the element's tag, eg "tag12"
+ * @param sz_return storage for the size of the element's content
+ * @returns the element's content
+ * @retval NULL [ENOENT] the element does not exist
+ * @retval NULL [EAGAIN] @a tag is not a list element of the container,
+ *                       or the container could not be scanned
+ */
+const char *
+list_element(struct mxml *m, const char *ckey, int ckeylen,
+	const char *span, size_t spansz, const char *tag, int taglen,
+	size_t *sz_return)
+{
+	struct list *l;
+	unsigned int n;
+
+	if (!list_elem_number(ckey, ckeylen, tag, taglen, &n))
+		goto again;
+	l = list_get(m, ckey, ckeylen, 1);
+	if (!l)
+		goto again;
+	if (!l->scanned && list_scan(l, span, spansz) == -1)
+		goto again;
+	if (n > LIST_ELEMS_MAX(spansz) && l->sparse)
+		goto again;
+	if (n > l->nelems || !l->elems[n - 1].data) {
+		errno = ENOENT;
+		return NULL;
+	}
+	*sz_return = l->elems[n - 1].size;
+	return l->elems[n - 1].data;
+again:
+	errno = EAGAIN;
+	return NULL;
+}
+
+/**
+ * Marks the field values of an edited element to be read again.
+ * @param rkey the edited key relative to the container, "tag12.f"
+ */
+static void
+list_fields_edited(struct list *l, const char *rkey, int rkeylen)
+{
+	const char *dot = memchr(rkey, '.', rkeylen);
+	struct list_field *f;
+	unsigned int n;
+
+	if (!list_elem_number(l->key, l->keylen, rkey,
+	    dot ? dot - rkey : rkeylen, &n))
+		return;
+	for (f = l->fields; f; f = f->next)
+		if (n <= f->n && !f->values[n - 1].dirty) {
+			f->values[n - 1].dirty = 1;
+			f->ndirty++;
+		}
+}
+
+/**
+ * Updates the cached lists at, above and below a key after an edit.
+ */
+static void
+list_key_edited(struct mxml *m, const struct edit *e, const char *key,
+	int keylen)
+{
+	const char *dot;
+	struct list *l;
+
+	/* The edit may replace what is below the key */
+	if (list_is_parent(m, key, keylen) || list_get(m, key, keylen, 0))
+		m->listgen++;
+
+	/* The containers that the key is inside */
+	for (dot = memchr(key, '.', keylen); dot;
+	     dot = memchr(dot + 1, '.', keylen - (dot + 1 - key)))
+	{
+		const char *rkey = dot + 1;	/* Relative to the container */
+		int rkeylen = keylen - (rkey - key);
+
+		l = list_get(m, key, dot - key, 0);
+		if (!l)
+			continue;
+		if (rkeylen < 5 || memcmp(rkey, "total", 5) != 0 ||
+		    (rkeylen > 5 && rkey[5] != '.'))
+		{
+			if (l->fields)
+				list_fields_edited(l, rkey, rkeylen);
+		} else if (rkeylen == 5 && e->op == EDIT_DELETE) {
+			l->total = 0;
+			l->total_state = LIST_TOTAL_MISSING;
+		} else if (rkeylen == 5 &&
+		    (e->op == EDIT_SET || e->op == EDIT_APPEND))
+		{
+			if (parse_uint(e->value, e->valuelen, &l->total) < 0)
+				l->total = 0;
+			l->total_state = LIST_TOTAL_PRESENT;
+		} else
+			l->total_state = LIST_TOTAL_UNKNOWN;
+	}
+}
+
+/**
+ * Updates the cached lists after an edit is made.
+ */
+void
+list_edited(struct mxml *m, const struct edit *e)
+{
+	int saved_errno = errno;
+
+	if (!m->nlists)
+		return;
+	if (e->op == EDIT_DELETE_MATCHING) {
+		/* Any list may be deleted */
+		m->listgen++;
+		return;
+	}
+	list_key_edited(m, e, e->key, strlen(e->key));
+	if (e->op == EDIT_MOVE)
+		list_key_edited(m, e, e->value, e->valuelen);
+	errno = saved_errno;
+}
+
+/**
+ * Expands a list key into its total key, "tags.total".
+ * @param list the list key, eg "a.tag"
+ * @param outbuf storage of KEY_MAX bytes for the total key
+ * @returns the length of the total key
+ * @retval -1 [EINVAL] the list key is malformed
+ */
+static int
+list_total_key(struct mxml *m, const char *list, char *outbuf)
+{
+	char tkey[KEY_MAX];
+
+	if (snprintf(tkey, sizeof tkey, "%s[#]", list) >= sizeof tkey) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return expand_key(m, outbuf, KEY_MAX, tkey);
+}
+
+/* Finds a child "tag<N>" with N in [lo, hi] */
+struct append_probe {
+	const char *tag;
+	int taglen;
+	unsigned int lo, hi;
+};
+
+static int
+append_probe_child(void *context, const char *key)
+{
+	const struct append_probe *p = context;
+	const char *name = strrchr(key, '.');
+	unsigned int index;
+
+	name = name ? name + 1 : key;
+	if (strncmp(name, p->tag, p->taglen) != 0 ||
+	    !isdigit((unsigned char)name[p->taglen]))
+		return 0;
+	if (parse_uint(name + p->taglen, strlen(name + p->taglen), &index) < 0)
+		return 0;
+	return index >= p->lo && index <= p->hi;
+}
+
+int
+mxml_list_append_many(struct mxml *m, const char *list, unsigned int n,
+	const char *const *fields, unsigned int nfields,
+	const char *const *values)
+{
+	char ekey[KEY_MAX];	/* "tags.total", then "tags.tag<N>.field" */
+	int ekeylen;
+	int containerlen;	/* Length of "tags" */
+	const char *tag;
+	int taglen;
+	size_t contentsz;
+	unsigned int total;
+	int has_total;
+	char newtotal[16];
+	unsigned int i, f;
+	const char *dot;
+	char container[KEY_MAX];
+	size_t maxfieldlen;
+	struct append_probe probe;
+
+	tag = strrchr(list, '.');
+	tag = tag ? tag + 1 : list;
+	taglen = strlen(tag);
+
+	ekeylen = list_total_key(m, list, ekey);
+	if (ekeylen < 0)
+		return -1;
+	containerlen = ekeylen - sizeof ".total" + 1;
+
+	/* Read the total once */
+	has_total = list_total(m, ekey, ekeylen, &total);
+	if (!n)
+		return 0;
+
+	/* Check every key fits, and that no item exists, before editing */
+	maxfieldlen = 0;
+	for (f = 0; f < nfields; f++)
+		if (strlen(fields[f]) + 1 > maxfieldlen)
+			maxfieldlen = strlen(fields[f]) + 1;
+	if (containerlen + snprintf(NULL, 0, ".%.*s%u", taglen, tag,
+	    total + n) + maxfieldlen >= KEY_MAX)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(container, ekey, containerlen);
+	container[containerlen] = '\0';
+	probe.tag = tag;
+	probe.taglen = taglen;
+	probe.lo = total + 1;
+	probe.hi = total + n;
+	switch (mxml_children(m, container, 0, UINT_MAX, append_probe_child,
+	    &probe)) {
+	case 0:
+		break;
+	case -1:
+		if (errno == ENOENT)
+			break;
+		return -1;
+	default:
+		errno = EEXIST;
+		return -1;
+	}
+
+	/* Append the missing container and its parents */
+	for (dot = ekey; (dot = memchr(dot, '.', ekeylen - (dot - ekey)));
+	     dot++)
+	{
+		if (find_key(m, ekey, dot - ekey, &contentsz))
+			continue;
+		if (!edit_new(m, EDIT_APPEND, ekey, dot - ekey, NULL))
+			return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		int itemlen;
+
+		itemlen = snprintf(ekey + containerlen, KEY_MAX - containerlen,
+		    ".%.*s%u", taglen, tag, total + 1 + i);
+		if (itemlen >= KEY_MAX - containerlen) {
+			errno = ENOMEM;
+			return -1;
+		}
+		itemlen += containerlen;
+		if (!nfields) {
+			if (!edit_new(m, EDIT_APPEND, ekey, itemlen,
+			    values[i]))
+				return -1;
+			continue;
+		}
+		if (!edit_new(m, EDIT_APPEND, ekey, itemlen, NULL))
+			return -1;
+		for (f = 0; f < nfields; f++) {
+			const char *value = values[i * nfields + f];
+			int fieldlen;
+
+			if (!value)
+				continue;
+			fieldlen = snprintf(ekey + itemlen, KEY_MAX - itemlen,
+			    ".%s", fields[f]);
+			if (fieldlen >= KEY_MAX - itemlen) {
+				errno = ENOMEM;
+				return -1;
+			}
+			if (!edit_new(m, EDIT_APPEND, ekey, itemlen + fieldlen,
+			    value))
+				return -1;
+		}
+	}
+
+	/* Write the final total once */
+	memcpy(ekey + containerlen, ".total", sizeof ".total");
+	snprintf(newtotal, sizeof newtotal, "%u", total + n);
+	if (!edit_new(m, has_total ? EDIT_SET : EDIT_APPEND, ekey, ekeylen,
+	    newtotal))
+		return -1;
+	return 0;
+}
+
+int
+mxml_list_remove(struct mxml *m, const char *list, unsigned int index)
+{
+	char ekey[KEY_MAX];	/* "tags.total", then "tags.tag<N>" */
+	int ekeylen;
+	int containerlen;	/* Length of "tags" */
+	const char *tag;
+	size_t contentsz;
+	unsigned int total;
+	int has_total;
+	char newtotal[16];
+	struct edit *edit;
+	int n;
+
+	if (!index) {
+		errno = EINVAL;
+		return -1;
+	}
+	tag = strrchr(list, '.');
+	tag = tag ? tag + 1 : list;
+
+	ekeylen = list_total_key(m, list, ekey);
+	if (ekeylen < 0)
+		return -1;
+	containerlen = ekeylen - sizeof ".total" + 1;
+	has_total = list_total(m, ekey, ekeylen, &total);
+
+	/* The element must exist */
+	n = snprintf(ekey + containerlen, KEY_MAX - containerlen,
+	    ".%s%u", tag, index);
+	if (n >= KEY_MAX - containerlen) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (!find_key(m, ekey, containerlen + n, &contentsz))
+		return -1;
+
+	/* Elements beyond the total do not count towards it */
+	if (has_total && index <= total)
+		total--;
+	snprintf(newtotal, sizeof newtotal, "%u", total);
+	edit = edit_new(m, EDIT_LIST_REMOVE, ekey, containerlen,
+	    has_total ? newtotal : NULL);
+	if (!edit)
+		return -1;
+	edit->listindex = index;
+	return 0;
+}
+
+/** Links element @a n into its hash bucket */
+static void
+field_link(struct list_field *f, unsigned int n)
+{
+	unsigned int *slot = &f->slots[f->values[n - 1].hash & (f->nslots - 1)];
+
+	f->values[n - 1].chain = *slot;
+	*slot = n;
+}
+
+/** Unlinks element @a n from its hash bucket */
+static void
+field_unlink(struct list_field *f, unsigned int n)
+{
+	unsigned int *p = &f->slots[f->values[n - 1].hash & (f->nslots - 1)];
+
+	while (*p && *p != n)
+		p = &f->values[*p - 1].chain;
+	if (*p)
+		*p = f->values[n - 1].chain;
+}
+
+/**
+ * Changes the number of elements indexed to a list's total.
+ * New elements are marked to be read.
+ * @retval -1 [ENOMEM]
+ */
+static int
+field_resize(struct list_field *f, unsigned int n)
+{
+	unsigned int nslots;
+	unsigned int i;
+
+	if (n > f->n) {
+		struct list_value *values;
+
+		values = realloc(f->values, n * sizeof *values);
+		if (!values) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(values + f->n, 0, (n - f->n) * sizeof *values);
+		for (i = f->n; i < n; i++)
+			values[i].dirty = 1;
+		f->ndirty += n - f->n;
+		f->values = values;
+	}
+	for (i = n; i < f->n; i++) {
+		if (f->values[i].dirty)
+			f->ndirty--;
+		free(f->values[i].value);
+	}
+	f->n = n;
+
+	/* Rebuild the buckets, growing them with the list */
+	for (nslots = 16; nslots < 2 * n; nslots *= 2)
+		;
+	if (nslots > f->nslots) {
+		unsigned int *slots = realloc(f->slots,
+		    nslots * sizeof *slots);
+
+		if (!slots) {
+			errno = ENOMEM;
+			return -1;
+		}
+		f->slots = slots;
+		f->nslots = nslots;
+	}
+	memset(f->slots, 0, f->nslots * sizeof *f->slots);
+	for (i = n; i > 0; i--)
+		if (!f->values[i - 1].dirty)
+			field_link(f, i);
+	return 0;
+}
+
+/**
+ * Reads again the field values of edited elements.
+ * @param ekey   storage of KEY_MAX bytes holding the container key
+ * @param tag    the list's tag, eg "tag"
+ */
+static int
+field_refresh(struct mxml *m, struct list_field *f, char *ekey,
+	int containerlen, const char *tag)
+{
+	unsigned int i;
+
+	for (i = 1; f->ndirty && i <= f->n; i++) {
+		struct list_value *v = &f->values[i - 1];
+		const char *content;
+		size_t contentsz;
+		int keylen;
+
+		if (!v->dirty)
+			continue;
+		if (v->value)
+			field_unlink(f, i);
+		free(v->value);
+		v->value = NULL;
+
+		keylen = snprintf(ekey + containerlen, KEY_MAX - containerlen,
+		    ".%s%u.%s", tag, i, f->field);
+		if (keylen >= KEY_MAX - containerlen) {
+			errno = ENOMEM;
+			return -1;
+		}
+		content = find_key(m, ekey, containerlen + keylen, &contentsz);
+		if (!content && errno != ENOENT)
+			return -1;
+		if (content) {
+			size_t len;
+
+			contentsz = unencode_xml_span(content, contentsz);
+			v->value = malloc(contentsz + 1);
+			if (!v->value) {
+				errno = ENOMEM;
+				return -1;
+			}
+			len = unencode_xml_into(content, contentsz, v->value);
+			v->value[len] = '\0';
+			v->hash = index_hash(v->value, len);
+			field_link(f, i);
+		}
+		v->dirty = 0;
+		f->ndirty--;
+	}
+	return 0;
+}
+
+int
+mxml_list_find(struct mxml *m, const char *list, const char *field,
+	const char *value)
+{
+	char ekey[KEY_MAX];	/* "tags.total", then "tags.tag<N>.field" */
+	int ekeylen;
+	int containerlen;	/* Length of "tags" */
+	const char *tag;
+	unsigned int total;
+	struct list *l;
+	struct list_field *f;
+	uint32_t hash;
+	unsigned int n, found;
+
+	if (!*field || strchr(field, '[')) {
+		errno = EINVAL;
+		return -1;
+	}
+	tag = strrchr(list, '.');
+	tag = tag ? tag + 1 : list;
+
+	ekeylen = list_total_key(m, list, ekey);
+	if (ekeylen < 0)
+		return -1;
+	containerlen = ekeylen - sizeof ".total" + 1;
+	if (!list_total(m, ekey, ekeylen, &total) || !total) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	l = list_get(m, ekey, containerlen, 1);
+	if (!l)
+		return -1;
+	for (f = l->fields; f; f = f->next)
+		if (strcmp(f->field, field) == 0)
+			break;
+	if (!f) {
+		f = calloc(1, sizeof *f + strlen(field) + 1);
+		if (!f) {
+			errno = ENOMEM;
+			return -1;
+		}
+		strcpy(f->field, field);
+		f->next = l->fields;
+		l->fields = f;
+	}
+	if (total != f->n && field_resize(f, total) == -1)
+		return -1;
+	if (field_refresh(m, f, ekey, containerlen, tag) == -1)
+		return -1;
+
+	/* The lowest numbered element with the value */
+	hash = index_hash(value, strlen(value));
+	found = 0;
+	for (n = f->slots[hash & (f->nslots - 1)]; n;
+	     n = f->values[n - 1].chain)
+		if (f->values[n - 1].hash == hash &&
+		    strcmp(f->values[n - 1].value, value) == 0 &&
+		    (!found || n < found))
+			found = n;
+	if (!found) {
+		errno = ENOENT;
+		return -1;
+	}
+	return found;
+}
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE /* memrchr */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * A node handle remembers where an element's content lies, so that
+ * lookups under the element and walks over its children continue
+ * from there instead of starting again from the document's root.
+ *
+ * A node's spans are those of the document (or of a replacement
+ * fragment), so nodes are only made for elements that have no edits
+ * inside them, and any later edit makes existing nodes stale.
+ */
+
+/** Tests that a node is still usable.
+ *  @retval -1 [ESTALE] an edit has been made since it was found */
+static int
+node_check(const struct mxml *m, const struct mxml_node *node)
+{
+	if (node->gen != m->gen) {
+		errno = ESTALE;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Makes a node for the element at a cursor.
+ * @param c      cursor at the '<' of the element's open tag
+ * @param parent the parent's key and length
+ * @retval NULL [ENOMEM]
+ */
+static struct mxml_node *
+node_at(const struct mxml *m, struct cursor *c, const char *parent,
+	int parentlen)
+{
+	struct mxml_node *node;
+	const char *tag;
+	int taglen;
+	const char *data;
+	size_t size;
+
+	data = cursor_eat_element(c, &tag, &taglen, &size);
+	if (parentlen + 1 + taglen > KEY_MAX) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	node = malloc(sizeof *node);
+	if (!node)
+		return NULL;
+	node->data = data;
+	node->size = size;
+	node->parentend = c->end;
+	node->gen = m->gen;
+	node->keylen = snprintf(node->key, sizeof node->key, "%.*s%s%.*s",
+	    parentlen, parent, parentlen ? "." : "", taglen, tag);
+	return node;
+}
+
+struct mxml_node *
+mxml_find_node(struct mxml *m, const char *key)
+{
+	struct mxml_node *node;
+	char ekey[KEY_MAX];
+	int ekeylen;
+	const char *dot;
+	const char *data;
+	size_t size;
+	const char *parent;
+	size_t parentsz;
+
+	ekeylen = expand_key(m, ekey, sizeof ekey, key);
+	if (ekeylen < 0)
+		return NULL;
+	data = find_key(m, ekey, ekeylen, &size);
+	if (!data)
+		return NULL;
+	if (subtree_is_edited(m, ekey, ekeylen)) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	/* Remember the end of the parent, for finding siblings */
+	dot = memrchr(ekey, '.', ekeylen);
+	if (!dot) {
+		parent = m->start;
+		parentsz = m->size;
+	} else if (!(parent = find_key(m, ekey, dot - ekey, &parentsz)))
+		return NULL;
+
+	node = malloc(sizeof *node);
+	if (!node)
+		return NULL;
+	node->gen = m->gen;
+	node->data = data;
+	node->size = size;
+	node->parentend = parent + parentsz;
+	memcpy(node->key, ekey, ekeylen);
+	node->key[ekeylen] = '\0';
+	node->keylen = ekeylen;
+	return node;
+}
+
+char *
+mxml_node_get(struct mxml *m, const struct mxml_node *node,
+	const char *relkey)
+{
+	const char *content;
+	size_t contentsz;
+
+	if (node_check(m, node) == -1)
+		return NULL;
+	if (!relkey)
+		relkey = "";
+	if (strchr(relkey, '[')) {
+		errno = EINVAL;
+		return NULL;
+	}
+	content = find_in_span(node->data, node->size, relkey,
+	    strlen(relkey), &contentsz);
+	if (!content)
+		return NULL;
+	return unencode_xml(m, content, contentsz);
+}
+
+const char *
+mxml_node_key(const struct mxml_node *node)
+{
+	return node->key;
+}
+
+struct mxml_node *
+mxml_node_first_child(struct mxml *m, const struct mxml_node *node)
+{
+	struct cursor c;
+
+	if (node_check(m, node) == -1)
+		return NULL;
+	c.pos = node->data;
+	c.end = node->data + node->size;
+	cursor_skip_content(&c);
+	if (cursor_is_at_eof(&c) || cursor_is_at(&c, "</")) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return node_at(m, &c, node->key, node->keylen);
+}
+
+struct mxml_node *
+mxml_node_next_sibling(struct mxml *m, const struct mxml_node *node)
+{
+	const char *dot;
+	int parentlen;
+	struct cursor c;
+
+	if (node_check(m, node) == -1)
+		return NULL;
+	/* Edits beside the node would not be seen */
+	dot = memrchr(node->key, '.', node->keylen);
+	parentlen = dot ? dot - node->key : 0;
+	if (dot ? subtree_is_edited(m, node->key, parentlen) : !!m->edits) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	/* Skip over the node's </tag> */
+	c.pos = node->data + node->size;
+	c.end = node->parentend;
+	cursor_skip_to_ch(&c, '>');
+	cursor_eatch(&c, '>');
+	cursor_skip_content(&c);
+	if (cursor_is_at_eof(&c) || cursor_is_at(&c, "</")) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return node_at(m, &c, node->key, parentlen);
+}
+
+void
+mxml_node_free(struct mxml_node *node)
+{
+	free(node);
+}
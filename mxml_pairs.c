@@ -0,0 +1,199 @@
+#include <string.h>
+#include <errno.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * Key/value pairs are taken from the flattened token stream in one pass.
+ * A leaf is an element whose OPEN is followed only by VALUEs and then its
+ * CLOSE. An OPEN is held as a candidate leaf until either a nested OPEN
+ * shows it to be a container, or its CLOSE arrives and the leaf is
+ * reported with its accumulated value.
+ */
+
+struct pairs_context {
+	const char *prefix;
+	int prefixlen;
+	int (*cb)(void *context, const char *key, const char *value);
+	void *context;
+	int ret;		/* Non-zero value returned by cb */
+	int leaf;		/* key[] holds a candidate leaf */
+	char key[KEY_MAX + 1];
+	int keylen;
+	char *value;		/* Decoded value of the candidate */
+	size_t valuelen;
+	size_t valuealloc;
+};
+
+/** Tests if a key is the prefix, or lies under it */
+static int
+pairs_match(const struct pairs_context *c, const char *key, int keylen)
+{
+	return !c->prefixlen ||
+		(keylen >= c->prefixlen &&
+		 memcmp(key, c->prefix, c->prefixlen) == 0 &&
+		 (keylen == c->prefixlen || key[c->prefixlen] == '.'));
+}
+
+/** Ensures room for @a n more value bytes and a NUL.
+ *  @retval -1 [ENOMEM] */
+static int
+pairs_reserve(struct pairs_context *c, size_t n)
+{
+	size_t alloc = c->valuealloc ? c->valuealloc : 256;
+	char *value;
+
+	if (c->valuelen + n + 1 <= c->valuealloc)
+		return 0;
+	while (c->valuelen + n + 1 > alloc)
+		alloc *= 2;
+	value = realloc(c->value, alloc);
+	if (!value) {
+		errno = ENOMEM;
+		return -1;
+	}
+	c->value = value;
+	c->valuealloc = alloc;
+	return 0;
+}
+
+/** Appends value text to the candidate leaf, decoding it if
+ *  it came from the XML source.
+ *  @retval -1 [ENOMEM] */
+static int
+pairs_value(struct pairs_context *c, const struct token *token)
+{
+	/* Decoded text is never longer than its encoding */
+	if (pairs_reserve(c, token->valuelen) == -1)
+		return -1;
+	if (token->escape) {
+		/* User text is held unencoded */
+		memcpy(c->value + c->valuelen, token->value, token->valuelen);
+		c->valuelen += token->valuelen;
+	} else
+		c->valuelen += unencode_xml_into(token->value,
+		    token->valuelen, c->value + c->valuelen);
+	return 0;
+}
+
+static size_t
+pairs_token(void *context, const struct token *token)
+{
+	struct pairs_context *c = context;
+
+	switch (token->type) {
+	case TOK_OPEN:
+		c->leaf = pairs_match(c, token->key, token->keylen);
+		if (c->leaf) {
+			memcpy(c->key, token->key, token->keylen);
+			c->key[token->keylen] = '\0';
+			c->keylen = token->keylen;
+			c->valuelen = 0;
+		}
+		break;
+	case TOK_VALUE:
+		if (c->leaf && token->keylen == c->keylen &&
+		    pairs_value(c, token) == -1)
+			return -1;
+		break;
+	case TOK_CLOSE:
+		if (c->leaf && token->keylen == c->keylen) {
+			c->leaf = 0;
+			if (pairs_reserve(c, 0) == -1)
+				return -1;
+			c->value[c->valuelen] = '\0';
+			c->ret = c->cb(c->context, c->key, c->value);
+			if (c->ret)
+				return -1;
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+int
+mxml_foreach_pair(const struct mxml *m, const char *prefix,
+	int (*cb)(void *context, const char *key, const char *value),
+	void *context)
+{
+	struct pairs_context c;
+	size_t ret;
+
+	memset(&c, 0, sizeof c);
+	c.prefix = prefix ? prefix : "";
+	c.prefixlen = strlen(c.prefix);
+	c.cb = cb;
+	c.context = context;
+	ret = flatten_edits(m, pairs_token, &c);
+	free(c.value);
+	if (c.ret)
+		return c.ret;
+	return ret == -1 ? -1 : 0;
+}
+
+struct write_pairs_context {
+	size_t (*writefn)(const void *ptr, size_t size, size_t nmemb,
+		void *context);
+	void *context;
+	size_t ret;
+};
+
+/** Writes some text; a short write stops the iteration */
+static int
+write_pairs_out(struct write_pairs_context *w, const char *s, size_t len)
+{
+	size_t n;
+
+	if (!len)
+		return 0;
+	n = w->writefn(s, 1, len, w->context);
+	if (n == -1) {
+		w->ret = -1;
+		return -1;
+	}
+	w->ret += n;
+	return n < len ? 1 : 0;
+}
+
+static int
+write_pairs_cb(void *context, const char *key, const char *value)
+{
+	struct write_pairs_context *w = context;
+	const char *special;
+	int ret;
+
+	if ((ret = write_pairs_out(w, key, strlen(key))) ||
+	    (ret = write_pairs_out(w, "=", 1)))
+		return ret;
+	/* Escape \ and newlines so that each pair is one line */
+	while ((special = strpbrk(value, "\\\n"))) {
+		if ((ret = write_pairs_out(w, value, special - value)) ||
+		    (ret = write_pairs_out(w, *special == '\n' ? "\\n" : "\\\\",
+		    2)))
+			return ret;
+		value = special + 1;
+	}
+	if ((ret = write_pairs_out(w, value, strlen(value))) ||
+	    (ret = write_pairs_out(w, "\n", 1)))
+		return ret;
+	return 0;
+}
+
+size_t
+mxml_write_pairs(const struct mxml *m, const char *prefix,
+	size_t (*writefn)(const void *ptr, size_t size, size_t nmemb, void *context),
+	void *context)
+{
+	struct write_pairs_context w;
+
+	w.writefn = writefn;
+	w.context = context;
+	w.ret = 0;
+	if (mxml_foreach_pair(m, prefix, write_pairs_cb, &w) == -1 &&
+	    w.ret != -1)
+		return -1;
+	return w.ret;
+}
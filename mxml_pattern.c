@@ -0,0 +1,162 @@
+#include <string.h>
+#include <errno.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * A key pattern is a dotted key whose segments may be "*", matching
+ * any one tag, or "**", matching any number of tags. It is run as a
+ * set of pattern positions, one bit each, that is stepped by each tag
+ * on the way down from the root. Position nsegs is the match.
+ */
+
+/**
+ * Compiles a key pattern.
+ * The segments refer into @a text, which must outlive the pattern.
+ * @returns a new pattern; release it with #free()
+ * @retval NULL [EINVAL] the pattern is malformed or too long
+ * @retval NULL [ENOMEM] out of memory
+ */
+struct pattern *
+pattern_new(const char *text, int textlen)
+{
+	struct pattern *p;
+	unsigned int nsegs = 1;
+	const char *seg = text;
+	const char *end = text + textlen;
+	int i;
+
+	for (i = 0; i < textlen; i++)
+		if (text[i] == '.')
+			nsegs++;
+	if (nsegs > PATTERN_SEGS_MAX || memchr(text, '[', textlen)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	p = malloc(sizeof *p + nsegs * sizeof *p->segs);
+	if (!p) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	p->text = text;
+	p->nsegs = 0;
+	for (;;) {
+		const char *dot = memchr(seg, '.', end - seg);
+		int seglen = (dot ? dot : end) - seg;
+		struct pattern_seg *s = &p->segs[p->nsegs++];
+
+		if (!seglen) {
+			free(p);
+			errno = EINVAL;
+			return NULL;
+		}
+		s->off = seg - text;
+		s->len = seglen;
+		if (seglen == 2 && memcmp(seg, "**", 2) == 0)
+			s->type = PATTERN_ANYS;
+		else if (seglen == 1 && *seg == '*')
+			s->type = PATTERN_ANY;
+		else
+			s->type = PATTERN_TAG;
+		if (!dot)
+			return p;
+		seg = dot + 1;
+	}
+}
+
+/** Adds the positions that follow "**" segments, which may match
+ *  no tags */
+static uint64_t
+pattern_closure(const struct pattern *p, uint64_t set)
+{
+	unsigned int i;
+
+	for (i = 0; i < p->nsegs; i++)
+		if ((set & (1ull << i)) && p->segs[i].type == PATTERN_ANYS)
+			set |= 1ull << (i + 1);
+	return set;
+}
+
+/** Returns the set of positions before any tags are matched */
+uint64_t
+pattern_start(const struct pattern *p)
+{
+	return pattern_closure(p, 1);
+}
+
+/** Steps a set of positions over a child's tag */
+uint64_t
+pattern_step(const struct pattern *p, uint64_t set, const char *tag,
+	int taglen)
+{
+	uint64_t next = 0;
+	unsigned int i;
+
+	for (i = 0; set && i < p->nsegs; i++) {
+		const struct pattern_seg *s = &p->segs[i];
+
+		if (!(set & (1ull << i)))
+			continue;
+		if (s->type == PATTERN_ANYS)
+			next |= 1ull << i;
+		else if (s->type == PATTERN_ANY ||
+		    (s->len == taglen &&
+		     memcmp(p->text + s->off, tag, taglen) == 0))
+			next |= 1ull << (i + 1);
+	}
+	return pattern_closure(p, next);
+}
+
+/** Tests if a set holds the match */
+int
+pattern_accepts(const struct pattern *p, uint64_t set)
+{
+	return (set >> p->nsegs) & 1;
+}
+
+/** Tests if elements below those of a set may match */
+int
+pattern_descends(const struct pattern *p, uint64_t set)
+{
+	return (set & ((1ull << p->nsegs) - 1)) != 0;
+}
+
+/**
+ * Steps a pattern over the tags of a key.
+ * @param matched_return storage for whether the key or one of its
+ *                       parents matched
+ * @returns the set of positions after the key's last tag, or 0 if
+ *          nothing under the key can match
+ */
+uint64_t
+pattern_walk(const struct pattern *p, const char *key, int keylen,
+	int *matched_return)
+{
+	uint64_t set = pattern_start(p);
+	const char *end = key + keylen;
+
+	*matched_return = 0;
+	while (keylen && set) {
+		const char *dot = memchr(key, '.', end - key);
+		const char *tagend = dot ? dot : end;
+
+		set = pattern_step(p, set, key, tagend - key);
+		if (pattern_accepts(p, set))
+			*matched_return = 1;
+		if (!dot)
+			break;
+		key = dot + 1;
+	}
+	return set;
+}
+
+/** Tests if a key, or one of its parents, matches a pattern */
+int
+pattern_match(const struct pattern *p, const char *key, int keylen)
+{
+	int matched;
+
+	pattern_walk(p, key, keylen, &matched);
+	return matched;
+}
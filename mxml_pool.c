@@ -0,0 +1,425 @@
+#include <string.h>
+#include <errno.h>
+
+#include "mxml_int.h"
+
+/*
+ * A string pool for the edit journal.
+ *
+ * Keys are interned as a tree of path nodes. Each node is a
+ * (parent node, tag atom) pair, where an atom is an interned tag name.
+ * Node 0 is the empty path, and is the parent of all top-level tags.
+ *
+ *     "a.b.c"  ->  node 3 = (node 2, atom "c")
+ *                  node 2 = (node 1, atom "b")
+ *                  node 1 = (node 0, atom "a")
+ *
+ * Edits with the same key share a node, and keys with the same prefix
+ * share the prefix's nodes. Equal keys have equal node ids, so that
+ * keys can be compared as integers. A node's dotted key text is only
+ * materialized when an edit refers to it.
+ *
+ * Short values are deduplicated; longer ones are simply copied.
+ * All pool strings live in an arena released by #pool_free().
+ */
+
+#define POOL_CHUNK		4096
+#define POOL_SHORT_VALUE	32	/* Longest value to deduplicate */
+
+struct pool_chunk {
+	struct pool_chunk *next;
+	char data[];
+};
+
+/** Allocates storage from the pool's arena.
+ *  Large requests get a chunk of their own. */
+static char *
+pool_alloc(struct pool *p, size_t size)
+{
+	struct pool_chunk *chunk;
+	char *ret;
+
+	if (size <= p->avail) {
+		ret = p->next;
+		p->next += size;
+		p->avail -= size;
+		return ret;
+	}
+	if (size > POOL_CHUNK / 4) {
+		chunk = malloc(sizeof *chunk + size);
+		if (!chunk)
+			return NULL;
+		if (p->chunks) {
+			/* Keep the current chunk at the head */
+			chunk->next = p->chunks->next;
+			p->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			p->chunks = chunk;
+		}
+		return chunk->data;
+	}
+	chunk = malloc(sizeof *chunk + POOL_CHUNK);
+	if (!chunk)
+		return NULL;
+	chunk->next = p->chunks;
+	p->chunks = chunk;
+	p->next = chunk->data + size;
+	p->avail = POOL_CHUNK - size;
+	return chunk->data;
+}
+
+/** Copies a string into the arena, with a NUL terminator */
+static const char *
+pool_strndup(struct pool *p, const char *s, size_t len)
+{
+	char *ret = pool_alloc(p, len + 1);
+
+	if (!ret)
+		return NULL;
+	memcpy(ret, s, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+/**
+ * Grows an open-addressed hash table of ids when it is half full.
+ * Table slots hold id+1, or 0 when empty.
+ * @param rehash function returning the hash of an id
+ * @retval -1 [ENOMEM]
+ */
+static int
+slots_grow(const struct pool *p, uint32_t **slots, uint32_t *nslots,
+	uint32_t nused, uint32_t (*rehash)(const struct pool *, uint32_t))
+{
+	uint32_t n = *nslots ? *nslots * 2 : 64;
+	uint32_t *newslots;
+	uint32_t i;
+
+	if (nused < *nslots / 2)
+		return 0;
+	newslots = calloc(n, sizeof *newslots);
+	if (!newslots) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < *nslots; i++) {
+		uint32_t id = (*slots)[i];
+		uint32_t h;
+
+		if (!id)
+			continue;
+		for (h = rehash(p, id - 1); newslots[h & (n - 1)]; h++)
+			;
+		newslots[h & (n - 1)] = id;
+	}
+	free(*slots);
+	*slots = newslots;
+	*nslots = n;
+	return 0;
+}
+
+/** Grows an array of elements to hold at least one more */
+static int
+array_grow(void **array, uint32_t *alloc, uint32_t n, size_t elsz)
+{
+	uint32_t newalloc;
+	void *newarray;
+
+	if (n < *alloc)
+		return 0;
+	newalloc = *alloc ? *alloc * 2 : 64;
+	newarray = realloc(*array, newalloc * elsz);
+	if (!newarray) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*array = newarray;
+	*alloc = newalloc;
+	return 0;
+}
+
+static uint32_t
+str_hash(const struct strtab *t, uint32_t id)
+{
+	return t->strs[id].hash;
+}
+
+static uint32_t
+atom_rehash(const struct pool *p, uint32_t id)
+{
+	return str_hash(&p->atoms, id);
+}
+
+static uint32_t
+value_rehash(const struct pool *p, uint32_t id)
+{
+	return str_hash(&p->values, id);
+}
+
+/**
+ * Interns a string in a string table.
+ * @returns the string's id in the table
+ * @retval -1 [ENOMEM]
+ */
+static long
+strtab_intern(struct pool *p, struct strtab *t,
+	uint32_t (*rehash)(const struct pool *, uint32_t),
+	const char *s, size_t len)
+{
+	uint32_t hash = index_hash(s, len);
+	uint32_t h;
+	struct pool_str *str;
+
+	if (t->nslots) {
+		for (h = hash; t->slots[h & (t->nslots - 1)]; h++) {
+			str = &t->strs[t->slots[h & (t->nslots - 1)] - 1];
+			if (str->hash == hash && str->len == len &&
+			    memcmp(str->s, s, len) == 0)
+				return str - t->strs;
+		}
+	}
+	if (slots_grow(p, &t->slots, &t->nslots, t->n, rehash) == -1 ||
+	    array_grow((void **)&t->strs, &t->alloc, t->n, sizeof *t->strs)
+	    == -1)
+		return -1;
+	str = &t->strs[t->n];
+	str->s = pool_strndup(p, s, len);
+	if (!str->s) {
+		errno = ENOMEM;
+		return -1;
+	}
+	str->len = len;
+	str->hash = hash;
+	for (h = hash; t->slots[h & (t->nslots - 1)]; h++)
+		;
+	t->slots[h & (t->nslots - 1)] = ++t->n;
+	return t->n - 1;
+}
+
+/** Finds a string in a string table, without interning it.
+ *  @retval -1 not found */
+static long
+strtab_find(const struct strtab *t, const char *s, size_t len)
+{
+	uint32_t hash = index_hash(s, len);
+	uint32_t h;
+
+	if (!t->nslots)
+		return -1;
+	for (h = hash; t->slots[h & (t->nslots - 1)]; h++) {
+		const struct pool_str *str =
+			&t->strs[t->slots[h & (t->nslots - 1)] - 1];
+		if (str->hash == hash && str->len == len &&
+		    memcmp(str->s, s, len) == 0)
+			return str - t->strs;
+	}
+	return -1;
+}
+
+static uint32_t
+node_hash(uint32_t parent, uint32_t atom)
+{
+	return (parent * 0x9e3779b1u) ^ (atom * 0x85ebca6bu);
+}
+
+static uint32_t
+node_rehash(const struct pool *p, uint32_t id)
+{
+	return node_hash(p->nodes[id].parent, p->nodes[id].atom);
+}
+
+/** Finds the child of a node, without interning it.
+ *  @retval -1 not found */
+static long
+node_find(const struct pool *p, uint32_t parent, uint32_t atom)
+{
+	uint32_t h;
+
+	if (!p->nodeslots)
+		return -1;
+	for (h = node_hash(parent, atom);
+	     p->nodetab[h & (p->nodeslots - 1)]; h++)
+	{
+		uint32_t id = p->nodetab[h & (p->nodeslots - 1)] - 1;
+		if (p->nodes[id].parent == parent && p->nodes[id].atom == atom)
+			return id;
+	}
+	return -1;
+}
+
+struct pool *
+pool_new(void)
+{
+	struct pool *p = calloc(1, sizeof *p);
+
+	if (!p)
+		return NULL;
+	/* Node 0 is the empty path */
+	if (array_grow((void **)&p->nodes, &p->nodealloc, 0,
+	    sizeof *p->nodes) == -1)
+	{
+		free(p);
+		return NULL;
+	}
+	memset(&p->nodes[0], 0, sizeof p->nodes[0]);
+	p->nodes[0].key = "";
+	p->nnodes = 1;
+	return p;
+}
+
+void
+pool_free(struct pool *p)
+{
+	struct pool_chunk *chunk;
+
+	if (!p)
+		return;
+	while ((chunk = p->chunks)) {
+		p->chunks = chunk->next;
+		free(chunk);
+	}
+	free(p->atoms.strs);
+	free(p->atoms.slots);
+	free(p->values.strs);
+	free(p->values.slots);
+	free(p->nodes);
+	free(p->nodetab);
+	free(p);
+}
+
+long
+pool_intern_key(struct pool *p, const char *key, int keylen)
+{
+	const char *end = key + keylen;
+	uint32_t id = 0;
+
+	if (!keylen)
+		return 0;
+	for (;;) {
+		const char *dot = memchr(key, '.', end - key);
+		const char *tagend = dot ? dot : end;
+		long atom = strtab_intern(p, &p->atoms, atom_rehash,
+			key, tagend - key);
+		long child;
+		struct pool_node *node;
+
+		if (atom == -1)
+			return -1;
+		child = node_find(p, id, atom);
+		if (child == -1) {
+			if (slots_grow(p, &p->nodetab, &p->nodeslots,
+			    p->nnodes, node_rehash) == -1 ||
+			    array_grow((void **)&p->nodes, &p->nodealloc,
+			    p->nnodes, sizeof *p->nodes) == -1)
+				return -1;
+			child = p->nnodes++;
+			node = &p->nodes[child];
+			node->parent = id;
+			node->atom = atom;
+			node->depth = p->nodes[id].depth + 1;
+			node->keylen = tagend - (end - keylen);
+			node->key = NULL;
+			{
+				uint32_t h;
+				for (h = node_hash(id, atom);
+				     p->nodetab[h & (p->nodeslots - 1)]; h++)
+					;
+				p->nodetab[h & (p->nodeslots - 1)] = child + 1;
+			}
+		}
+		id = child;
+		if (!dot)
+			return id;
+		key = dot + 1;
+	}
+}
+
+const char *
+pool_key(struct pool *p, uint32_t id)
+{
+	struct pool_node *node = &p->nodes[id];
+	char *key;
+	char *end;
+
+	if (node->key)
+		return node->key;
+	key = pool_alloc(p, node->keylen + 1);
+	if (!key) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	/* Fill in the tags from the last to the first */
+	end = key + node->keylen;
+	*end = '\0';
+	for (;;) {
+		const struct pool_str *atom = &p->atoms.strs[node->atom];
+
+		end -= atom->len;
+		memcpy(end, atom->s, atom->len);
+		if (!node->parent)
+			break;
+		*--end = '.';
+		node = &p->nodes[node->parent];
+	}
+	p->nodes[id].key = key;
+	return key;
+}
+
+const char *
+pool_value(struct pool *p, const char *value, size_t len)
+{
+	const char *ret;
+	long id;
+
+	if (!len)
+		return "";
+	if (len > POOL_SHORT_VALUE) {
+		ret = pool_strndup(p, value, len);
+		if (!ret)
+			errno = ENOMEM;
+		return ret;
+	}
+	id = strtab_intern(p, &p->values, value_rehash, value, len);
+	if (id == -1)
+		return NULL;
+	return p->values.strs[id].s;
+}
+
+unsigned int
+pool_find_path(const struct pool *p, const char *key, int keylen,
+	uint32_t *path, unsigned int maxdepth, int *complete_return)
+{
+	const char *end = key + keylen;
+	unsigned int depth = 0;
+
+	path[0] = 0;
+	*complete_return = 1;
+	if (!keylen)
+		return 0;
+	for (;;) {
+		const char *dot = memchr(key, '.', end - key);
+		const char *tagend = dot ? dot : end;
+		long atom = strtab_find(&p->atoms, key, tagend - key);
+		long child;
+
+		if (atom == -1 || depth == maxdepth ||
+		    (child = node_find(p, path[depth], atom)) == -1)
+		{
+			*complete_return = 0;
+			return depth;
+		}
+		path[++depth] = child;
+		if (!dot)
+			return depth;
+		key = dot + 1;
+	}
+}
+
+uint32_t
+pool_ancestor(const struct pool *p, uint32_t id, unsigned int depth)
+{
+	while (p->nodes[id].depth > depth)
+		id = p->nodes[id].parent;
+	return id;
+}
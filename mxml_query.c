@@ -0,0 +1,291 @@
+#define _GNU_SOURCE /* memrchr */
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * A query steps a key pattern (see mxml_pattern.c) down from the root.
+ * An element whose set of pattern positions is empty cannot contain a
+ * match, and is skipped with #cursor_skip_to_close().
+ *
+ * Unedited elements are walked directly in the document. An element
+ * with an edit to one of its children is flattened with the edits
+ * under it, and its tokens are stepped through the same sets.
+ */
+
+struct query {
+	const struct mxml *m;
+	struct pattern *pattern;
+	int (*cb)(void *context, const char *key, const char *value);
+	void *context;
+	int ret;		/* Non-zero value returned by cb */
+	char *value;		/* Decoded value being reported */
+	size_t valuelen;
+	size_t valuealloc;
+
+	/* Token stream state; see query_token() */
+	unsigned int depth;
+	uint64_t sets[KEY_MAX / 2 + 2];	/* Position sets by depth */
+	int match;		/* key[] is a match awaiting its value */
+	char key[KEY_MAX + 1];
+	int keylen;
+};
+
+/** Ensures room for @a n more value bytes and a NUL.
+ *  @retval -1 [ENOMEM] */
+static int
+query_reserve(struct query *q, size_t n)
+{
+	size_t alloc = q->valuealloc ? q->valuealloc : 256;
+	char *value;
+
+	if (q->valuelen + n + 1 <= q->valuealloc)
+		return 0;
+	while (q->valuelen + n + 1 > alloc)
+		alloc *= 2;
+	value = realloc(q->value, alloc);
+	if (!value) {
+		errno = ENOMEM;
+		return -1;
+	}
+	q->value = value;
+	q->valuealloc = alloc;
+	return 0;
+}
+
+/** Reports a match with the value gathered in q->value.
+ *  @retval -1 the callback stopped the query */
+static int
+query_report(struct query *q, const char *key)
+{
+	if (query_reserve(q, 0) == -1)
+		return -1;
+	q->value[q->valuelen] = '\0';
+	q->ret = q->cb(q->context, key, q->value);
+	return q->ret ? -1 : 0;
+}
+
+static size_t
+query_token(void *context, const struct token *token)
+{
+	struct query *q = context;
+	const char *tag;
+
+	switch (token->type) {
+	case TOK_OPEN:
+		/* A container's value is the text before its first child */
+		if (q->match) {
+			q->match = 0;
+			if (query_report(q, q->key) == -1)
+				return -1;
+		}
+		tag = memrchr(token->key, '.', token->keylen);
+		tag = tag ? tag + 1 : token->key;
+		q->depth++;
+		q->sets[q->depth] = pattern_step(q->pattern, q->sets[q->depth - 1], tag,
+		    token->keylen - (tag - token->key));
+		if (pattern_accepts(q->pattern, q->sets[q->depth])) {
+			memcpy(q->key, token->key, token->keylen);
+			q->key[token->keylen] = '\0';
+			q->keylen = token->keylen;
+			q->valuelen = 0;
+			q->match = 1;
+		}
+		break;
+	case TOK_VALUE:
+		if (q->match && token->keylen == q->keylen) {
+			if (query_reserve(q, token->valuelen) == -1)
+				return -1;
+			if (token->escape) {
+				/* User text is held unencoded */
+				memcpy(q->value + q->valuelen, token->value,
+				    token->valuelen);
+				q->valuelen += token->valuelen;
+			} else
+				q->valuelen += unencode_xml_into(token->value,
+				    token->valuelen, q->value + q->valuelen);
+		}
+		break;
+	case TOK_CLOSE:
+		q->depth--;
+		if (q->match && token->keylen == q->keylen) {
+			q->match = 0;
+			if (query_report(q, q->key) == -1)
+				return -1;
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/**
+ * Tests how the edits affect an element.
+ * @param direct_return storage for whether an edit is of one of
+ *                      the element's children
+ * @returns whether any edit lies under the element
+ */
+static int
+query_edits_under(const struct mxml *m, const char *key, int keylen,
+	int *direct_return)
+{
+	const struct edit *e;
+	int under = 0;
+
+	*direct_return = 0;
+	for (e = m->edits; e; e = e->next) {
+		if (strncmp(e->key, key, keylen) != 0 || e->key[keylen] != '.')
+			continue;
+		under = 1;
+		if (!strchr(e->key + keylen + 1, '.')) {
+			*direct_return = 1;
+			break;
+		}
+	}
+	return under;
+}
+
+/**
+ * Flattens one element with the edits under it, into query_token().
+ * @param start the element's open tag
+ * @param end   the end of its close tag
+ * @param key   the element's key
+ */
+static int
+query_flatten(struct query *q, const char *start, const char *end,
+	const char *key, int keylen, uint64_t set)
+{
+	q->depth = 0;
+	q->sets[0] = set;
+	q->match = 0;
+	return flatten_element(q->m, start, end - start, key, keylen,
+	    query_token, q) == -1 ? -1 : 0;
+}
+
+/**
+ * Walks the children of an element in the document.
+ * @param c       cursor over the element's content
+ * @param key     storage of KEY_MAX bytes holding the element's key
+ * @param set     the element's pattern positions
+ * @param edited  some edits may lie under the element
+ */
+static int
+query_walk(struct query *q, struct cursor *c, char *key, int keylen,
+	uint64_t set, int edited)
+{
+	cursor_skip_content(c);
+	while (!cursor_is_at_eof(c) && !cursor_is_at(c, "</")) {
+		const char *start = c->pos;
+		const char *tag;
+		int taglen;
+		const char *data;
+		size_t size;
+		uint64_t childset;
+		int childlen;
+		int under = 0, direct = 0;
+
+		data = cursor_eat_element(c, &tag, &taglen, &size);
+
+		/* Prune elements that cannot contain a match */
+		childset = pattern_step(q->pattern, set, tag, taglen);
+		if (!childset) {
+			cursor_skip_content(c);
+			continue;
+		}
+
+		childlen = keylen + !!keylen + taglen;
+		if (childlen >= KEY_MAX) {
+			errno = ENOMEM;
+			return -1;
+		}
+		if (keylen)
+			key[keylen] = '.';
+		memcpy(key + keylen + !!keylen, tag, taglen);
+		key[childlen] = '\0';
+
+		if (edited)
+			under = query_edits_under(q->m, key, childlen, &direct);
+		if (direct) {
+			if (query_flatten(q, start, c->pos, key, childlen,
+			    set) == -1)
+				return -1;
+		} else {
+			if (pattern_accepts(q->pattern, childset)) {
+				q->valuelen = 0;
+				if (query_reserve(q, unencode_xml_span(data,
+				    size)) == -1)
+					return -1;
+				q->valuelen = unencode_xml_into(data, size,
+				    q->value);
+				if (query_report(q, key) == -1)
+					return -1;
+			}
+			if (pattern_descends(q->pattern, childset)) {
+				struct cursor cc;
+
+				cc.pos = data;
+				cc.end = data + size;
+				if (query_walk(q, &cc, key, childlen, childset,
+				    under) == -1)
+					return -1;
+			}
+		}
+		key[keylen] = '\0';
+		cursor_skip_content(c);
+	}
+	return 0;
+}
+
+int
+mxml_query(const struct mxml *m, const char *pattern,
+	int (*cb)(void *context, const char *key, const char *value),
+	void *context)
+{
+	struct query *q;
+	const struct edit *e;
+	char key[KEY_MAX];
+	struct cursor c;
+	int serial = 0;
+	int ret;
+
+	q = calloc(1, sizeof *q);
+	if (!q) {
+		errno = ENOMEM;
+		return -1;
+	}
+	q->m = m;
+	q->cb = cb;
+	q->context = context;
+	q->pattern = pattern_new(pattern, strlen(pattern));
+	if (!q->pattern) {
+		free(q);
+		return -1;
+	}
+
+	/* Moves, pattern deletes and edits of top-level elements
+	 * need the whole document */
+	for (e = m->edits; e; e = e->next)
+		if (e->op == EDIT_MOVE || e->op == EDIT_DELETE_MATCHING ||
+		    !strchr(e->key, '.'))
+			serial = 1;
+	if (serial) {
+		q->sets[0] = pattern_start(q->pattern);
+		ret = flatten_edits(m, query_token, q) == -1 ? -1 : 0;
+	} else {
+		c.pos = m->start;
+		c.end = m->start + m->size;
+		key[0] = '\0';
+		ret = query_walk(q, &c, key, 0, pattern_start(q->pattern),
+		    m->edits != NULL);
+	}
+	if (q->ret)
+		ret = q->ret;
+	free(q->pattern);
+	free(q->value);
+	free(q);
+	return ret;
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * A snapshot file holds a flattened XML document together with its
+ * index, laid out so that it can be mapped and used without scanning.
+ *
+ *     struct snapshot_header
+ *     (serialized index; see mxml_index.c)
+ *     char doc[docsz]                        (the XML document)
+ *
+ * Integers are in host order; a foreign snapshot is rejected by
+ * its magic number.
+ */
+
+#define SNAPSHOT_MAGIC		0x4d584d53	/* "MXMS" */
+#define SNAPSHOT_VERSION	1
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t filesz;	/* Total size of the snapshot file */
+	uint64_t srcsz;		/* Size of the XML it holds */
+	uint64_t srcsum;	/* #index_checksum() of that XML */
+	uint64_t doc_off;
+	uint64_t docsz;
+	struct index_layout index;
+};
+
+/* Accumulates the flattened document in memory */
+struct snapshot_buf {
+	char *data;
+	size_t len;
+	size_t alloc;
+	int failed;
+};
+
+static size_t
+snapshot_buf_write(const void *ptr, size_t size, size_t nmemb, void *context)
+{
+	struct snapshot_buf *b = context;
+	size_t n = size * nmemb;
+
+	if (b->len + n > b->alloc) {
+		size_t alloc = b->alloc ? b->alloc : 4096;
+		char *data;
+
+		while (b->len + n > alloc)
+			alloc *= 2;
+		data = realloc(b->data, alloc);
+		if (!data) {
+			b->failed = 1;
+			return 0;
+		}
+		b->data = data;
+		b->alloc = alloc;
+	}
+	memcpy(b->data + b->len, ptr, n);
+	b->len += n;
+	return nmemb;
+}
+
+int
+mxml_export_snapshot(const struct mxml *m, const char *path)
+{
+	struct snapshot_buf doc = { 0 };
+	struct snapshot_header h;
+	struct index *ix;
+	char *tmppath;
+	int fd;
+	int failed;
+	int ret = -1;
+
+	if (mxml_write(m, snapshot_buf_write, &doc) == (size_t)-1 ||
+	    doc.failed)
+	{
+		free(doc.data);
+		if (doc.failed)
+			errno = ENOMEM;
+		return -1;
+	}
+	ix = index_build(doc.data, doc.len, 0);
+	if (!ix) {
+		free(doc.data);
+		return -1;
+	}
+
+	memset(&h, 0, sizeof h);
+	h.magic = SNAPSHOT_MAGIC;
+	h.version = SNAPSHOT_VERSION;
+	/* Identify the XML written, which includes the edits */
+	h.srcsz = doc.len;
+	h.srcsum = index_checksum(doc.data, doc.len);
+	h.doc_off = (index_layout(ix, sizeof h, &h.index) + 7) & ~7;
+	h.docsz = doc.len;
+	h.filesz = h.doc_off + h.docsz;
+
+	/* Write to a temporary file, then rename it into place,
+	 * so that readers never see a partial snapshot */
+	fd = replace_open(path, &tmppath);
+	if (fd == -1)
+		goto out;
+	failed = write_all(fd, &h, sizeof h) == -1 ||
+	    index_write(fd, ix, sizeof h) == -1 ||
+	    write_pad(fd, h.index.keys_off + h.index.keysz) == -1 ||
+	    write_all(fd, doc.data, doc.len) == -1;
+	ret = replace_commit(fd, tmppath, path, failed);
+out:
+	index_free(ix);
+	free(doc.data);
+	return ret;
+}
+
+struct mxml *
+mxml_open_snapshot(const char *path)
+{
+	struct stat st;
+	const struct snapshot_header *h;
+	struct mxml *m = NULL;
+	struct index *ix = NULL;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof *h) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	/* Validate the header before trusting any offsets */
+	h = map;
+	if (h->magic != SNAPSHOT_MAGIC ||
+	    h->version != SNAPSHOT_VERSION ||
+	    h->filesz != st.st_size ||
+	    h->doc_off > h->filesz || h->docsz > h->filesz - h->doc_off)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	ix = index_map(map, h->filesz, &h->index);
+	if (!ix)
+		goto fail;
+
+	m = mxml_new((const char *)map + h->doc_off, h->docsz);
+	if (!m)
+		goto fail;
+	m->index = ix;
+	m->map = map;
+	m->mapsz = st.st_size;
+	return m;
+fail:
+	index_free(ix);
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+int
+mxml_snapshot_matches(const struct mxml *m, const char *xml, size_t xml_len)
+{
+	const struct snapshot_header *h = m->map;
+
+	/* Check that m came from mxml_open_snapshot() */
+	if (!m->index || !h || m->mapsz < sizeof *h ||
+	    h->magic != SNAPSHOT_MAGIC ||
+	    m->start != (const char *)m->map + h->doc_off)
+		return 0;
+	return h->srcsz == xml_len &&
+	       h->srcsum == index_checksum(xml, xml_len);
+}
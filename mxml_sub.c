@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * A sub-document is an ordinary handle whose document is the content
+ * span of one of its parent's elements. The span is not copied; it
+ * lies either in the parent's document or in the parent's journal
+ * pool, both of which remain unchanged until the parent is freed.
+ *
+ * The sub-document's keys are relative to the element, and its edits
+ * are kept in its own journal until they are merged into the parent's
+ * journal by prefixing their keys with the element's key.
+ */
+
+/**
+ * Finds the content span of an element whose span shows all its edits.
+ * @retval NULL [EBUSY] the element's descendants have been edited
+ */
+static const char *
+find_span(struct mxml *m, const char *key, char *ekey, int *ekeylen_return,
+	size_t *sz_return)
+{
+	int ekeylen;
+	const char *span;
+
+	ekeylen = expand_key(m, ekey, KEY_MAX, key);
+	if (ekeylen < 0)
+		return NULL;
+	span = find_key(m, ekey, ekeylen, sz_return);
+	if (!span)
+		return NULL;
+	if (subtree_is_edited(m, ekey, ekeylen)) {
+		errno = EBUSY;
+		return NULL;
+	}
+	*ekeylen_return = ekeylen;
+	return span;
+}
+
+const char *
+mxml_get_subtree_span(struct mxml *m, const char *key, size_t *len_return)
+{
+	char ekey[KEY_MAX];
+	int ekeylen;
+
+	return find_span(m, key, ekey, &ekeylen, len_return);
+}
+
+struct mxml *
+mxml_new_sub(struct mxml *m, const char *key)
+{
+	char ekey[KEY_MAX];
+	int ekeylen;
+	const char *span;
+	size_t spansz;
+	struct mxml *sub;
+
+	span = find_span(m, key, ekey, &ekeylen, &spansz);
+	if (!span)
+		return NULL;
+	sub = mxml_new(span, spansz);
+	if (!sub)
+		return NULL;
+	sub->prefix = strndup(ekey, ekeylen);
+	if (!sub->prefix) {
+		mxml_free(sub);
+		return NULL;
+	}
+	return sub;
+}
+
+int
+mxml_merge_sub(struct mxml *m, struct mxml *sub)
+{
+	const struct edit **edits;
+	const struct edit *e;
+	unsigned int nedits = 0;
+	unsigned int i;
+	int ret = -1;
+
+	if (!sub->prefix) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Replay the unmerged edits, oldest first */
+	for (e = sub->edits; e != sub->merged; e = e->next)
+		nedits++;
+	edits = malloc((nedits ? nedits : 1) * sizeof *edits);
+	if (!edits)
+		return -1;
+	i = nedits;
+	for (e = sub->edits; e != sub->merged; e = e->next)
+		edits[--i] = e;
+
+	for (i = 0; i < nedits; i++) {
+		char key[KEY_MAX];
+		char dest[KEY_MAX];
+		struct edit *edit;
+		int keylen;
+		int destlen = 0;
+
+		e = edits[i];
+		keylen = snprintf(key, sizeof key, "%s.%s", sub->prefix,
+		    e->key);
+		if (e->op == EDIT_MOVE)
+			destlen = snprintf(dest, sizeof dest, "%s.%s",
+			    sub->prefix, e->value);
+		if (keylen >= KEY_MAX || destlen >= KEY_MAX) {
+			errno = ENOMEM;
+			goto out;
+		}
+		if (e->op == EDIT_MOVE)
+			edit = edit_new_n(m, e->op, key, keylen, dest, destlen);
+		else
+			edit = edit_new_n(m, e->op, key, keylen, e->value,
+			    e->valuelen);
+		if (!edit)
+			goto out;
+		edit->listindex = e->listindex;
+		sub->merged = e;
+	}
+	ret = 0;
+out:
+	free(edits);
+	return ret;
+}
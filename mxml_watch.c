@@ -0,0 +1,277 @@
+#include <string.h>
+#include <errno.h>
+
+#include "mxml.h"
+#include "mxml_int.h"
+
+/*
+ * Subscriptions and edit counts are kept by the journal pool's path
+ * nodes (see mxml_pool.c), which already form a prefix trie of the
+ * keys. m->watches[] is indexed by pool node id.
+ *
+ * An edit counts itself in the nodes from its key up to the root, and
+ * calls the subscriptions found there. Edits that may change the
+ * element's descendants also call the subscriptions below the key.
+ * Those are found through the watched children lists, which link only
+ * the nodes on the path to a subscription.
+ */
+
+int
+watch_reserve(struct mxml *m)
+{
+	uint32_t n;
+	struct watch *watches;
+
+	if (!m->pool || m->pool->nnodes <= m->nwatches)
+		return 0;
+	n = m->pool->nodealloc;
+	watches = realloc(m->watches, n * sizeof *watches);
+	if (!watches) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(watches + m->nwatches, 0,
+	    (n - m->nwatches) * sizeof *watches);
+	m->watches = watches;
+	m->nwatches = n;
+	return 0;
+}
+
+void
+watch_free_all(struct mxml *m)
+{
+	struct mxml_subscription *sub;
+	uint32_t i;
+
+	for (i = 0; i < m->nwatches; i++)
+		while ((sub = m->watches[i].subs)) {
+			m->watches[i].subs = sub->next;
+			free(sub);
+		}
+	free(m->watches);
+	m->watches = NULL;
+	m->nwatches = 0;
+}
+
+/** Counts an edit of a node */
+static void
+watch_mark(struct mxml *m, uint32_t id)
+{
+	m->watches[id].here++;
+	for (;;) {
+		m->watches[id].below++;
+		if (!id)
+			break;
+		id = m->pool->nodes[id].parent;
+	}
+}
+
+/** Calls the subscriptions to one node.
+ *  The callbacks may make edits, which can move m->watches[]. */
+static void
+watch_call(struct mxml *m, uint32_t id, const char *key)
+{
+	struct mxml_subscription *sub, *next;
+
+	for (sub = m->watches[id].subs; sub; sub = next) {
+		next = sub->next;
+		sub->cb(sub->context, key);
+	}
+}
+
+/** Calls the subscriptions to a node and its parents,
+ *  up to but excluding @a stop */
+static void
+watch_call_up(struct mxml *m, uint32_t id, uint32_t stop, const char *key)
+{
+	for (;;) {
+		if (m->watches[id].subs)
+			watch_call(m, id, key);
+		if (!id)
+			break;
+		id = m->pool->nodes[id].parent;
+		if (id == stop)
+			break;
+	}
+}
+
+/** Calls the subscriptions below a node */
+static void
+watch_call_below(struct mxml *m, uint32_t id, const char *key)
+{
+	uint32_t child;
+
+	for (child = m->watches[id].child; child;
+	     child = m->watches[child - 1].sibling)
+	{
+		if (!m->watches[child - 1].nsubs)
+			continue;
+		watch_call(m, child - 1, key);
+		watch_call_below(m, child - 1, key);
+	}
+}
+
+/** Calls the subscriptions to a node and below that a pattern delete
+ *  may affect: those at or under a match, or above a possible match */
+static void
+watch_call_matching(struct mxml *m, uint32_t id, const struct edit *e,
+	uint64_t set, int matched)
+{
+	const struct pool *p = m->pool;
+	uint32_t child;
+
+	if (!m->watches[id].nsubs)
+		return;
+	if (matched || pattern_descends(e->pattern, set))
+		watch_call(m, id, e->key);
+	for (child = m->watches[id].child; child;
+	     child = m->watches[child - 1].sibling)
+	{
+		const struct pool_str *tag =
+			&p->atoms.strs[p->nodes[child - 1].atom];
+		uint64_t childset = pattern_step(e->pattern, set, tag->s,
+		    tag->len);
+
+		if (childset || matched)
+			watch_call_matching(m, child - 1, e, childset,
+			    matched || pattern_accepts(e->pattern, childset));
+	}
+}
+
+void
+watch_edited(struct mxml *m, const struct edit *e)
+{
+	const struct pool *p = m->pool;
+	uint32_t id = e->keyid;
+	unsigned int i;
+
+	if (e->op == EDIT_DELETE_MATCHING) {
+		/* Count the pattern as an edit of its literal prefix */
+		for (i = 0; i < e->pattern->nsegs &&
+		     e->pattern->segs[i].type == PATTERN_TAG; i++)
+			;
+		watch_mark(m, pool_ancestor(p, id, i));
+		watch_call_matching(m, 0, e, pattern_start(e->pattern), 0);
+		return;
+	}
+	watch_mark(m, id);
+	if (e->op == EDIT_MOVE)
+		watch_mark(m, e->destid);
+	if (!m->watches[0].nsubs)
+		return;
+
+	watch_call_up(m, id, UINT32_MAX, e->key);
+	if (e->op != EDIT_APPEND)
+		watch_call_below(m, id, e->key);
+	if (e->op == EDIT_MOVE) {
+		uint32_t top = e->destid;
+
+		/* Skip the parents already called */
+		while (pool_ancestor(p, id, p->nodes[top].depth) != top)
+			top = p->nodes[top].parent;
+		if (top != e->destid)
+			watch_call_up(m, e->destid, top, e->value);
+		watch_call_below(m, e->destid, e->value);
+	}
+}
+
+struct mxml_subscription *
+mxml_subscribe(struct mxml *m, const char *prefix,
+	void (*cb)(void *context, const char *key), void *context)
+{
+	char ekey[KEY_MAX];
+	int ekeylen = 0;
+	struct mxml_subscription *sub;
+	long id;
+	uint32_t i;
+
+	if (*prefix) {
+		ekeylen = expand_key(m, ekey, sizeof ekey, prefix);
+		if (ekeylen < 0)
+			return NULL;
+	}
+	if (!m->pool && !(m->pool = pool_new())) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	id = pool_intern_key(m->pool, ekey, ekeylen);
+	if (id == -1 || watch_reserve(m) == -1)
+		return NULL;
+	sub = malloc(sizeof *sub);
+	if (!sub) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	sub->node = id;
+	sub->cb = cb;
+	sub->context = context;
+	sub->next = m->watches[id].subs;
+	m->watches[id].subs = sub;
+
+	/* Link the path to the root */
+	for (i = id; ; i = m->pool->nodes[i].parent) {
+		struct watch *w = &m->watches[i];
+
+		w->nsubs++;
+		if (!i)
+			break;
+		if (!w->linked) {
+			struct watch *pw =
+				&m->watches[m->pool->nodes[i].parent];
+
+			w->sibling = pw->child;
+			pw->child = i + 1;
+			w->linked = 1;
+		}
+	}
+	return sub;
+}
+
+void
+mxml_unsubscribe(struct mxml *m, struct mxml_subscription *sub)
+{
+	struct mxml_subscription **subp;
+	uint32_t i;
+
+	if (!sub)
+		return;
+	for (subp = &m->watches[sub->node].subs; *subp != sub;
+	     subp = &(*subp)->next)
+		;
+	*subp = sub->next;
+	for (i = sub->node; ; i = m->pool->nodes[i].parent) {
+		m->watches[i].nsubs--;
+		if (!i)
+			break;
+	}
+	free(sub);
+}
+
+int
+mxml_is_dirty(struct mxml *m, const char *prefix)
+{
+	char ekey[KEY_MAX];
+	int ekeylen = 0;
+	uint32_t path[KEY_MAX / 2 + 1];
+	unsigned int depth, i;
+	int complete;
+
+	if (*prefix) {
+		ekeylen = expand_key(m, ekey, sizeof ekey, prefix);
+		if (ekeylen < 0)
+			return -1;
+	}
+	if (!m->nwatches)
+		return 0;
+	depth = pool_find_path(m->pool, ekey, ekeylen, path, KEY_MAX / 2,
+	    &complete);
+
+	/* An edit of the key or of a parent; the root holds
+	 * pattern deletes without a literal prefix */
+	for (i = 0; i <= depth; i++)
+		if (path[i] < m->nwatches && m->watches[path[i]].here)
+			return 1;
+	/* An edit below the key */
+	return complete && path[depth] < m->nwatches &&
+	    m->watches[path[depth]].below != 0;
+}
@@ -1,4 +1,7 @@
 #include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include "mxml.h"
 #include "mxml_int.h"
@@ -8,46 +11,115 @@ struct write_token_context {
 	void *context;
 };
 
-static size_t
-write_token(void *context, const struct token *token)
+/* Escaped text is accumulated here between calls to writefn */
+struct escape_buf {
+	struct write_token_context *c;
+	size_t ret;
+	size_t len;
+	char data[4096];
+};
+
+/** Passes the escape buffer's content to the write function.
+ *  @retval -1 the write function returned -1 */
+static int
+escape_flush(struct escape_buf *b)
 {
-	struct write_token_context *c = context;
-	const char *first;
-	const char *entity;
-	const char *text;
-	size_t ret = 0;
+	size_t n;
 
-	if (token->valuelen > 0) {
-		return c->writefn(token->value, 1, token->valuelen, c->context);
-	}
-	if (token->valuelen == 0)
+	if (!b->len)
 		return 0;
+	n = b->c->writefn(b->data, 1, b->len, b->c->context);
+	b->len = 0;
+	if (n == -1)
+		return -1;
+	b->ret += n;
+	return 0;
+}
+
+/** Appends text to the escape buffer. Text that would not fit
+ *  is written directly after flushing, rather than in pieces.
+ *  @retval -1 the write function returned -1 */
+static int
+escape_out(struct escape_buf *b, const char *s, size_t len)
+{
+	if (b->len + len > sizeof b->data) {
+		size_t n;
+
+		if (escape_flush(b) == -1)
+			return -1;
+		if (len > sizeof b->data) {
+			n = b->c->writefn(s, 1, len, b->c->context);
+			if (n == -1)
+				return -1;
+			b->ret += n;
+			return 0;
+		}
+	}
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+	return 0;
+}
+
+/**
+ * Writes user text with XML-encoding of its <, > and & characters.
+ * The special characters are located with #memchr(), whose
+ * implementation scans many bytes at a time; each position is
+ * remembered until passed, so the text is only searched once
+ * for each character.
+ */
+static size_t
+write_escaped(struct write_token_context *c, const char *text, size_t len)
+{
+	struct escape_buf b;
+	const char *end = text + len;
+	const char *lt, *gt, *amp;
+
+	b.c = c;
+	b.ret = 0;
+	b.len = 0;
+	lt = memchr(text, '<', len);
+	gt = memchr(text, '>', len);
+	amp = memchr(text, '&', len);
+	for (;;) {
+		const char *next = end;
+		const char *entity;
 
-#define OUT(s, len) do { \
-		int _len = (len); \
-		if (_len) { \
-			const char *_s = (s); \
-			size_t _n = c->writefn(_s, 1, _len, c->context); \
-			if (_n == -1) return -1; \
-			ret += _n; \
-		} \
-	} while (0)
-
-	text = token->value;
-	while ((text = strpbrk(first = text, "<>&"))) {
-		OUT(first, text - first);
-		if (*text == '<')
+		if (lt && lt < next) next = lt;
+		if (gt && gt < next) next = gt;
+		if (amp && amp < next) next = amp;
+		if (escape_out(&b, text, next - text) == -1)
+			return -1;
+		if (next == end)
+			break;
+		if (next == lt) {
 			entity = "&lt;";
-		else if (*text == '>')
+			lt = memchr(next + 1, '<', end - (next + 1));
+		} else if (next == gt) {
 			entity = "&gt;";
-		else /* if (*text == '&') */
+			gt = memchr(next + 1, '>', end - (next + 1));
+		} else /* if (next == amp) */ {
 			entity = "&amp;";
-		OUT(entity, strlen(entity));
-		text++;
+			amp = memchr(next + 1, '&', end - (next + 1));
+		}
+		if (escape_out(&b, entity, strlen(entity)) == -1)
+			return -1;
+		text = next + 1;
 	}
-	OUT(first, strlen(first));
-	return ret;
-#undef OUT
+	if (escape_flush(&b) == -1)
+		return -1;
+	return b.ret;
+}
+
+static size_t
+write_token(void *context, const struct token *token)
+{
+	struct write_token_context *c = context;
+
+	if (token->valuelen == 0)
+		return 0;
+	if (token->escape)
+		return write_escaped(c, token->value, token->valuelen);
+	return c->writefn(token->value, 1, token->valuelen, c->context);
 }
 
 size_t
@@ -61,3 +133,303 @@ mxml_write(const struct mxml *m,
 	};
 	return flatten_edits(m, write_token, &c);
 }
+
+/*
+ * Parallel writing splits the document into partitions between the
+ * children of the root element:
+ *
+ *     <?xml?><root> <a>...</a> <b>...</b> | <c>...</c> | <d>...</d> </root>
+ *     ^-- partition 0 ---------------------^-- 1 -------^-- 2 (last) -------^
+ *
+ * Each edit is routed to every partition holding a child of the root
+ * with the same tag as the edit's key, and to the last partition which
+ * holds the root's close tag where new children get appended.
+ * Edits only affect tokens with matching keys, so routing an edit to
+ * a partition where it matches nothing is harmless.
+ * Each partition is flattened by its own thread into a private buffer,
+ * and then the buffers are written out in order.
+ */
+
+/* A range of the document flattened by one thread */
+struct partition {
+	struct flatten_src src;
+	const struct edit **edits;
+	unsigned int nedits;
+	char *data;		/* The flattened output */
+	size_t len;
+	size_t alloc;
+	int failed;
+};
+
+static size_t
+partition_write(const void *ptr, size_t size, size_t nmemb, void *context)
+{
+	struct partition *p = context;
+	size_t n = size * nmemb;
+
+	if (p->len + n > p->alloc) {
+		size_t alloc = p->alloc ? p->alloc : 4096;
+		char *data;
+
+		while (p->len + n > alloc)
+			alloc *= 2;
+		data = realloc(p->data, alloc);
+		if (!data) {
+			p->failed = 1;
+			return 0;
+		}
+		p->data = data;
+		p->alloc = alloc;
+	}
+	memcpy(p->data + p->len, ptr, n);
+	p->len += n;
+	return nmemb;
+}
+
+static void *
+partition_thread(void *arg)
+{
+	struct partition *p = arg;
+	struct write_token_context c = {
+		.writefn = partition_write,
+		.context = p
+	};
+
+	if (flatten_range(p->edits, p->nedits, &p->src, write_token, &c) == -1)
+		p->failed = 1;
+	return NULL;
+}
+
+/* A child element of the root */
+struct rootchild {
+	const char *pos;	/* The child's '<' */
+	const char *tag;
+	int taglen;
+};
+
+/**
+ * Finds the root element and its children.
+ * @param key_return storage for the root's tag name
+ * @param end_return storage for the position of the root's close tag
+ * @param children_return storage for a new array of the root's children
+ * @returns the number of children found
+ * @retval -1 [ENOMEM] out of memory
+ */
+static int
+find_root_children(const struct mxml *m, struct cursor *key_return,
+	const char **end_return, struct rootchild **children_return)
+{
+	struct cursor c;
+	struct rootchild *children = NULL;
+	int n = 0;
+	int alloc = 0;
+	size_t size;
+
+	c.pos = m->start;
+	c.end = m->start + m->size;
+	cursor_skip_content(&c);
+	if (cursor_is_at_eof(&c) || cursor_is_at(&c, "</"))
+		goto none;
+	cursor_eatch(&c, '<');
+	key_return->pos = c.pos;
+	while (!cursor_is_at_eof(&c) && *c.pos != '>' && !isspace(*c.pos))
+		c.pos++;
+	key_return->end = c.pos;
+	cursor_skip_to_ch(&c, '>'); /* TODO attributes */
+	cursor_eatch(&c, '>');
+
+	for (;;) {
+		struct rootchild *child;
+
+		cursor_skip_content(&c);
+		if (cursor_is_at_eof(&c) || cursor_is_at(&c, "</"))
+			break;
+		if (n == alloc) {
+			struct rootchild *newchildren;
+
+			alloc = alloc ? alloc * 2 : 64;
+			newchildren = realloc(children,
+				alloc * sizeof *children);
+			if (!newchildren) {
+				free(children);
+				errno = ENOMEM;
+				return -1;
+			}
+			children = newchildren;
+		}
+		child = &children[n++];
+		child->pos = c.pos;
+		cursor_eat_element(&c, &child->tag, &child->taglen, &size);
+	}
+	*end_return = c.pos;
+	*children_return = children;
+	return n;
+none:
+	*children_return = NULL;
+	return 0;
+}
+
+/**
+ * Routes an edit to the partitions where it may apply.
+ * @retval 0 routed
+ * @retval -1 the edit does not lie inside a child of the root,
+ *            or it moves a subtree (which may cross partitions),
+ *            or it deletes by a pattern (which may match anywhere)
+ */
+static int
+route_edit(const struct edit *edit, const struct cursor *rootkey,
+	const struct rootchild *children, const unsigned int *childpart,
+	unsigned int nchildren, struct partition *parts, unsigned int nparts)
+{
+	size_t rootlen = rootkey->end - rootkey->pos;
+	const char *tag;
+	const char *dot;
+	size_t taglen;
+	unsigned int i;
+	unsigned int last = -1;
+
+	if (edit->op == EDIT_MOVE || edit->op == EDIT_DELETE_MATCHING ||
+	    strncmp(edit->key, rootkey->pos, rootlen) != 0 ||
+	    edit->key[rootlen] != '.')
+		return -1;
+	tag = edit->key + rootlen + 1;
+	dot = strchr(tag, '.');
+	taglen = dot ? dot - tag : strlen(tag);
+
+	for (i = 0; i < nchildren; i++)
+		if (children[i].taglen == taglen &&
+		    memcmp(children[i].tag, tag, taglen) == 0 &&
+		    childpart[i] != last)
+		{
+			struct partition *p = &parts[last = childpart[i]];
+			if (last != nparts - 1)
+				p->edits[p->nedits++] = edit;
+		}
+	parts[nparts - 1].edits[parts[nparts - 1].nedits++] = edit;
+	return 0;
+}
+
+size_t
+mxml_write_parallel(const struct mxml *m, unsigned int nthreads,
+	size_t (*writefn)(const void *ptr, size_t size, size_t nmemb, void *context),
+	void *context)
+{
+	struct cursor rootkey;
+	const char *rootend;
+	struct rootchild *children = NULL;
+	unsigned int *childpart = NULL;
+	int nchildren;
+	struct partition *parts = NULL;
+	pthread_t *threads = NULL;
+	char *started = NULL;
+	unsigned int nparts;
+	unsigned int nedits = 0;
+	const struct edit *edit;
+	unsigned int i;
+	size_t ret = 0;
+
+	nchildren = find_root_children(m, &rootkey, &rootend, &children);
+	if (nchildren < 0)
+		return -1;
+	nparts = nthreads < nchildren ? nthreads : nchildren;
+	if (nparts < 2)
+		goto serial;
+
+	for (edit = m->edits; edit; edit = edit->next)
+		nedits++;
+	parts = calloc(nparts, sizeof *parts);
+	childpart = calloc(nchildren, sizeof *childpart);
+	threads = calloc(nparts, sizeof *threads);
+	started = calloc(nparts, 1);
+	if (!parts || !childpart || !threads || !started)
+		goto nomem;
+
+	/* Divide the children into partitions of similar size */
+	{
+		size_t total = rootend - children[0].pos;
+		unsigned int p = 0;
+
+		parts[0].src.start = m->start;
+		parts[0].src.key = "";
+		for (i = 0; i < nchildren; i++) {
+			if (p + 1 < nparts && children[i].pos -
+			    children[0].pos >= total / nparts * (p + 1))
+			{
+				p++;
+				parts[p].src.start = children[i].pos;
+				parts[p].src.key = rootkey.pos;
+				parts[p].src.keylen = rootkey.end - rootkey.pos;
+			}
+			childpart[i] = p;
+		}
+		nparts = p + 1;
+		for (p = 0; p + 1 < nparts; p++)
+			parts[p].src.size = parts[p + 1].src.start -
+				parts[p].src.start;
+		parts[p].src.size = m->start + m->size - parts[p].src.start;
+	}
+
+	/* Route each edit, keeping them in order */
+	for (i = 0; i < nparts; i++) {
+		parts[i].edits = malloc((nedits ? nedits : 1) *
+			sizeof *parts[i].edits);
+		if (!parts[i].edits)
+			goto nomem;
+	}
+	for (edit = m->edits; edit; edit = edit->next)
+		if (route_edit(edit, &rootkey, children, childpart,
+		    nchildren, parts, nparts) == -1)
+			goto serial;
+
+	/* Flatten the partitions concurrently */
+	for (i = 1; i < nparts; i++)
+		if (pthread_create(&threads[i], NULL, partition_thread,
+		    &parts[i]) == 0)
+			started[i] = 1;
+	partition_thread(&parts[0]);
+	for (i = 1; i < nparts; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			partition_thread(&parts[i]);
+	}
+	for (i = 0; i < nparts; i++)
+		if (parts[i].failed)
+			goto nomem;
+
+	/* Emit the partitions in order */
+	for (i = 0; i < nparts; i++) {
+		size_t n;
+
+		if (!parts[i].len)
+			continue;
+		n = writefn(parts[i].data, 1, parts[i].len, context);
+		if (n == -1) {
+			ret = -1;
+			break;
+		}
+		ret += n;
+		if (n < parts[i].len)
+			break;
+	}
+	goto out;
+
+nomem:
+	ret = -1;
+	errno = ENOMEM;
+	goto out;
+serial:
+	ret = mxml_write(m, writefn, context);
+out:
+	if (parts)
+		for (i = 0; i < nparts; i++) {
+			free(parts[i].edits);
+			free(parts[i].data);
+		}
+	free(parts);
+	free(threads);
+	free(started);
+	free(childpart);
+	free(children);
+	return ret;
+}
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "mxml.h"
 
@@ -213,6 +215,50 @@ static void buf_init(struct buf *b) { memset(b, 0, sizeof *b); }
 static void buf_clear(struct buf *b) { b->len = 0; if (b->alloc) b->data[0] = '\0'; }
 static void buf_release(struct buf *b) { free(b->data); buf_init(b); }
 
+static int
+pair_cb(void *context, const char *key, const char *value)
+{
+	struct buf *b = context;
+	buf_write(key, 1, strlen(key), b);
+	buf_write("=", 1, 1, b);
+	buf_write(value, 1, strlen(value), b);
+	buf_write(";", 1, 1, b);
+	return strcmp(value, "stop") == 0 ? 7 : 0;
+}
+
+static int
+child_cb(void *context, const char *key)
+{
+	struct buf *b = context;
+	buf_write(key, 1, strlen(key), b);
+	buf_write(";", 1, 1, b);
+	return strcmp(key, "a.us.u3") == 0 ? 7 : 0;
+}
+
+static void
+note_cb(void *context, const char *key)
+{
+	struct buf *b = context;
+	buf_write(key, 1, strlen(key), b);
+	buf_write(";", 1, 1, b);
+}
+
+static unsigned int nfrees;
+static void
+count_free(void *value)
+{
+	nfrees++;
+	free(value);
+}
+
+static unsigned int nwrites;
+static size_t
+count_write(const void *d, size_t sz, size_t len, void *context)
+{
+	nwrites++;
+	return buf_write(d, sz, len, context);
+}
+
 int
 main()
 {
@@ -220,6 +266,11 @@ main()
 	struct mxml *m;
 	char **keys;
 	unsigned int nkeys;
+	struct mxml_key *key;
+	struct mxml *snap;
+	char snappath[] = "/tmp/t-mxml.XXXXXX";
+	char idxpath[sizeof snappath + 4];
+	int fd;
 
 	/* Internal test of xml_streq() */
 	assert(xml_streq("", ""));
@@ -271,12 +322,26 @@ main()
 		"  <system>\n"
 		"    <name>localhost</name>\n"
 		"    <motd>Ben&amp;Jerry's &lt; Oak &gt;</motd>\n"
+		"    <sig>&quot;&#65;&#x42;&apos; &#xe9;&#8364;&#x1F600;"
+		    "&bogus;&#0;&#xd800;!<![CDATA[&amp;]]>&amp;</sig>\n"
 		"  </system>\n"
 		"</config>\n");
 	assert_streq(mxml_get(m, "config.version"), "1");
 	assert_streq(mxml_get(m, "config.system.name"), "localhost");
 	/* Entity decoding works */
 	assert_streq(mxml_get(m, "config.system.motd"), "Ben&Jerry's < Oak >");
+	/* Named and numeric entities are decoded, bad ones dropped */
+	assert_streq(mxml_get(m, "config.system.sig"),
+		"\"AB' \xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80!&amp;&");
+	/* A container's value is decoded only up to its first tag */
+	{
+		struct mxml *c = MXML_NEW("<a>x &amp; <![CDATA[<y>]]> z"
+			"<b>&lt;</b>&amp; &bogus</a>");
+
+		assert_streq(mxml_get(c, "a"), "x & <y> z");
+		assert_streq(mxml_get(c, "a.b"), "<");
+		mxml_free(c);
+	}
 	/* Can change a key's value */
 	assert0(mxml_update(m, "config.system.name", "fred"));
 	assert_streq(mxml_get(m, "config.system.name"), "fred");
@@ -289,6 +354,23 @@ main()
 	assert0(mxml_set(m, "config.system.model", "SD4002"));
 	assert_streq(mxml_get(m, "config.system.model"), "SD4002");
 
+	/* Can append elements with long tag names */
+	{
+		char longkey[200];
+		char *longtag;
+
+		strcpy(longkey, "config.system.");
+		longtag = longkey + strlen(longkey);
+		memset(longtag, 't', sizeof longkey - 1 - strlen(longkey));
+		longkey[sizeof longkey - 1] = '\0';
+		assert0(mxml_set(m, longkey, "long"));
+		buf_clear(&buf);
+		mxml_write(m, buf_write, &buf);
+		assert(strstr(buf.data, longtag));
+		assert_streq(mxml_get(m, longkey), "long");
+		assert0(mxml_delete(m, longkey));
+	}
+
 	/* Can set a key to NULL and delete it */
 	assert0(mxml_set(m, "config.system.model", NULL));
 	assert(!mxml_exists(m, "config.system.model"));
@@ -341,10 +423,29 @@ main()
 	/* can't write to the [#] */
 	assert_errno(mxml_update(m, "top.dog[#]", "9"), EPERM);
 
+	/* Compiled keys behave like their source keys */
+	assert((key = mxml_key_compile(m, "top.dog[2].colour")) != NULL);
+	assert_streq(mxml_get_key(m, key), "Spotty");
+	assert(mxml_exists_key(m, key));
+	mxml_key_free(key);
+	assert((key = mxml_key_compile(m, "top.unicorn[#]")) != NULL);
+	assert_streq(mxml_get_key(m, key), "0");
+	mxml_key_free(key);
+	assert_null_errno(mxml_key_compile(m, "top.dog[0].name"), EINVAL);
+	/* Compiled [$] is resolved at each use */
+	assert((key = mxml_key_compile(m, "top.unicorn[$].name")) != NULL);
+	assert(!mxml_exists_key(m, key));
+	assert_null_errno(mxml_get_key(m, key), ENOENT);
+
 	/* Can insert a new unicorn */
 	assert0(mxml_append(m, "top.unicorn[+].name", "Charlie"));
 	assert_streq(mxml_get(m, "top.unicorn[$].name"), "Charlie");
 	assert_streq(mxml_get(m, "top.unicorn[#]"), "1");
+	assert_streq(mxml_get_key(m, key), "Charlie");
+	assert0(mxml_append(m, "top.unicorn[+].name", "Dobbin"));
+	assert_streq(mxml_get_key(m, key), "Dobbin");
+	mxml_key_free(key);
+	assert0(mxml_delete(m, "top.unicorn[$]"));
 	/* Can delete an entire tree */
 	assert0(mxml_delete(m, "top.cat[*]"));
 	assert_streq(mxml_get(m, "top.cat[#]"), "0");
@@ -360,6 +461,322 @@ main()
 
 	mxml_free(m);
 
+	/* Many list items can be appended at once */
+	{
+		static const char *const fields[] = { "name", "colour" };
+		static const char *const values[] = {
+			"Tom", "grey",  "Ginger", NULL,  "Kit", "black" };
+		static const char *const leaves[] = { "a", "b" };
+
+		m = MXML_NEW("<top><cats><cat1><name>Felix</name></cat1>"
+			"<total>1</total></cats></top>");
+		assert0(mxml_list_append_many(m, "top.cat", 3, fields, 2,
+		    values));
+		assert_streq(mxml_get(m, "top.cat[#]"), "4");
+		assert_streq(mxml_get(m, "top.cat[2].name"), "Tom");
+		assert_streq(mxml_get(m, "top.cat[$].colour"), "black");
+		assert(mxml_exists(m, "top.cat[3]"));
+		assert(!mxml_exists(m, "top.cat[3].colour"));
+		/* New lists and their parents are created */
+		assert0(mxml_list_append_many(m, "top.x.y", 2, NULL, 0,
+		    leaves));
+		assert_streq(mxml_get(m, "top.x.y[#]"), "2");
+		assert_streq(mxml_get(m, "top.x.y[1]"), "a");
+		assert_streq(mxml_get(m, "top.x.y[2]"), "b");
+		buf_clear(&buf);
+		mxml_write(m, buf_write, &buf);
+		assert_streq(buf.data, "<top><cats><cat1><name>Felix</name>"
+			"</cat1><total>4</total><cat2><name>Tom</name>"
+			"<colour>grey</colour></cat2><cat3><name>Ginger</name>"
+			"</cat3><cat4><name>Kit</name><colour>black</colour>"
+			"</cat4></cats><x><ys><y1>a</y1><y2>b</y2>"
+			"<total>2</total></ys></x></top>");
+		assert_errno(mxml_list_append_many(m, "top.", 1, NULL, 0,
+		    leaves), EINVAL);
+		mxml_free(m);
+
+		/* Nothing is appended over an item beyond the total */
+#define STRAY_XML "<top><ys><y1>a</y1><y10>j</y10><y3>c</y3>" \
+		  "<total>1</total></ys></top>"
+		m = MXML_NEW(STRAY_XML);
+		assert_errno(mxml_list_append_many(m, "top.y", 2, NULL, 0,
+		    leaves), EEXIST);
+		buf_clear(&buf);
+		mxml_write(m, buf_write, &buf);
+		assert_streq(buf.data, STRAY_XML);
+		assert0(mxml_list_append_many(m, "top.y", 1, NULL, 0,
+		    leaves));
+		assert_streq(mxml_get(m, "top.y[2]"), "a");
+		mxml_free(m);
+	}
+
+	/* Removing a list element renumbers the elements after it */
+	m = MXML_NEW("<top><cats><cat1><name>c1</name></cat1>"
+		"<cat2><name>c2</name></cat2><cat3 x=\"y\"><name>c3</name>"
+		"</cat3><cat4><name>c4</name></cat4><cat5>c5</cat5>"
+		"<total>5</total></cats></top>");
+	assert0(mxml_set(m, "top.cat[4].name", "d4"));
+	assert0(mxml_list_remove(m, "top.cat", 2));
+	assert_streq(mxml_get(m, "top.cat[#]"), "4");
+	assert_streq(mxml_get(m, "top.cat[1].name"), "c1");
+	assert_streq(mxml_get(m, "top.cat[2].name"), "c3");
+	assert_streq(mxml_get(m, "top.cat[3].name"), "d4");
+	assert_streq(mxml_get(m, "top.cat[$]"), "c5");
+	assert(!mxml_exists(m, "top.cat[5]"));
+	assert0(mxml_append(m, "top.cat[+].name", "new"));
+	assert_streq(mxml_get(m, "top.cats.cat5.name"), "new");
+	assert0(mxml_list_remove(m, "top.cat", 1));
+	assert_streq(mxml_get(m, "top.cat[1].name"), "c3");
+	assert_streq(mxml_get(m, "top.cat[$].name"), "new");
+	assert_errno(mxml_list_remove(m, "top.cat", 5), ENOENT);
+	assert_errno(mxml_list_remove(m, "top.cat", 0), EINVAL);
+	buf_clear(&buf);
+	mxml_write(m, buf_write, &buf);
+	assert_streq(buf.data, "<top><cats><cat1 x=\"y\"><name>c3</name>"
+		"</cat1><cat2><name>d4</name></cat2><cat3>c5</cat3>"
+		"<total>4</total><cat4><name>new</name></cat4></cats></top>");
+	mxml_free(m);
+
+	/* List items can be found by a field's value */
+	m = MXML_NEW("<a><users><user1><name>alice</name></user1>"
+		"<user2><name>b&amp;b</name></user2><user3><uid>3</uid>"
+		"</user3><user4><name>bob</name></user4>"
+		"<total>4</total></users></a>");
+	assert(mxml_list_find(m, "a.user", "name", "bob") == 4);
+	assert(mxml_list_find(m, "a.user", "name", "b&b") == 2);
+	assert(mxml_list_find(m, "a.user", "uid", "3") == 3);
+	assert_errno(mxml_list_find(m, "a.user", "name", "carol"), ENOENT);
+	assert_errno(mxml_list_find(m, "a.user", "name[1]", "x"), EINVAL);
+	assert_errno(mxml_list_find(m, "a.group", "name", "x"), ENOENT);
+	/* The index follows edits */
+	assert0(mxml_set(m, "a.user[1].name", "bob"));
+	assert(mxml_list_find(m, "a.user", "name", "bob") == 1);
+	assert_errno(mxml_list_find(m, "a.user", "name", "alice"), ENOENT);
+	assert0(mxml_append(m, "a.user[+].name", "carol"));
+	assert(mxml_list_find(m, "a.user", "name", "carol") == 5);
+	assert0(mxml_list_remove(m, "a.user", 2));
+	assert(mxml_list_find(m, "a.user", "name", "carol") == 4);
+	assert0(mxml_delete(m, "a.user[$]"));
+	assert_errno(mxml_list_find(m, "a.user", "name", "carol"), ENOENT);
+	assert0(mxml_replace_subtree(m, "a.user[1]", "<name>dave</name>",
+	    sizeof "<name>dave</name>" - 1));
+	assert(mxml_list_find(m, "a.user", "name", "dave") == 1);
+	assert(mxml_list_find(m, "a.user", "name", "bob") == 3);
+	/* So do edits of the list's parents */
+#define ERIN_XML "<users><user1><name>erin</name></user1>" \
+		 "<total>1</total></users>"
+	assert0(mxml_append(m, "a.user[+].name", "frank"));
+	assert0(mxml_replace_subtree(m, "a", ERIN_XML, strlen(ERIN_XML)));
+	assert(mxml_list_find(m, "a.user", "name", "erin") == 1);
+	assert_errno(mxml_list_find(m, "a.user", "name", "bob"), ENOENT);
+	assert0(mxml_append(m, "a.user[+].name", "gina"));
+	assert(mxml_list_find(m, "a.user", "name", "gina") == 2);
+	mxml_free(m);
+
+	/* Subtrees can be moved */
+	m = MXML_NEW("<top><a><x>1</x><y>2</y></a><b><z>3</z></b></top>");
+	assert0(mxml_move(m, "top.b", "top.a.bb"));
+	assert_streq(mxml_get(m, "top.a.bb.z"), "3");
+	assert(!mxml_exists(m, "top.b"));
+	assert0(mxml_set(m, "top.a.bb.w", "4"));
+	assert0(mxml_set(m, "top.a.x", "one"));
+	assert0(mxml_move(m, "top.a.x", "top.c.x2"));
+	assert_streq(mxml_get(m, "top.c.x2"), "one");
+	assert0(mxml_move(m, "top.c", "top.d"));
+	assert_streq(mxml_get(m, "top.d.x2"), "one");
+	assert(!mxml_exists(m, "top.c"));
+	assert_errno(mxml_move(m, "top.d", "top.a"), EEXIST);
+	assert_errno(mxml_move(m, "top.b", "top.e"), ENOENT);
+	assert_errno(mxml_move(m, "top.d", "top.d.e"), EINVAL);
+	assert_errno(mxml_move(m, "top.d", "e"), EINVAL);
+	buf_clear(&buf);
+	mxml_write(m, buf_write, &buf);
+	assert_streq(buf.data, "<top><a><y>2</y><bb><z>3</z><w>4</w></bb>"
+		"</a><d><x2>one</x2></d></top>");
+	mxml_free(m);
+	/* An unedited subtree moves with its text and attributes */
+	m = MXML_NEW("<top><a k=\"v\">x<b>1&amp;2</b>y</a><c>3</c></top>");
+	assert0(mxml_move(m, "top.a", "top.c.a2"));
+	assert0(mxml_move(m, "top.c", "top.d"));
+	buf_clear(&buf);
+	mxml_write(m, buf_write, &buf);
+	assert_streq(buf.data, "<top><d>3<a2 k=\"v\">x<b>1&amp;2</b>y</a2>"
+		"</d></top>");
+	mxml_free(m);
+
+	/* An element's content can be replaced with an XML fragment */
+	m = MXML_NEW("<top><serial><port1><baud>9600</baud></port1>"
+		"<total>1</total></serial><x>1</x></top>");
+	{
+		static const char frag[] = "<port1><baud>115200</baud></port1>"
+			"<port2><baud>19200</baud></port2><total>2</total>";
+		static const char frag2[] = "<a>1&amp;2</a>";
+
+		assert0(mxml_replace_subtree(m, "top.serial", frag,
+		    sizeof frag - 1));
+		assert_streq(mxml_get(m, "top.serial.port1.baud"), "115200");
+		assert_streq(mxml_get(m, "top.serial.port2.baud"), "19200");
+		assert_streq(mxml_get(m, "top.serial.total"), "2");
+		assert(!mxml_exists(m, "top.serial.port3"));
+		assert0(mxml_set(m, "top.serial.port2.baud", "38400"));
+		assert0(mxml_set(m, "top.serial.port3.baud", "1"));
+		assert_streq(mxml_get(m, "top.serial.port2.baud"), "38400");
+		assert_streq(mxml_get(m, "top.serial.port3.baud"), "1");
+		assert0(mxml_replace_subtree(m, "top.new.sub", frag2,
+		    sizeof frag2 - 1));
+		assert_streq(mxml_get(m, "top.new.sub.a"), "1&2");
+		assert_errno(mxml_replace_subtree(m, "top.x", "<a>", 3),
+		    EINVAL);
+		assert_errno(mxml_replace_subtree(m, "top.x", "</a>", 4),
+		    EINVAL);
+		buf_clear(&buf);
+		mxml_write(m, buf_write, &buf);
+		assert_streq(buf.data, "<top><serial>"
+			"<port1><baud>115200</baud></port1>"
+			"<port2><baud>38400</baud></port2><total>2</total>"
+			"<port3><baud>1</baud></port3></serial><x>1</x>"
+			"<new><sub><a>1&amp;2</a></sub></new></top>");
+	}
+	mxml_free(m);
+
+	/* Sub-documents work on an element's content in place */
+	m = MXML_NEW("<config><ports><port1><baud>9600</baud></port1>"
+		"<total>1</total></ports><x>1</x></config>");
+	{
+		struct mxml *sub;
+		const char *span;
+		size_t len;
+
+		span = mxml_get_subtree_span(m, "config.port[1]", &len);
+		assert(span != NULL);
+		assert(len == 17 && memcmp(span, "<baud>9600</baud>", len) == 0);
+		assert_null_errno(mxml_get_subtree_span(m, "config.y", &len),
+		    ENOENT);
+		assert((sub = mxml_new_sub(m, "config.ports")) != NULL);
+		assert_streq(mxml_get(sub, "port1.baud"), "9600");
+		assert0(mxml_set(sub, "port1.baud", "19200"));
+		assert0(mxml_append(sub, "port2.baud", "300"));
+		assert0(mxml_set(sub, "total", "2"));
+		buf_clear(&buf);
+		mxml_write(sub, buf_write, &buf);
+		assert_streq(buf.data, "<port1><baud>19200</baud></port1>"
+			"<total>2</total><port2><baud>300</baud></port2>");
+		/* The parent is unchanged until the edits are merged */
+		assert_streq(mxml_get(m, "config.port[1].baud"), "9600");
+		assert0(mxml_merge_sub(m, sub));
+		assert_streq(mxml_get(m, "config.port[1].baud"), "19200");
+		assert_streq(mxml_get(m, "config.port[$].baud"), "300");
+		assert0(mxml_delete(sub, "port1"));
+		assert0(mxml_merge_sub(m, sub));
+		assert(!mxml_exists(m, "config.port[1]"));
+		assert_errno(mxml_merge_sub(m, m), EINVAL);
+		assert_null_errno(mxml_new_sub(m, "config.ports"), EBUSY);
+		assert((span = mxml_get_subtree_span(m, "config.x", &len)));
+		mxml_free(sub);
+		mxml_free(m);
+
+		/* Spans are refused when a move or a list removal
+		 * would hide the edits made before it */
+		m = MXML_NEW("<top><a><x>old</x></a><cats><cat1><n>A</n>"
+			"</cat1><cat2><n>B</n></cat2><cat3><n>C</n></cat3>"
+			"<total>3</total></cats><y>1</y></top>");
+		assert0(mxml_set(m, "top.a.x", "new"));
+		assert0(mxml_move(m, "top.a", "top.b"));
+		assert_null_errno(mxml_get_subtree_span(m, "top.b", &len),
+		    EBUSY);
+		assert_null_errno(mxml_new_sub(m, "top.b"), EBUSY);
+		assert_null_errno(mxml_find_node(m, "top.b"), EBUSY);
+		assert0(mxml_set(m, "top.cats.cat3.n", "C2"));
+		assert0(mxml_list_remove(m, "top.cat", 1));
+		assert_null_errno(mxml_new_sub(m, "top.cats.cat2"), EBUSY);
+		assert_null_errno(mxml_find_node(m, "top.cats.cat2"), EBUSY);
+		assert_streq(mxml_get(m, "top.cat[2].n"), "C2");
+		/* So is the text of a set value */
+		assert0(mxml_set(m, "top.y", "2"));
+		assert_null_errno(mxml_get_subtree_span(m, "top.y", &len),
+		    EBUSY);
+	}
+	mxml_free(m);
+
+	/* Nodes find keys relative to an element */
+	m = MXML_NEW("<a><cats><cat1><name>Tom</name></cat1><cat7>"
+		"<name>Kit</name><colour>black</colour><age>3</age></cat7>"
+		"<total>2</total></cats><b>x</b></a>");
+	{
+		struct mxml_node *node, *child, *next;
+
+		assert((node = mxml_find_node(m, "a.cat[7]")) != NULL);
+		assert_streq(mxml_node_key(node), "a.cats.cat7");
+		assert_streq(mxml_node_get(m, node, "name"), "Kit");
+		assert_streq(mxml_node_get(m, node, "colour"), "black");
+		assert_null_errno(mxml_node_get(m, node, "weight"), ENOENT);
+		assert_null_errno(mxml_node_get(m, node, "x[1]"), EINVAL);
+
+		/* Children and siblings */
+		assert((child = mxml_node_first_child(m, node)) != NULL);
+		assert_streq(mxml_node_key(child), "a.cats.cat7.name");
+		assert_streq(mxml_node_get(m, child, NULL), "Kit");
+		assert((next = mxml_node_next_sibling(m, child)) != NULL);
+		mxml_node_free(child);
+		assert_streq(mxml_node_key(next), "a.cats.cat7.colour");
+		assert((child = mxml_node_next_sibling(m, next)) != NULL);
+		mxml_node_free(next);
+		assert_null_errno(mxml_node_next_sibling(m, child), ENOENT);
+		assert_null_errno(mxml_node_first_child(m, child), ENOENT);
+		mxml_node_free(child);
+		assert((next = mxml_node_next_sibling(m, node)) != NULL);
+		assert_streq(mxml_node_key(next), "a.cats.total");
+		mxml_node_free(next);
+
+		/* Edits make nodes stale */
+		assert0(mxml_set(m, "a.b", "y"));
+		assert_null_errno(mxml_node_get(m, node, "name"), ESTALE);
+		mxml_node_free(node);
+		assert((node = mxml_find_node(m, "a.cats")) != NULL);
+		assert_null_errno(mxml_node_next_sibling(m, node), EBUSY);
+		mxml_node_free(node);
+		assert_null_errno(mxml_find_node(m, "a"), EBUSY);
+		assert_null_errno(mxml_find_node(m, "a.z"), ENOENT);
+	}
+	mxml_free(m);
+
+	/* Elements and totals of long lists are found directly */
+	{
+		char *doc = malloc(2000 * 40 + 100);
+		char *d = doc;
+		unsigned int i;
+
+		assert(doc != NULL);
+		d += sprintf(d, "<top><cats><cat01>zero</cat01>");
+		for (i = 1; i <= 2000; i++)
+			d += sprintf(d, "<cat%u><name>c%u</name></cat%u>",
+			    i, i, i);
+		d += sprintf(d, "<cat7>dup</cat7><cat999999>far</cat999999>"
+			"<total>2000</total></cats></top>");
+		m = mxml_new(doc, d - doc);
+		assert_streq(mxml_get(m, "top.cat[$].name"), "c2000");
+		assert_streq(mxml_get(m, "top.cat[500].name"), "c500");
+		assert_streq(mxml_get(m, "top.cat[7].name"), "c7");
+		assert_streq(mxml_get(m, "top.cats.cat999999"), "far");
+		assert_streq(mxml_get(m, "top.cats.cat01"), "zero");
+		assert(!mxml_exists(m, "top.cat[2001]"));
+		assert0(mxml_append(m, "top.cat[+].name", "new"));
+		assert_streq(mxml_get(m, "top.cat[#]"), "2001");
+		assert_streq(mxml_get(m, "top.cat[$].name"), "new");
+		assert0(mxml_delete(m, "top.cat[$]"));
+		assert_streq(mxml_get(m, "top.cat[#]"), "2000");
+		assert0(mxml_set(m, "top.cats.total", "3"));
+		assert_streq(mxml_expand_key(m, "top.cat[$]"), "top.cat[3]");
+		assert_streq(mxml_get(m, "top.cat[$].name"), "c3");
+		assert0(mxml_delete(m, "top.cats"));
+		assert_streq(mxml_get(m, "top.cat[#]"), "0");
+		assert0(mxml_append(m, "top.cat[+]", "again"));
+		assert_streq(mxml_get(m, "top.cat[#]"), "1");
+		assert_streq(mxml_get(m, "top.cat[1]"), "again");
+		mxml_free(m);
+		free(doc);
+	}
+
 	/* Writing an unchanged XML document yields an identical output */
 	m = MXML_NEW("<?xml?>\n"
 		"<top>\n"
@@ -439,4 +856,603 @@ main()
 	mxml_free_keys(keys, nkeys);
 
 	mxml_free(m);
+
+	/* A snapshot serves the document with its edits */
+#define SNAP_XML "<top><a>1</a><b><c>x &amp; y</c></b><d>2</d></top>"
+	m = MXML_NEW(SNAP_XML);
+	assert0(mxml_set(m, "top.b.e", "new"));
+	assert0(mxml_delete(m, "top.d"));
+	assert((fd = mkstemp(snappath)) != -1);
+	close(fd);
+	assert0(mxml_export_snapshot(m, snappath));
+	buf_clear(&buf);
+	assert(mxml_write(m, buf_write, &buf) > 0);
+	mxml_free(m);
+	assert((snap = mxml_open_snapshot(snappath)) != NULL);
+	/* A snapshot with edits matches the edited XML, not the source */
+	assert(!mxml_snapshot_matches(snap, SNAP_XML, sizeof SNAP_XML - 1));
+	assert(mxml_snapshot_matches(snap, buf.data, buf.len));
+	assert(!mxml_snapshot_matches(snap, "<top/>", 6));
+	assert_streq(mxml_get(snap, "top.a"), "1");
+	assert_streq(mxml_get(snap, "top.b.c"), "x & y");
+	assert_streq(mxml_get(snap, "top.b.e"), "new");
+	assert(!mxml_exists(snap, "top.d"));
+	assert(!mxml_exists(snap, "top.b.c.x"));
+	assert((keys = mxml_keys(snap, &nkeys)) != NULL);
+	assert(nkeys == 5);
+	assert_streq(keys[0], "top");
+	assert_streq(keys[4], "top.b.e");
+	mxml_free_keys(keys, nkeys);
+	/* A snapshot can be edited */
+	assert0(mxml_set(snap, "top.a", "9"));
+	assert_streq(mxml_get(snap, "top.a"), "9");
+	buf_clear(&buf);
+	assert(mxml_write(snap, buf_write, &buf) > 0);
+	assert_xml_streq(buf.data, "<top><a>9</a><b><c>x &amp; y</c>"
+	    "<e>new</e></b></top>");
+	mxml_free(snap);
+	/* A file that isn't a snapshot is rejected */
+	assert((fd = open(snappath, O_WRONLY | O_TRUNC)) != -1);
+	assert(write(fd, SNAP_XML, sizeof SNAP_XML - 1) > 0);
+	close(fd);
+	assert_null_errno(mxml_open_snapshot(snappath), EINVAL);
+	/* A document that cannot be flattened is not exported */
+	{
+		char deep[60 * 19 + 32];
+		char *p = deep;
+		int i;
+
+		p += sprintf(p, "<top>");
+		for (i = 0; i < 60; i++)
+			p += sprintf(p, "<deeptag>");
+		for (i = 0; i < 60; i++)
+			p += sprintf(p, "</deeptag>");
+		p += sprintf(p, "<tail>1</tail></top>");
+		m = mxml_new(deep, p - deep);
+		assert(m);
+		assert_inteq(mxml_write(m, buf_write, &buf), (size_t)-1, "zu");
+		assert_inteq(mxml_export_snapshot(m, snappath), -1, "d");
+		mxml_free(m);
+		assert_null_errno(mxml_open_snapshot(snappath), EINVAL);
+	}
+
+	/* Opening a file saves a sidecar index */
+	strcpy(idxpath, snappath);
+	strcat(idxpath, ".mxi");
+	assert((m = mxml_open_file(snappath)) != NULL);
+	assert0(access(idxpath, R_OK));
+	assert_streq(mxml_get(m, "top.b.c"), "x & y");
+	mxml_free(m);
+	/* The sidecar index is reused */
+	assert((m = mxml_open_file(snappath)) != NULL);
+	assert_streq(mxml_get(m, "top.d"), "2");
+	assert(!mxml_exists(m, "top.e"));
+	mxml_free(m);
+	/* A stale sidecar index is replaced */
+	assert((fd = open(snappath, O_WRONLY | O_TRUNC)) != -1);
+	assert(write(fd, "<top><d>3</d></top>", 19) == 19);
+	close(fd);
+	assert((m = mxml_open_file(snappath)) != NULL);
+	assert_streq(mxml_get(m, "top.d"), "3");
+	assert(!mxml_exists(m, "top.a"));
+	mxml_free(m);
+	/* A corrupt sidecar index is ignored */
+	assert((fd = open(idxpath, O_WRONLY | O_TRUNC)) != -1);
+	assert(write(fd, "junk", 4) == 4);
+	close(fd);
+	assert((m = mxml_open_file(snappath)) != NULL);
+	assert_streq(mxml_get(m, "top.d"), "3");
+	mxml_free(m);
+	unlink(idxpath);
+	unlink(snappath);
+#undef SNAP_XML
+
+	/* A parallel index agrees with scanning, even when chunks
+	 * are split inside CDATA */
+	{
+		size_t biglen = 0;
+		char *big = malloc(2 * 1024 * 1024);
+		char **ikeys;
+		unsigned int nikeys, i;
+		struct mxml *im;
+
+		assert(big);
+		biglen += sprintf(big + biglen, "<?xml?><top>");
+		for (i = 0; biglen < 2 * 1024 * 1024 - 1024; i++)
+			biglen += sprintf(big + biglen,
+			    "<item%u><a>%u</a>"
+			    "<c><![CDATA[<d></e> <f></g>]]></c></item%u>\n",
+			    i, i, i);
+		biglen += sprintf(big + biglen, "</top>");
+		m = mxml_new(big, biglen);
+		im = mxml_new(big, biglen);
+		assert0(mxml_build_index(im, 4));
+		assert((keys = mxml_keys(m, &nkeys)) != NULL);
+		assert((ikeys = mxml_keys(im, &nikeys)) != NULL);
+		assert_inteq(nikeys, nkeys, "u");
+		for (i = 0; i < nkeys; i++)
+			assert_streq(ikeys[i], keys[i]);
+		mxml_free_keys(keys, nkeys);
+		mxml_free_keys(ikeys, nikeys);
+		assert_streq(mxml_get(im, "top.item7.a"), "7");
+		assert_streq(mxml_get(im, "top.item7.c"), "<d></e> <f></g>");
+		assert(!mxml_exists(im, "top.item7.b"));
+		mxml_free(im);
+		mxml_free(m);
+		free(big);
+	}
+
+	/* Journals with many shared key prefixes and values */
+	{
+		char key[64];
+		unsigned int i;
+
+		m = MXML_NEW("<config><ports><total>0</total></ports>"
+			"<portal>x</portal></config>");
+		for (i = 1; i <= 50; i++)
+			assert0(mxml_set(m, "config.port[+].state",
+			    i % 2 ? "on" : "off"));
+		assert0(mxml_delete(m, "config.ports.port3"));
+		assert0(mxml_delete(m, "config.port"));
+		assert_null_errno(mxml_get(m, "config.ports.port3.state"),
+		    ENOENT);
+		assert(!mxml_exists(m, "config.ports.port3"));
+		assert_streq(mxml_get(m, "config.ports.port4.state"), "off");
+		assert_streq(mxml_get(m, "config.portal"), "x");
+		assert_null_errno(mxml_get(m, "config.unknown.key"), ENOENT);
+		assert0(mxml_set(m, "config.ports.port3.state", "on"));
+		assert(mxml_exists(m, "config.ports.port3"));
+		assert_streq(mxml_get(m, "config.ports.port3.state"), "on");
+		for (i = 1; i <= 50; i++) {
+			snprintf(key, sizeof key, "config.ports.port%u.state",
+			    i);
+			assert_streq(mxml_get(m, key),
+			    i % 2 || i == 3 ? "on" : "off");
+		}
+		assert_streq(mxml_get(m, "config.port[#]"), "50");
+		mxml_free(m);
+	}
+
+	/* Leaf key/value pairs can be visited in one pass */
+	m = MXML_NEW("<a>\n"
+		" <b>x &amp; <![CDATA[<y>]]></b>\n"
+		" <c><d>1</d><e></e></c>\n"
+		" <cc>2</cc>\n"
+		" <f>stop</f>\n"
+		"</a>\n");
+	assert0(mxml_set(m, "a.c.d", "new & <1>"));
+	assert0(mxml_set(m, "a.c.g", "two\nlines\\"));
+	assert0(mxml_delete(m, "a.c.e"));
+	buf_clear(&buf);
+	assert_inteq(mxml_foreach_pair(m, "a.c", pair_cb, &buf), 0, "d");
+	assert_streq(buf.data, "a.c.d=new & <1>;a.c.g=two\nlines\\;");
+	buf_clear(&buf);
+	assert_inteq(mxml_foreach_pair(m, NULL, pair_cb, &buf), 7, "d");
+	assert_streq(buf.data, "a.b=x & <y>;a.c.d=new & <1>;"
+		"a.c.g=two\nlines\\;a.cc=2;a.f=stop;");
+	buf_clear(&buf);
+	assert_inteq(mxml_write_pairs(m, "", buf_write, &buf), buf.len, "zu");
+	assert_streq(buf.data, "a.b=x & <y>\na.c.d=new & <1>\n"
+		"a.c.g=two\\nlines\\\\\na.cc=2\na.f=stop\n");
+	mxml_free(m);
+
+	/* Keys can be queried with wildcards */
+	m = MXML_NEW("<a><cats><cat1><name>Tom</name></cat1><cat2><name>"
+		"Kit &amp; co</name><kits><kit1><name>Ng</name></kit1></kits>"
+		"</cat2><total>2</total></cats><dogs><dog1><name>Rex</name>"
+		"</dog1></dogs></a>");
+	buf_clear(&buf);
+	assert0(mxml_query(m, "a.cats.*.name", pair_cb, &buf));
+	assert_streq(buf.data, "a.cats.cat1.name=Tom;a.cats.cat2.name=Kit & co;");
+	buf_clear(&buf);
+	assert0(mxml_query(m, "a.**.name", pair_cb, &buf));
+	assert_streq(buf.data, "a.cats.cat1.name=Tom;a.cats.cat2.name=Kit & co;"
+		"a.cats.cat2.kits.kit1.name=Ng;a.dogs.dog1.name=Rex;");
+	buf_clear(&buf);
+	assert0(mxml_query(m, "**.total", pair_cb, &buf));
+	assert_streq(buf.data, "a.cats.total=2;");
+	buf_clear(&buf);
+	assert0(mxml_query(m, "a.*.*", pair_cb, &buf));
+	assert_streq(buf.data, "a.cats.cat1=;a.cats.cat2=;a.cats.total=2;"
+		"a.dogs.dog1=;");
+	assert_errno(mxml_query(m, "a..b", pair_cb, &buf), EINVAL);
+	assert_errno(mxml_query(m, "a.cat[1]", pair_cb, &buf), EINVAL);
+	/* Edits are seen */
+	assert0(mxml_set(m, "a.cats.cat1.name", "stop"));
+	assert0(mxml_append(m, "a.cat[+].name", "New"));
+	assert0(mxml_set(m, "a.cats.cat2.kits.kit1.name", "Ngaio"));
+	buf_clear(&buf);
+	assert_inteq(mxml_query(m, "a.**.name", pair_cb, &buf), 7, "d");
+	assert_streq(buf.data, "a.cats.cat1.name=stop;");
+	assert0(mxml_set(m, "a.cats.cat1.name", "Tom"));
+	buf_clear(&buf);
+	assert0(mxml_query(m, "a.**.name", pair_cb, &buf));
+	assert_streq(buf.data, "a.cats.cat1.name=Tom;a.cats.cat2.name=Kit & co;"
+		"a.cats.cat2.kits.kit1.name=Ngaio;a.cats.cat3.name=New;"
+		"a.dogs.dog1.name=Rex;");
+	assert0(mxml_move(m, "a.dogs", "a.cats.cat3.dogs"));
+	buf_clear(&buf);
+	assert0(mxml_query(m, "a.cats.cat3.**.name", pair_cb, &buf));
+	assert_streq(buf.data, "a.cats.cat3.name=New;"
+		"a.cats.cat3.dogs.dog1.name=Rex;");
+	mxml_free(m);
+
+	/* Typed values are parsed in place */
+	m = MXML_NEW("<a><n> 42 </n><big>4294967296</big><neg>-17</neg>"
+		"<min>-9223372036854775808</min><over>9223372036854775808</over>"
+		"<t>Yes</t><f>off</f><e>&#52;2</e><mode>rw</mode><x>4x</x>"
+		"<cats><total>3</total></cats></a>");
+	{
+		static const char *const modes[] = { "ro", "rw", NULL };
+		unsigned int u;
+		int64_t i64;
+		int b;
+
+		assert0(mxml_get_uint(m, "a.n", &u));
+		assert_inteq(u, 42, "u");
+		assert0(mxml_get_uint(m, "a.e", &u));
+		assert_inteq(u, 42, "u");
+		assert0(mxml_get_uint(m, "a.cat[#]", &u));
+		assert_inteq(u, 3, "u");
+		assert0(mxml_get_uint(m, "a.dog[#]", &u));
+		assert_inteq(u, 0, "u");
+		assert_errno(mxml_get_uint(m, "a.big", &u), ERANGE);
+		assert_errno(mxml_get_uint(m, "a.neg", &u), EINVAL);
+		assert_errno(mxml_get_uint(m, "a.x", &u), EINVAL);
+		assert_errno(mxml_get_uint(m, "a.none", &u), ENOENT);
+		assert0(mxml_get_int64(m, "a.big", &i64));
+		assert(i64 == 4294967296LL);
+		assert0(mxml_get_int64(m, "a.neg", &i64));
+		assert(i64 == -17);
+		assert0(mxml_get_int64(m, "a.min", &i64));
+		assert(i64 == INT64_MIN);
+		assert_errno(mxml_get_int64(m, "a.over", &i64), ERANGE);
+		assert0(mxml_get_bool(m, "a.t", &b));
+		assert_inteq(b, 1, "d");
+		assert0(mxml_get_bool(m, "a.f", &b));
+		assert_inteq(b, 0, "d");
+		assert_errno(mxml_get_bool(m, "a.n", &b), EINVAL);
+		assert_inteq(mxml_get_enum(m, "a.mode", modes), 1, "d");
+		assert_errno(mxml_get_enum(m, "a.x", modes), EINVAL);
+		/* Edits are seen */
+		assert0(mxml_set(m, "a.mode", "ro"));
+		assert_inteq(mxml_get_enum(m, "a.mode", modes), 0, "d");
+		assert0(mxml_set(m, "a.n", "7"));
+		assert0(mxml_get_uint(m, "a.n", &u));
+		assert_inteq(u, 7, "u");
+	}
+	mxml_free(m);
+
+	/* Values can be lent to the journal without copying */
+	{
+		char *v = strdup("bigtail");
+
+		m = MXML_NEW("<a><x>1</x></a>");
+		/* Only the first len bytes are the value */
+		assert0(mxml_set_nocopy(m, "a.x", v, 7, count_free));
+		assert0(mxml_set_nocopy(m, "a.y", v, 3, count_free));
+		assert0(mxml_set_nocopy(m, "a.z", "lit", 3, NULL));
+		assert_streq(mxml_get(m, "a.x"), "bigtail");
+		assert_streq(mxml_get(m, "a.y"), "big");
+		assert_streq(mxml_get(m, "a.z"), "lit");
+		buf_clear(&buf);
+		mxml_write(m, buf_write, &buf);
+		assert_streq(buf.data, "<a><x>bigtail</x><y>big</y><z>lit</z></a>");
+		/* A value that is not taken stays with the caller */
+		assert_errno(mxml_set_nocopy(m, "a..b", v, 3, count_free),
+		    EINVAL);
+		/* The shared value is freed once, with the journal */
+		assert_inteq(nfrees, 0, "u");
+		mxml_free(m);
+		assert_inteq(nfrees, 1, "u");
+	}
+
+	/* Edits call subscriptions at, above and below their keys */
+	{
+		struct mxml_subscription *sa, *sb;
+
+		m = MXML_NEW("<a><net><p1><baud>1</baud></p1></net>"
+			"<x>1</x></a>");
+		assert_inteq(mxml_is_dirty(m, ""), 0, "d");
+		assert((sa = mxml_subscribe(m, "a.net", note_cb, &buf)) != NULL);
+		assert((sb = mxml_subscribe(m, "a.net.p1.baud", note_cb,
+		    &buf)) != NULL);
+		assert(mxml_subscribe(m, "a.u[#]", note_cb, &buf));
+		assert(mxml_subscribe(m, "a.dst", note_cb, &buf));
+		assert_inteq(mxml_is_dirty(m, "a"), 0, "d");
+		buf_clear(&buf);
+		assert0(mxml_set(m, "a.x", "2"));
+		assert_streq(buf.data, "");
+		assert_inteq(mxml_is_dirty(m, "a.x"), 1, "d");
+		assert_inteq(mxml_is_dirty(m, "a"), 1, "d");
+		assert_inteq(mxml_is_dirty(m, "a.net"), 0, "d");
+		assert0(mxml_set(m, "a.net.p1.baud", "2"));
+		assert_streq(buf.data, "a.net.p1.baud;a.net.p1.baud;");
+		/* Implied parents are reported */
+		buf_clear(&buf);
+		assert0(mxml_set(m, "a.net.p2.baud", "3"));
+		assert_streq(buf.data, "a.net.p2;a.net.p2.baud;");
+		/* Edits of parents are reported below */
+		buf_clear(&buf);
+		assert0(mxml_delete(m, "a.net"));
+		assert_streq(buf.data, "a.net;a.net;");
+		assert_inteq(mxml_is_dirty(m, "a.net.p1.baud"), 1, "d");
+		assert_inteq(mxml_is_dirty(m, "a.q"), 0, "d");
+		mxml_unsubscribe(m, sb);
+		buf_clear(&buf);
+		assert0(mxml_delete_matching(m, "a.net.*.baud"));
+		assert_streq(buf.data, "a.net.*.baud;");
+		/* List totals are reported */
+		buf_clear(&buf);
+		assert0(mxml_set(m, "a.u[+]", "v"));
+		assert_streq(buf.data, "a.us.total;");
+		/* Moves are reported at their destination */
+		buf_clear(&buf);
+		assert0(mxml_move(m, "a.x", "a.dst.x"));
+		assert_streq(buf.data, "a.dst;a.dst.x;");
+		mxml_unsubscribe(m, sa);
+		buf_clear(&buf);
+		assert0(mxml_set(m, "a.net", "z"));
+		assert_streq(buf.data, "");
+		mxml_free(m);
+
+		/* Patterns without a literal prefix dirty every key */
+		m = MXML_NEW("<a><cats><total>1</total></cats></a>");
+		assert(mxml_subscribe(m, "a.cats.total", note_cb, &buf) != NULL);
+		buf_clear(&buf);
+		assert0(mxml_delete_matching(m, "**.total"));
+		assert_streq(buf.data, "**.total;");
+		assert(!mxml_exists(m, "a.cats.total"));
+		assert_inteq(mxml_is_dirty(m, "a.cats.total"), 1, "d");
+		assert_inteq(mxml_is_dirty(m, "a.cats"), 1, "d");
+		mxml_free(m);
+	}
+
+	/* Elements can be deleted by pattern */
+	m = MXML_NEW("<a><us><u1><off>1</off><n>x</n></u1><u2><n>y</n></u2>"
+		"<u3><off>1</off></u3><total>3</total></us><b><off>0</off>"
+		"</b><c>keep</c></a>");
+	assert0(mxml_set(m, "a.u[2].off", "1"));
+	assert0(mxml_delete_matching(m, "a.us.*.off"));
+	assert(!mxml_exists(m, "a.us.u1.off"));
+	assert(!mxml_exists(m, "a.us.u2.off"));
+	assert_streq(mxml_get(m, "a.us.u1.n"), "x");
+	assert_streq(mxml_get(m, "a.b.off"), "0");
+	assert0(mxml_set(m, "a.us.u3.off", "2"));
+	assert_streq(mxml_get(m, "a.us.u3.off"), "2");
+	assert0(mxml_delete_matching(m, "**.b"));
+	assert(!mxml_exists(m, "a.b.off"));
+	assert_errno(mxml_delete_matching(m, "a..b"), EINVAL);
+	assert_errno(mxml_delete_matching(m, "a.u[1]"), EINVAL);
+	buf_clear(&buf);
+	mxml_write(m, buf_write, &buf);
+	assert_streq(buf.data, "<a><us><u1><n>x</n></u1><u2><n>y</n></u2>"
+		"<u3><off>2</off></u3><total>3</total></us><c>keep</c></a>");
+	buf_clear(&buf);
+	assert_inteq(mxml_write_parallel(m, 2, buf_write, &buf), buf.len, "zu");
+	assert_streq(buf.data, "<a><us><u1><n>x</n></u1><u2><n>y</n></u2>"
+		"<u3><off>2</off></u3><total>3</total></us><c>keep</c></a>");
+	assert_inteq(mxml_count_children(m, "a"), 2, "d");
+	assert_null_errno(mxml_find_node(m, "a.us"), EBUSY);
+	mxml_free(m);
+
+	/* Children can be counted and visited in ranges */
+	{
+		unsigned int j;
+
+		for (j = 0; j < 2; j++) {
+			m = MXML_NEW("<a><us><u1><n>x</n></u1><u2></u2><u3>"
+				"<n>z</n></u3><total>3</total></us><b>t</b></a>");
+			if (j)
+				assert0(mxml_build_index(m, 1));
+			assert_inteq(mxml_count_children(m, "a"), 2, "d");
+			assert_inteq(mxml_count_children(m, "a.us"), 4, "d");
+			assert_inteq(mxml_count_children(m, "a.b"), 0, "d");
+			assert_errno(mxml_count_children(m, "a.c"), ENOENT);
+			buf_clear(&buf);
+			assert0(mxml_children(m, "a.us", 0, 2, child_cb, &buf));
+			assert_streq(buf.data, "a.us.u1;a.us.u2;");
+			buf_clear(&buf);
+			assert_inteq(mxml_children(m, "a.us", 1, 3, child_cb, &buf),
+			    7, "d");
+			assert_streq(buf.data, "a.us.u2;a.us.u3;");
+			buf_clear(&buf);
+			assert0(mxml_children(m, "a.us", 3, 10, child_cb, &buf));
+			assert_streq(buf.data, "a.us.total;");
+			buf_clear(&buf);
+			assert0(mxml_children(m, "a.us", 4, 10, child_cb, &buf));
+			assert_streq(buf.data, "");
+			/* Edits under the children leave them as they were */
+			assert0(mxml_set(m, "a.us.u1.n", "y"));
+			assert_inteq(mxml_count_children(m, "a.us"), 4, "d");
+			/* Edits of the children are counted */
+			assert0(mxml_set(m, "a.u[+]", "w"));
+			assert0(mxml_delete(m, "a.us.u1"));
+			assert_inteq(mxml_count_children(m, "a.us"), 4, "d");
+			buf_clear(&buf);
+			assert0(mxml_children(m, "a.us", 2, 2, child_cb, &buf));
+			assert_streq(buf.data, "a.us.total;a.us.u4;");
+			buf_clear(&buf);
+			assert_inteq(mxml_children(m, "a.us", 0, 10, child_cb, &buf),
+			    7, "d");
+			assert_streq(buf.data, "a.us.u2;a.us.u3;");
+			/* Edits of the parents */
+			assert0(mxml_replace_subtree(m, "a.us", "<v></v>", 7));
+			assert_inteq(mxml_count_children(m, "a.us"), 1, "d");
+			mxml_free(m);
+		}
+	}
+
+	/* A batch of sets has the same effect as setting each in turn */
+	{
+		static const struct mxml_pair pairs[] = {
+			{ "cfg.name", "box" },
+			{ "cfg.net.ip", "10.0.0.1" },
+			{ "cfg.net.mask", "255.0.0.0" },
+			{ "cfg.name", "router" },
+			{ "cfg.port[+].speed", "1000" },
+			{ "cfg.port[$].duplex", "full" },
+			{ "cfg.net.gw.ip", "10.0.0.254" },
+			{ "cfg.old", NULL },
+			{ "cfg.port[1].speed", "10" },
+			{ "cfg.port[#]", "9" },
+			{ "cfg.never", "x" },
+		};
+		struct mxml *bm;
+		struct buf bbuf;
+		unsigned int i;
+
+#define BATCH_XML "<cfg><name>x</name><old>1</old>" \
+		  "<ports><port1><speed>1</speed></port1>" \
+		  "<total>1</total></ports></cfg>"
+		m = MXML_NEW(BATCH_XML);
+		for (i = 0; i < sizeof pairs / sizeof pairs[0]; i++)
+			if (mxml_set(m, pairs[i].key, pairs[i].value) == -1)
+				break; /* at cfg.port[#] */
+		bm = MXML_NEW(BATCH_XML);
+		assert_errno(mxml_apply_batch(bm, pairs,
+		    sizeof pairs / sizeof pairs[0]), EPERM);
+		buf_init(&bbuf);
+		buf_clear(&buf);
+		mxml_write(m, buf_write, &buf);
+		mxml_write(bm, buf_write, &bbuf);
+		assert_streq(bbuf.data, buf.data);
+		assert_streq(mxml_get(bm, "cfg.name"), "router");
+		assert_streq(mxml_get(bm, "cfg.port[2].duplex"), "full");
+		assert(!mxml_exists(bm, "cfg.old"));
+		mxml_free(bm);
+
+		/* [+] and [$] count the items added earlier in a batch */
+		{
+			static const struct mxml_pair adds[] = {
+				{ "cfg.port[+].speed", "1" },
+				{ "cfg.port[$].duplex", "half" },
+				{ "cfg.name", "r" },
+				{ "cfg.port[+].speed", "2" },
+				{ "cfg.vlan[+].id", "3" },
+				{ "cfg.vlan[$].port[+].id", "4" },
+				{ "cfg.port[$].speed", "5" },
+			};
+			struct mxml *sm = MXML_NEW(BATCH_XML);
+
+			bm = MXML_NEW(BATCH_XML);
+			for (i = 0; i < sizeof adds / sizeof adds[0]; i++)
+				assert0(mxml_set(sm, adds[i].key, adds[i].value));
+			assert0(mxml_apply_batch(bm, adds,
+			    sizeof adds / sizeof adds[0]));
+			buf_clear(&buf);
+			buf_clear(&bbuf);
+			mxml_write(sm, buf_write, &buf);
+			mxml_write(bm, buf_write, &bbuf);
+			assert_streq(bbuf.data, buf.data);
+			assert_streq(mxml_get(bm, "cfg.port[3].speed"), "5");
+			assert_streq(mxml_get(bm, "cfg.vlan[1].port[1].id"),
+			    "4");
+			mxml_free(sm);
+			mxml_free(bm);
+		}
+
+		/* Pairs survive being written and loaded */
+		buf_clear(&buf);
+		mxml_write_pairs(m, NULL, buf_write, &buf);
+		bm = MXML_NEW("<cfg></cfg>");
+		assert0(mxml_load_pairs(bm, "# comment\n\ncfg.v=a\\\\b\\nc\n",
+		    strlen("# comment\n\ncfg.v=a\\\\b\\nc\n")));
+		assert_streq(mxml_get(bm, "cfg.v"), "a\\b\nc");
+		assert0(mxml_load_pairs(bm, buf.data, buf.len));
+		buf_clear(&bbuf);
+		mxml_write_pairs(bm, "cfg.net", buf_write, &bbuf);
+		assert_streq(bbuf.data, "cfg.net.ip=10.0.0.1\n"
+		    "cfg.net.mask=255.0.0.0\ncfg.net.gw.ip=10.0.0.254\n");
+		assert_errno(mxml_load_pairs(bm, "nonsense\n", 9), EINVAL);
+		mxml_free(bm);
+		mxml_free(m);
+		buf_release(&bbuf);
+#undef BATCH_XML
+	}
+
+	/* Large values are escaped without fragmenting the output */
+	{
+		char value[20001];
+		char *expect;
+		unsigned int i;
+		size_t j = 0;
+
+		for (i = 0; i < sizeof value - 1; i++)
+			value[i] = "abc<def>gh&"[i % 11];
+		value[i] = '\0';
+		assert((expect = malloc(sizeof value * 5 + 32)) != NULL);
+		j += sprintf(expect, "<top><v>");
+		for (i = 0; value[i]; i++)
+			j += sprintf(expect + j, "%s",
+			    value[i] == '<' ? "&lt;" :
+			    value[i] == '>' ? "&gt;" :
+			    value[i] == '&' ? "&amp;" : (char[]){value[i], 0});
+		j += sprintf(expect + j, "</v><w>plain</w></top>");
+
+		m = MXML_NEW("<top><v>x</v></top>");
+		assert0(mxml_set(m, "top.v", value));
+		assert0(mxml_set(m, "top.w", "plain"));
+		buf_clear(&buf);
+		nwrites = 0;
+		assert_inteq(mxml_write(m, count_write, &buf), j, "zu");
+		assert_streq(buf.data, expect);
+		assert(nwrites < 30);
+		mxml_free(m);
+		free(expect);
+	}
+
+	/* Parallel writing gives the same output as serial writing */
+	{
+		struct buf pbuf;
+		size_t biglen = 0;
+		char big[8192];
+		unsigned int i;
+
+		biglen += sprintf(big + biglen, "<?xml?>\n<top>\n");
+		for (i = 0; i < 40; i++)
+			biglen += sprintf(big + biglen,
+			    " <item%u><a>%u</a></item%u>\n", i, i, i);
+		biglen += sprintf(big + biglen, " <dup>x</dup>\n"
+		    " <cats><total>1</total><cat1><name>Tom</name></cat1>"
+		    "</cats>\n <dup>y</dup>\n</top>\n");
+
+		buf_init(&pbuf);
+		assert((m = mxml_new(big, biglen)) != NULL);
+		assert0(mxml_set(m, "top.item3.a", "three & <3>"));
+		assert0(mxml_set(m, "top.item30.b", "new"));
+		assert0(mxml_delete(m, "top.item20"));
+		assert0(mxml_set(m, "top.dup", "z"));
+		assert0(mxml_append(m, "top.item39.c", "tail"));
+		assert0(mxml_set(m, "top.cats.cat[+].name", "Jerry"));
+		assert0(mxml_list_remove(m, "top.cats.cat", 1));
+		assert0(mxml_replace_subtree(m, "top.item7", "<r>7</r>", 8));
+		assert0(mxml_set(m, "top.fresh", "1"));
+		buf_clear(&buf);
+		assert_inteq(mxml_write(m, buf_write, &buf), buf.len, "zu");
+		for (i = 0; i <= 8; i++) {
+			buf_clear(&pbuf);
+			assert_inteq(mxml_write_parallel(m, i, buf_write, &pbuf),
+			    pbuf.len, "zu");
+			assert_streq(pbuf.data, buf.data);
+		}
+		/* Moves and edits outside the root's children
+		 * fall back to serial */
+		assert0(mxml_move(m, "top.item5", "top.item39.moved"));
+		buf_clear(&buf);
+		mxml_write(m, buf_write, &buf);
+		buf_clear(&pbuf);
+		mxml_write_parallel(m, 4, buf_write, &pbuf);
+		assert_streq(pbuf.data, buf.data);
+		assert0(mxml_set(m, "top", "gone"));
+		buf_clear(&buf);
+		mxml_write(m, buf_write, &buf);
+		buf_clear(&pbuf);
+		mxml_write_parallel(m, 4, buf_write, &pbuf);
+		assert_streq(pbuf.data, buf.data);
+		mxml_free(m);
+		buf_release(&pbuf);
+	}
+
+	buf_release(&buf);
 }